@@ -20,9 +20,73 @@
 #define __NORI_BVH_H
 
 #include <nori/mesh.h>
+#include <nori/mappedfile.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
 
 NORI_NAMESPACE_BEGIN
 
+/**
+ * \brief Bundle of up to 16 rays that are traced together
+ *
+ * Packets work best when their rays are coherent, i.e. when they have
+ * similar origins and directions (primary rays of neighboring pixels,
+ * or shadow rays towards the same light source).
+ */
+struct RayPacket {
+    enum {
+        /// Maximum number of rays in a packet
+        MaxSize = 16
+    };
+
+    Ray3f rays[MaxSize];
+    uint32_t size = 0;
+
+    /// Remove all rays from the packet
+    void clear() { size = 0; }
+
+    /// Append a ray (the packet must not be full)
+    void append(const Ray3f &ray) { rays[size++] = ray; }
+
+    /// Is there room for another ray?
+    bool isFull() const { return size == MaxSize; }
+};
+
+/**
+ * \brief Minimal record of the closest hit found by a traversal
+ *
+ * This is all the traversal itself keeps track of. The position, the
+ * frames and the texture coordinates of the hit are only computed on
+ * demand by \ref Accel::computeIntersection().
+ */
+struct HitRecord {
+    enum {
+        /// Value of \ref instance for hits of regular meshes
+        NoInstance = 0xFFFFFFFFu,
+        /// Value of \ref instance for hits of moving meshes
+        Moving = 0xFFFFFFFEu,
+        /// Flag of \ref instance for hits of lazy meshes, the other bits index the mesh
+        Lazy = 0x80000000u
+    };
+
+    /// Distance along the ray
+    float t = std::numeric_limits<float>::infinity();
+    /// Barycentric coordinates of the hit
+    float u = 0, v = 0;
+    /// Position of the triangle in the triangle store
+    uint32_t prim = 0;
+    /// Index of the instance that was hit (or \ref NoInstance / \ref Moving / \ref Lazy)
+    uint32_t instance = NoInstance;
+    /// Time of the ray
+    float time = 0;
+    /// Number of BVH nodes visited by the traversal
+    uint32_t nodeVisits = 0;
+    /// Number of ray-triangle tests performed by the traversal
+    uint32_t triangleTests = 0;
+};
+
 /**
  * \brief Bounding Volume Hierarchy for fast ray intersection queries
  *
@@ -41,8 +105,49 @@ NORI_NAMESPACE_BEGIN
  * \author Wenzel Jakob
  */
 class Accel {
-    friend class BVHBuildTask;
+    friend class BVHBuilder;
+    friend class LBVHBuilder;
+    friend class SBVHBuilder;
+    template <int N> friend class WideBVHBuilder;
+    template <int N> friend class QuantizedWideBVHBuilder;
+    template <int N> friend struct WideBVHTraversal;
+    friend struct PacketTraversal;
+    friend class MotionBVHBuilder;
 public:
+    /**
+     * \brief Node layouts supported by the traversal code
+     *
+     * The SAH build always produces a binary tree. The wide layouts are
+     * obtained by collapsing it, so that a single traversal step tests
+     * the boxes of up to 4 or 8 children at once using SIMD instructions.
+     */
+    enum ELayout {
+        /// Binary tree, one box test per traversal step
+        EBinary = 2,
+        /// 4-wide tree with SSE slab tests
+        EWide4 = 4,
+        /// 8-wide tree with AVX slab tests (SSE when compiled without AVX)
+        EWide8 = 8
+    };
+
+    /**
+     * \brief Construction algorithms
+     *
+     * The Morton code based builders run in (nearly) linear time but
+     * produce trees of lower quality, which is useful when the time to
+     * the first pixel matters more than the rendering time.
+     */
+    enum EBuildMethod {
+        /// Top-down binned SAH build (best quality)
+        ESAH = 0,
+        /// Linear BVH: Morton order, split at the highest differing bit
+        ELBVH,
+        /// Hierarchical LBVH: SAH over clusters of Morton order, LBVH within
+        EHLBVH,
+        /// SAH build that also considers spatial splits (duplicates references)
+        ESBVH
+    };
+
     /// Create a new and empty BVH
     Accel() { m_meshOffset.push_back(0u); }
 
@@ -55,13 +160,114 @@ public:
     /**
      * \brief Register a triangle mesh for inclusion in the BVH.
      *
+     * Moving meshes (see \ref Mesh::isMoving()) are kept out of the
+     * regular BVH and get a motion BVH instead, whose boxes follow the
+     * triangles over time (see \ref MotionBVHNode). Lazy meshes (see
+     * \ref Mesh::isLazy()) are only placed by their bounding box, and
+     * receive a bottom-level BVH when a ray first enters it.
+     *
      * This function can only be used before \ref build() is called
      */
     void addMesh(Mesh *mesh);
 
+    /**
+     * \brief Register a shared mesh (see \ref Mesh::getId()), which
+     * receives its own bottom-level BVH and is only rendered through
+     * \ref addInstance()
+     *
+     * This function can only be used before \ref build() is called
+     */
+    void addSharedMesh(Mesh *mesh);
+
+    /**
+     * \brief Place a copy of the shared mesh with the given \c id
+     *
+     * Rays are transformed into the object space of the copy during
+     * traversal, so the copies share the geometry and the bottom-level
+     * BVH of the mesh. A top-level BVH over the copies is built next
+     * to the BVH of the regular meshes.
+     *
+     * This function can only be used before \ref build() is called
+     */
+    void addInstance(const std::string &id, const Transform &toWorld);
+
     /// Build the BVH
     void build();
 
+    /**
+     * \brief Choose the node layout used for traversal
+     *
+     * This function can only be used before \ref build() is called
+     */
+    void setLayout(ELayout layout) { m_layout = layout; }
+
+    /// Return the node layout used for traversal
+    ELayout getLayout() const { return m_layout; }
+
+    /**
+     * \brief Store the child boxes of the wide layouts as 8-bit offsets
+     * relative to the box of their parent (see \ref QuantizedWideBVHNode)
+     *
+     * This halves the size of the nodes at the cost of decoding the boxes
+     * during traversal. Has no effect on the binary layout.
+     *
+     * This function can only be used before \ref build() is called
+     */
+    void setCompressed(bool compressed) { m_compressed = compressed; }
+
+    /// Are the child boxes of the wide layouts quantized?
+    bool isCompressed() const { return m_compressed; }
+
+    /**
+     * \brief Use the watertight ray-triangle test instead of Moeller-Trumbore
+     *
+     * Rays never slip through the shared edges of adjacent triangles,
+     * and hits are only reported if their distance is larger than its
+     * floating point error bound. This costs some performance.
+     */
+    void setWatertight(bool watertight) { m_watertight = watertight; }
+
+    /// Is the watertight ray-triangle test used?
+    bool isWatertight() const { return m_watertight; }
+
+    /**
+     * \brief Choose the construction algorithm
+     *
+     * This function can only be used before \ref build() is called
+     */
+    void setBuildMethod(EBuildMethod method) { m_buildMethod = method; }
+
+    /// Return the construction algorithm
+    EBuildMethod getBuildMethod() const { return m_buildMethod; }
+
+    /**
+     * \brief Store built trees in the given directory and reuse them
+     *
+     * The cache files are named after a hash of the triangle data and
+     * of the build settings, so changing either one leads to a rebuild.
+     * An empty string (the default) disables the cache.
+     *
+     * This function can only be used before \ref build() is called
+     */
+    void setCacheDirectory(const std::string &path) { m_cacheDirectory = path; }
+
+    /// Return the directory of the BVH cache (empty if disabled)
+    const std::string &getCacheDirectory() const { return m_cacheDirectory; }
+
+    /**
+     * \brief Limit the memory used by the geometry of lazy meshes
+     *
+     * When loading a lazy mesh exceeds the budget, the least recently
+     * used ones that no ray currently traverses are released again
+     * (vertex data and bottom-level BVH). A mesh that is needed is
+     * always loaded, even if the budget is too small for it. Zero
+     * (the default) means no limit.
+     */
+    void setMemoryBudget(size_t bytes) { m_memoryBudget = bytes; }
+
+    /// Return the memory budget of the lazy meshes (0 if unlimited)
+    size_t getMemoryBudget() const { return m_memoryBudget; }
+
     /**
      * \brief Intersect a ray against all triangle meshes registered
      * with the BVH
@@ -75,14 +281,90 @@ public:
      * providing any more detail (i.e. \c its will not be filled with
      * contents). This is usually much faster.
      *
+     * This is a shorthand for \ref rayIntersect(const Ray3f &, HitRecord &)
+     * followed by \ref computeIntersection(), or for \ref occluded().
+     *
      * \return \c true If an intersection was found
      */
     bool rayIntersect(const Ray3f &ray, Intersection &its, 
         bool shadowRay = false) const;
 
+    /**
+     * \brief Find the closest intersection of a ray, but only record
+     * the triangle and the distance
+     *
+     * \ref computeIntersection() turns the record into a full
+     * \ref Intersection, should the details be needed.
+     *
+     * \return \c true If an intersection was found
+     */
+    bool rayIntersect(const Ray3f &ray, HitRecord &hit) const;
+
+    /**
+     * \brief Check whether a ray hits anything at all
+     *
+     * The traversal stops at the first hit and never computes any
+     * surface details (used for shadow rays).
+     */
+    bool occluded(const Ray3f &ray) const;
+
+    /// Compute the position, frames and texture coordinates of a hit
+    void computeIntersection(const HitRecord &hit, Intersection &its) const;
+
+    /**
+     * \brief Intersect a packet of rays against all triangle meshes
+     * registered with the BVH
+     *
+     * The rays are traversed together through the binary tree, testing
+     * the node boxes and triangles against several rays at once using
+     * SIMD instructions. Rays that miss a node are masked out until the
+     * traversal leaves the node again.
+     *
+     * \param its
+     *    Array of <tt>packet.size</tt> intersection records. Entries of
+     *    rays that hit something are filled in, unless \c shadowRay is set.
+     *
+     * \param shadowRay
+     *    When set to \c true, only determine occlusion. Rays stop
+     *    participating as soon as they are occluded, and the entire
+     *    packet terminates once all of its rays are.
+     *
+     * \return A bit mask of the rays that found an intersection
+     */
+    uint32_t rayIntersect(const RayPacket &packet, Intersection *its,
+        bool shadowRay = false) const;
+
+    /**
+     * \brief Intersect a stream of (possibly incoherent) rays
+     *
+     * The rays are grouped by the octant of their direction and then
+     * traced as packets of \ref RayPacket::MaxSize consecutive rays
+     * of the same octant. This works well for batches that are
+     * coherent in order but mixed in direction, e.g. diffuse bounces
+     * or NEE shadow rays of a whole image block.
+     *
+     * \param its
+     *    Array of \c count intersection records (see above). May be
+     *    \c nullptr when \c shadowRay is set.
+     *
+     * \param hit
+     *    Array of \c count flags that record which rays found an intersection
+     */
+    void rayIntersect(const Ray3f *rays, uint32_t count, Intersection *its,
+        bool *hit, bool shadowRay = false) const;
+
     /// Return the total number of meshes registered with the BVH
     uint32_t getMeshCount() const { return (uint32_t) m_meshes.size(); }
 
+    /// Return the total number of moving meshes
+    uint32_t getMovingMeshCount() const { return (uint32_t) m_movingMeshes.size(); }
+
+    /// Return the total number of instances of shared meshes
+    uint32_t getInstanceCount() const { return (uint32_t) m_instances.size(); }
+
+    /// Return the total number of lazy meshes
+    uint32_t getLazyMeshCount() const { return (uint32_t) m_lazyMeshes.size(); }
+
     /// Return the total number of internally represented triangles 
     uint32_t getTriangleCount() const { return m_meshOffset.back(); }
 
@@ -98,31 +380,247 @@ public:
     }
 
 protected:
-    /**
-     * \brief Compute the mesh and triangle indices corresponding to 
-     * a primitive index used by the underlying generic BVH implementation. 
-     */
-    uint32_t findMesh(uint32_t &idx) const {
-        auto it = std::lower_bound(m_meshOffset.begin(), m_meshOffset.end(), idx+1) - 1;
-        idx -= *it;
-        return (uint32_t) (it - m_meshOffset.begin());
-    }
+    /// Reference to one triangle of one of the registered meshes
+    struct PrimitiveRef {
+        uint32_t mesh;   ///< Index into \ref m_meshes
+        uint32_t index;  ///< Triangle index within that mesh
+    };
 
     //// Return an axis-aligned bounding box containing the given triangle
     BoundingBox3f getBoundingBox(uint32_t index) const {
-        uint32_t meshIdx = findMesh(index);
-        return m_meshes[meshIdx]->getBoundingBox(index);
+        const PrimitiveRef &prim = m_primitives[index];
+        return m_meshes[prim.mesh]->getBoundingBox(prim.index);
     }
     
     //// Return the centroid of the given triangle
     Point3f getCentroid(uint32_t index) const {
-        uint32_t meshIdx = findMesh(index);
-        return m_meshes[meshIdx]->getCentroid(index);
+        const PrimitiveRef &prim = m_primitives[index];
+        return m_meshes[prim.mesh]->getCentroid(prim.index);
     }
 
+    /// Copy of a shared mesh, i.e. a bottom-level BVH and its placement
+    struct InstanceRef {
+        const Accel *accel;  ///< Bottom-level BVH over the shared mesh
+        Transform toObject;  ///< World-to-object transformation
+        BoundingBox3f bbox;  ///< World space bounding box
+    };
+
+    struct BVHNode;
+
+    /**
+     * \brief Lazy mesh with the bottom-level BVH of its geometry, if loaded
+     *
+     * A traversal pins the geometry by incrementing \c users before it
+     * reads \c accel, and eviction only takes place if \c users is still
+     * zero after \c accel was cleared (see \ref acquireLazy()).
+     */
+    struct LazyMeshRef {
+        Mesh *mesh;                             ///< The mesh (geometry only loaded while resident)
+        BoundingBox3f bbox;                     ///< Bounding box determined while parsing
+        std::atomic<Accel *> accel { nullptr }; ///< Bottom-level BVH (\c nullptr if not resident)
+        std::atomic<uint32_t> users { 0 };      ///< Number of traversals currently using the geometry
+        std::atomic<uint64_t> lastUse { 0 };    ///< Value of \ref m_lazyEpoch at the last access
+        size_t memory = 0;                      ///< Memory of the geometry and the BVH while resident
+    };
+
+    /// Build the BVH over the triangles of the regular meshes
+    void buildGeometry();
+
+    /**
+     * \brief Build a top-level BVH whose leaves reference a single box each
+     *
+     * On return, leaf \c start values index \c order, which holds the
+     * indices of the boxes in the order of the tree.
+     */
+    void buildTopLevel(const std::vector<BoundingBox3f> &boxes, std::vector<BVHNode> &nodes,
+                       std::vector<uint32_t> &order) const;
+
+    /// Build the top-level BVH over the instances of shared meshes
+    void buildInstances();
+
+    /// Build the top-level BVH over the boxes of the lazy meshes
+    void buildLazy();
+
+    /// Build the motion BVHs over the triangles of the moving meshes
+    void buildMotion();
+
+    /// Hash the triangle data and the build settings to identify a cache file
+    uint64_t cacheKey() const;
+
+    /**
+     * \brief Try to load the tree from a cache file
+     *
+     * The file stays mapped, and the traversal reads its sections in place.
+     *
+     * \return \c false if the file does not exist or does not match
+     */
+    bool loadCache(const std::string &filename, uint64_t key);
+
+    /// Write the tree to a cache file (\c buildTime is reported when it is loaded)
+    void writeCache(const std::string &filename, uint64_t key, double buildTime) const;
+
+    /// Point the traversal at the vectors of the tree that was just built
+    void setTraversalData();
+
     /// Compute internal tree statistics
     std::pair<float, uint32_t> statistics(uint32_t index = 0) const;
 
+    /**
+     * \brief Build the binary tree with one of the Morton code based
+     * methods. \c endPhase is invoked at the end of every build phase.
+     */
+    void buildMorton(const std::function<void(const char *)> &endPhase);
+
+    /// Build the binary tree with spatial splits (SBVH), see \ref ESBVH
+    void buildSpatial();
+
+    /// Collapse the binary tree into the wide layout selected by \ref setLayout()
+    void buildWide();
+
+    /// Traverse the regular meshes and the instances (\c ray uses the adaptive epsilon)
+    bool traverse(Ray3f &ray, HitRecord &hit, bool shadowRay) const;
+
+    /// Traverse the binary or wide tree, depending on the layout (see below)
+    bool rayIntersectBVH(Ray3f &ray, HitRecord &hit, bool shadowRay) const {
+        return m_layout == EBinary
+            ? rayIntersectBinary(ray, hit, shadowRay)
+            : rayIntersectWide(ray, hit, shadowRay);
+    }
+
+    /**
+     * \brief Traverse the top-level BVH (\c ray.maxt shrinks as hits are found)
+     *
+     * On a hit, \c hit.instance receives the index of the instance in
+     * \ref m_instances and \c hit.prim the triangle within its bottom-level BVH.
+     */
+    bool rayIntersectInstances(Ray3f &ray, HitRecord &hit, bool shadowRay) const;
+
+    /**
+     * \brief Traverse the top-level BVH of the lazy meshes, loading the
+     * ones whose box is entered (\c ray.maxt shrinks as hits are found)
+     *
+     * On a hit, \c hit.instance is set to the index of the mesh in
+     * \ref m_lazyMeshes combined with \ref HitRecord::Lazy, and \c hit.prim
+     * receives the index of the triangle within the mesh (which, unlike
+     * the position in the bottom-level BVH, survives reloading it).
+     */
+    bool rayIntersectLazy(Ray3f &ray, HitRecord &hit, bool shadowRay) const;
+
+    /**
+     * \brief Pin the geometry of a lazy mesh and return its bottom-level BVH
+     *
+     * The mesh is loaded if needed, which may evict others to stay
+     * within the memory budget. Every call must be followed by
+     * \ref releaseLazy() once the geometry is no longer accessed.
+     */
+    const Accel *acquireLazy(uint32_t index) const;
+
+    /// Unpin the geometry of a lazy mesh (see \ref acquireLazy())
+    void releaseLazy(uint32_t index) const {
+        m_lazyMeshes[index]->users.fetch_sub(1, std::memory_order_release);
+    }
+
+    /// Load a lazy mesh and evict others if the budget is exceeded
+    Accel *pageIn(uint32_t index) const;
+
+    /// Return the memory used by the nodes and the triangle data
+    size_t getMemoryUsage() const;
+
+    /**
+     * \brief Traverse the motion BVH of the time segment that contains
+     * \c ray.time (\c ray.maxt shrinks as hits are found)
+     *
+     * On a hit, \c hit.instance is set to \ref HitRecord::Moving and
+     * \c hit.prim receives the position of the triangle in \ref m_motionIndices.
+     */
+    bool rayIntersectMotion(Ray3f &ray, HitRecord &hit, bool shadowRay) const;
+
+    /**
+     * \brief Return the index of the time segment that contains \c time
+     * (clamped to [0, 1]), and the relative position within it in \c alpha
+     */
+    uint32_t findMotionSegment(float time, float &alpha) const;
+
+    /// Traverse the binary tree (\c ray.maxt shrinks as hits are found)
+    bool rayIntersectBinary(Ray3f &ray, HitRecord &hit, bool shadowRay) const;
+
+    /// Traverse the wide tree (\c ray.maxt shrinks as hits are found)
+    bool rayIntersectWide(Ray3f &ray, HitRecord &hit, bool shadowRay) const;
+
+    /**
+     * \brief Intersect the ray against the triangles referenced by
+     * <tt>m_indices[start, end)</tt>
+     *
+     * The triangles are read from the precomputed triangle store and
+     * tested several at a time using SIMD instructions. On every hit,
+     * \c ray.maxt and the distance and barycentric coordinates of \c hit
+     * are updated, and the position of the triangle in \c m_indices is
+     * stored in \c hit.prim (see \ref resolveIntersection()).
+     */
+    bool intersectLeaf(uint32_t start, uint32_t end, Ray3f &ray,
+                       HitRecord &hit, bool shadowRay) const;
+
+    /// Watertight version of \ref intersectLeaf() (see \ref setWatertight())
+    bool intersectLeafWatertight(uint32_t start, uint32_t end, Ray3f &ray,
+                                 HitRecord &hit, bool shadowRay) const;
+
+    /**
+     * \brief Copy the vertices of all triangles into the
+     * triangle store, and reorder \ref m_primitives to follow \c m_indices
+     */
+    void buildTriangleStore();
+
+    /**
+     * \brief Return one component of the triangle store
+     *
+     * Components 0-2 hold the first vertex of every triangle, 3-5 the
+     * second and 6-8 the third one. Entry \c i belongs to the triangle
+     * referenced by <tt>m_indices[i]</tt>.
+     */
+    const float *getTriangleData(int component) const {
+        return m_triangleData + component * m_triangleStride;
+    }
+
+    /**
+     * \brief Look up the triangle at position \c f of \c m_indices found
+     * by the traversal and fill in the geometric details of the intersection
+     */
+    void resolveIntersection(Intersection &its, uint32_t f) const {
+        const PrimitiveRef &prim = m_primitiveData[f];
+        its.mesh = m_meshes[prim.mesh];
+        computeGeometry(its, prim.index);
+    }
+
+    /**
+     * \brief Fill in the geometric details of an intersection with
+     * triangle \c f of \c its.mesh (\c its.uv holds the barycentric
+     * coordinates on entry)
+     */
+    void computeGeometry(Intersection &its, uint32_t f) const;
+
+    /**
+     * \brief Version of \ref computeGeometry() that takes the vertex
+     * positions of the triangle, e.g. of a moving mesh at the time of
+     * the hit. The shading normals are interpolated to \c its.time.
+     */
+    void computeGeometry(Intersection &its, uint32_t f, const Point3f &p0,
+                         const Point3f &p1, const Point3f &p2) const;
+
+    /**
+     * \brief Resolve the intersection with the triangle at position \c f
+     * of \ref m_motionIndices, which was hit at \c its.time
+     */
+    void resolveMotionIntersection(Intersection &its, uint32_t f) const;
+
+    /**
+     * \brief Resolve the intersection with triangle \c f of an instance
+     * in object space and transform it into world space
+     */
+    void resolveInstanceIntersection(Intersection &its, uint32_t instance, uint32_t f) const;
+
+    /// Resolve the intersection with triangle \c f of a lazy mesh (loading it again if needed)
+    void resolveLazyIntersection(Intersection &its, uint32_t index, uint32_t f) const;
+
     /* BVH node in 32 bytes */
     struct BVHNode {
         union {
@@ -162,11 +660,136 @@ protected:
             return leaf.start + leaf.size;
         }
     };
+
+    /**
+     * \brief BVH node of a moving mesh
+     *
+     * A motion BVH covers one time segment, in which all vertices move
+     * linearly. \c bbox[0] and \c bbox[1] bound the subtree at the start
+     * and at the end of the segment, and the box at a time in between
+     * is their linear interpolation. This contains the triangles at all
+     * times, while being much tighter than the union of the two boxes.
+     * The tree layout is that of \ref BVHNode, and leaves reference
+     * <tt>m_motionIndices[start, end)</tt>.
+     */
+    struct MotionBVHNode {
+        union {
+            struct {
+                unsigned flag : 1;
+                uint32_t size : 31;
+                uint32_t start;
+            } leaf;
+
+            struct {
+                unsigned flag : 1;
+                uint32_t axis : 31;
+                uint32_t rightChild;
+            } inner;
+
+            uint64_t data;
+        };
+        BoundingBox3f bbox[2];
+
+        bool isLeaf() const {
+            return leaf.flag == 1;
+        }
+
+        bool isInner() const {
+            return leaf.flag == 0;
+        }
+
+        uint32_t start() const {
+            return leaf.start;
+        }
+
+        uint32_t end() const {
+            return leaf.start + leaf.size;
+        }
+    };
+
+    /// Time segment with its own motion BVH
+    struct MotionSegment {
+        float start, end;  ///< Time interval of the segment
+        uint32_t root;     ///< Index of the root node in \ref m_motionNodes
+    };
+
+    /**
+     * \brief Wide BVH node with the boxes of all children stored in
+     * SoA form, i.e. <tt>bounds[2*axis][i]</tt> and <tt>bounds[2*axis+1][i]</tt>
+     * hold the minimum and maximum of child \c i along \c axis.
+     *
+     * Inner children have <tt>count == 0</tt> and reference another wide
+     * node through \c child. Leaf children reference the triangles
+     * <tt>m_indices[child, child+count)</tt>. Unused slots have an empty
+     * (inverted) box, which fails every slab test.
+     */
+    template <int N> struct alignas(32) WideBVHNode {
+        float bounds[6][N];
+        uint32_t child[N];
+        uint32_t count[N];
+    };
+
+    /**
+     * \brief Wide BVH node with quantized child boxes
+     *
+     * Along every axis, the box of child \c i extends from
+     * <tt>origin + qmin[axis][i] * 2^exponent[axis]</tt> to
+     * <tt>origin + qmax[axis][i] * 2^exponent[axis]</tt>, where \c origin
+     * is the minimum of the box of the node. The offsets are rounded
+     * outwards, so that the decoded boxes always contain the exact ones.
+     * \c valid holds the mask of the used slots; \c child and \c count
+     * have the same meaning as in \ref WideBVHNode. The 8-wide node takes
+     * 128 bytes instead of 256.
+     */
+    template <int N> struct alignas(N == 8 ? 64 : 8) QuantizedWideBVHNode {
+        float origin[3];
+        int8_t exponent[3];
+        uint8_t valid;
+        uint8_t qmin[3][N];
+        uint8_t qmax[3][N];
+        uint32_t child[N];
+        uint32_t count[N];
+    };
 private:
     std::vector<Mesh *> m_meshes;       ///< List of meshes registered with the BVH
     std::vector<uint32_t> m_meshOffset; ///< Index of the first triangle for each shape
     std::vector<BVHNode> m_nodes;       ///< BVH nodes
     std::vector<uint32_t> m_indices;    ///< Index references by BVH nodes
+    std::vector<PrimitiveRef> m_primitives; ///< Mesh and triangle of each primitive (in the order of m_indices after the build)
+    std::vector<WideBVHNode<4>> m_nodes4; ///< Collapsed 4-wide nodes (EWide4)
+    std::vector<WideBVHNode<8>> m_nodes8; ///< Collapsed 8-wide nodes (EWide8)
+    std::vector<QuantizedWideBVHNode<4>> m_quantized4; ///< Compressed 4-wide nodes (EWide4)
+    std::vector<QuantizedWideBVHNode<8>> m_quantized8; ///< Compressed 8-wide nodes (EWide8)
+    std::vector<float> m_triangles;     ///< Triangle store (SoA, in the order of m_indices)
+    uint32_t m_triangleStride = 0;      ///< Number of entries per triangle store component
+    /* The traversal reads the tree through these pointers, which refer to
+       the vectors above after a build, or to the sections of the cache file */
+    const BVHNode *m_nodeData = nullptr; ///< Binary nodes (\c nullptr without a tree)
+    const PrimitiveRef *m_primitiveData = nullptr; ///< Mesh and triangle of each primitive
+    const float *m_triangleData = nullptr; ///< Triangle store
+    const void *m_wideNodeData = nullptr; ///< Nodes of the wide layout (of the type given by m_layout and m_compressed)
+    std::unique_ptr<MappedFile> m_cacheFile; ///< Memory-mapped cache file that the tree was loaded from (if any)
+    std::vector<Accel *> m_sharedMeshes; ///< Bottom-level BVHs of the shared meshes (one mesh each)
+    std::vector<InstanceRef> m_instances; ///< Instances of shared meshes (in the order of the top-level BVH after the build)
+    std::vector<BVHNode> m_instanceNodes; ///< Top-level BVH nodes, leaves reference m_instances
+    std::vector<Mesh *> m_movingMeshes; ///< Moving meshes (not part of m_meshes)
+    std::vector<PrimitiveRef> m_motionPrimitives; ///< Triangles of the moving meshes (PrimitiveRef::mesh indexes m_movingMeshes)
+    std::vector<MotionSegment> m_motionSegments; ///< Time segments of the motion BVHs, in order
+    std::vector<MotionBVHNode> m_motionNodes; ///< Nodes of the motion BVHs of all segments
+    std::vector<uint32_t> m_motionIndices; ///< Index references by the motion BVH nodes (into m_motionPrimitives)
+    std::vector<float> m_motionTriangles; ///< Vertices at the start and end of the segment, 18 floats per entry of m_motionIndices
+    std::vector<LazyMeshRef *> m_lazyMeshes; ///< Lazy meshes (in the order of the top-level BVH after the build)
+    std::vector<BVHNode> m_lazyNodes;   ///< Top-level BVH nodes, leaves reference m_lazyMeshes
+    size_t m_memoryBudget = 0;          ///< Memory budget of the lazy meshes (0 if unlimited)
+    mutable std::mutex m_lazyMutex;     ///< Serializes loading and evicting lazy meshes
+    mutable size_t m_lazyMemory = 0;    ///< Memory used by the resident lazy meshes
+    mutable std::atomic<uint64_t> m_lazyEpoch { 0 }; ///< Number of lazy meshes loaded so far (the clock of the LRU eviction)
+    std::string m_cacheDirectory;       ///< Directory of the BVH cache (empty if disabled)
+    ELayout m_layout = EWide4;          ///< Node layout used for traversal
+    EBuildMethod m_buildMethod = ESAH;  ///< Construction algorithm
+    bool m_compressed = false;          ///< Quantize the child boxes of the wide nodes?
+    bool m_watertight = false;          ///< Use the watertight ray-triangle test?
+    bool m_quiet = false;               ///< Don't report the build (bottom-level BVHs of lazy meshes)?
     BoundingBox3f m_bbox;               ///< Bounding box of the entire BVH
 };
 
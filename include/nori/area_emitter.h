@@ -31,7 +31,7 @@ class AreaEmitter : public Emitter
             lRec.p = sRec.p;
             lRec.n = sRec.n;
             lRec.d = (lRec.p - lRec.ref).normalized();
-            lRec.shadowRay = Ray3f(lRec.ref, lRec.d, 5 * Epsilon, (lRec.p - lRec.ref).norm() - Epsilon);
+            lRec.shadowRay = spawnRayTo(lRec.ref, lRec.refError, lRec.refN, lRec.p, lRec.time);
             lRec.pdf = pdf(mesh, lRec);
             if (lRec.pdf > 0.0f && !std::isnan(lRec.pdf) && !std::isinf(lRec.pdf))
             {
@@ -25,6 +25,10 @@
 #include <nori/color.h>
 #include <nori/vector.h>
 #include <tbb/mutex.h>
+#include <tbb/cache_aligned_allocator.h>
+#include <atomic>
+#include <vector>
+#include <cstdio>
 
 #define NORI_BLOCK_SIZE 32 /* Block size used for parallelization */
 
@@ -79,8 +83,12 @@ public:
      * 
      * This entails normalizing all pixels and discarding
      * the border region.
+     *
+     * \param divideByWeight
+     *     Divide the pixels by their accumulated weight, as needed when
+     *     samples were recorded with weights (see \ref put())
      */
-    Bitmap *toBitmap() const;
+    Bitmap *toBitmap(bool divideByWeight = false) const;
 
     /// Convert a bitmap into an image block
     void fromBitmap(const Bitmap &bitmap);
@@ -88,8 +96,14 @@ public:
     /// Clear all contents
     void clear() { setConstant(Color4f()); }
 
-    /// Record a sample with the given position and radiance value
-    void put(const Point2f &pos, const Color3f &value);
+    /**
+     * \brief Record a sample with the given position and radiance value
+     *
+     * \param weight
+     *     Weight of the sample, e.g. the number of samples that \c value
+     *     is the average of
+     */
+    void put(const Point2f &pos, const Color3f &value, float weight = 1.f);
 
     /**
      * \brief Merge another image block into this one
@@ -99,6 +113,20 @@ public:
      */
     void put(ImageBlock &b);
 
+    /**
+     * \brief Merge another image block without a border into this one,
+     * without locking
+     *
+     * Without a border, blocks whose regions don't overlap (as generated
+     * by \ref BlockGenerator) don't share any pixels, so they can be merged
+     * concurrently. Blocks with a border go through \ref put(ImageBlock &)
+     * or \ref RowAccumulator instead.
+     *
+     * This function does not take the mutex, so that \ref lock() only
+     * guards against \ref put(ImageBlock &)
+     */
+    void merge(const ImageBlock &b);
+
     /// Lock the image block (using an internal mutex)
     inline void lock() const { m_mutex.lock(); }
     
@@ -120,12 +148,132 @@ protected:
 };
 
 /**
- * \brief Spiraling block generator
+ * \brief Rendered rows that are added to an image in a fixed order
+ *
+ * With a reconstruction filter that has a border, the pixels near the
+ * edges of a block also receive samples of the neighboring blocks, and
+ * their floating point sums would depend on the order in which the blocks
+ * finish and on where \ref BlockGenerator split them. Instead, every row
+ * of a block is rendered into its own image block of height one and
+ * stored here, and \ref addTo() adds all of them to the image in the
+ * order of their rows and blocks. The image is then the same for any
+ * thread count and schedule.
+ *
+ * Different threads may store different rows concurrently.
+ */
+class RowAccumulator {
+public:
+    /**
+     * \brief Create storage for all rows of an image
+     * \param size
+     *      Size of the image
+     * \param blockSize
+     *      Maximum size of the blocks that the rows belong to
+     * \param borderSize
+     *      Border size of the reconstruction filter
+     */
+    RowAccumulator(const Vector2i &size, int blockSize, int borderSize);
+
+    /// Store a row of a block (an image block with a height of one)
+    void put(const ImageBlock &row);
+
+    /// Add the stored rows to an image of the same size
+    void addTo(ImageBlock &image) const;
+protected:
+    Vector2i m_size;
+    int m_blockSize, m_borderSize;
+    /// Row (with border) of block x of image row y at (y, x) in units of rows
+    Eigen::Array<Color4f, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> m_rows;
+};
+
+/**
+ * \brief Per-pixel sample statistics that accompany an image block
+ *
+ * Records the running mean and variance of the luminance of the samples
+ * of every pixel with Welford's algorithm. Progressive rendering derives
+ * the remaining noise of the image from them, and adaptive sampling uses
+ * them to decide how many samples every pixel gets in the next pass.
+ *
+ * Different threads may record samples of different pixels concurrently.
+ */
+class PixelStatistics {
+public:
+    /// Create statistics for an image of the specified size
+    PixelStatistics(const Vector2i &size);
+
+    /// Record the luminance of a sample of a pixel
+    void put(const Point2i &pixel, float value) {
+        int i = index(pixel);
+        float delta = value - m_mean[i];
+        m_mean[i] += delta / ++m_count[i];
+        m_m2[i] += delta * (value - m_mean[i]);
+    }
+
+    /// Return the number of samples of a pixel
+    uint32_t getSampleCount(const Point2i &pixel) const { return m_count[index(pixel)]; }
+
+    /**
+     * \brief Return the relative variance of the mean of a pixel
+     *
+     * The variance of the mean is divided by the squared mean plus 0.01,
+     * which keeps dark pixels from dominating. Pixels with fewer than two
+     * samples have an infinite error.
+     */
+    float getError(const Point2i &pixel) const { return error(index(pixel)); }
+
+    /// Return the relative RMS error of the image (see \ref getError())
+    float getNoise() const;
+
+    /**
+     * \brief Distribute samples among the pixels for the next pass
+     *
+     * Every pixel receives a share of \c budget proportional to its
+     * error (see \ref getError()) averaged over a 5x5 window, but at
+     * most \c maxSamples. Pixels without an error estimate come first. The fractions are carried
+     * over to the next pixel, so the result is deterministic.
+     *
+     * \return The number of distributed samples
+     */
+    uint64_t allocate(uint64_t budget, uint32_t maxSamples);
+
+    /// Return the number of samples of a pixel in the next pass (see \ref allocate())
+    uint32_t getPassSampleCount(const Point2i &pixel) const { return m_passCount[index(pixel)]; }
+
+    /// Return a histogram of the sample counts (in powers of two) as a string
+    std::string getSampleHistogram() const;
+
+    /// Write the statistics to a file (see \ref saveCheckpoint())
+    bool write(FILE *file) const;
+
+    /// Read statistics of the same size that were written by \ref write()
+    bool read(FILE *file);
+protected:
+    int index(const Point2i &pixel) const { return pixel.y() * m_size.x() + pixel.x(); }
+    float error(int i) const;
+
+    Vector2i m_size;
+    std::vector<float> m_mean, m_m2;
+    std::vector<uint32_t> m_count, m_passCount;
+};
+
+/**
+ * \brief Spiraling block generator with work stealing
  *
  * This class can be used to chop up an image into many small
  * rectangular blocks suitable for parallel rendering. The blocks
  * are ordered in spiraling pattern so that the center is
  * rendered first.
+ *
+ * The workers claim blocks through an atomic counter over the
+ * precomputed order, and then the rows of their block one at a time.
+ * Once all blocks are claimed, idle workers split the block with the
+ * most remaining work (estimated from the time its rows took so far)
+ * and take over the bottom half of its unclaimed rows. This way, a
+ * few expensive blocks (e.g. caustics) don't leave most threads idle
+ * at the end of the frame. No locks are involved.
+ *
+ * Samplers are prepared for every row (see \ref Sampler::prepareRow()),
+ * so the image does not depend on how the blocks are split.
  */
 class BlockGenerator {
 public:
@@ -135,32 +283,85 @@ public:
      *      Size of the image that should be split into blocks
      * \param blockSize
      *      Maximum size of the individual blocks
+     * \param workerCount
+     *      Number of workers that call \ref next() concurrently
      */
-    BlockGenerator(const Vector2i &size, int blockSize);
-    
+    BlockGenerator(const Vector2i &size, int blockSize, int workerCount);
+
     /**
-     * \brief Return the next block to be rendered
+     * \brief Assign the next block (or part of a block) to a worker
+     *
+     * Sets the offset and size of \c block to the rows that the worker
+     * now owns, which it then claims with \ref nextRow(). Must only be
+     * called once the previous block of the worker has no rows left.
      *
      * This function is thread-safe
      *
      * \return \c false if there were no more blocks
      */
-    bool next(ImageBlock &block);
+    bool next(int worker, ImageBlock &block);
+
+    /**
+     * \brief Claim the next row of the block owned by a worker
+     *
+     * \param row
+     *      Receives the index of the row within the image
+     * \param rowTime
+     *      Time (in seconds) that the previous row of this worker took,
+     *      which thieves use to find the most expensive block
+     *
+     * \return \c false if all rows of the block are claimed, possibly
+     *      by another worker that split it
+     */
+    bool nextRow(int worker, int &row, float rowTime = 0.f);
 
     /// Return the total number of blocks
-    int getBlockCount() const { return m_blocksLeft; }
+    int getBlockCount() const { return (int) m_blocks.size(); }
+
+    /// Return the number of times that a block was split
+    int getSplitCount() const { return m_splits.load(); }
+
+    /**
+     * \brief Hand out all blocks once more, e.g. for the next pass
+     * of progressive rendering
+     *
+     * Must not be called while workers are using the generator
+     */
+    void reset();
 protected:
     enum EDirection { ERight = 0, EDown, ELeft, EUp };
 
-    Point2i m_block;
-    Vector2i m_numBlocks;
+    /// Marks a worker without a block in \ref Worker::work
+    static const uint32_t NoBlock = 0xFFFFFFFFu;
+
+    /// Pack a block index and a range of its rows for \ref Worker::work
+    static uint64_t pack(uint32_t block, uint32_t next, uint32_t end) {
+        return ((uint64_t) block << 32) | (next << 16) | end;
+    }
+
+    /**
+     * \brief State of a worker, on its own cache line
+     *
+     * \c work holds the block index (upper 32 bits) and the range of its
+     * unclaimed rows [next, end) (16 bits each, relative to the block).
+     * The owner increments \c next, and thieves decrease \c end, both
+     * with a compare-and-swap of the whole word. The block index in it
+     * keeps thieves from cutting a block that the owner already left.
+     */
+    struct alignas(64) Worker {
+        std::atomic<uint64_t> work { pack(NoBlock, 0, 0) };
+        std::atomic<float> rowTime { 0.f };  ///< Time taken by the last row (seconds)
+    };
+
+    /// Spiral order of the blocks (positions in units of blocks)
+    std::vector<Point2i> m_blocks;
+    /// Allocated with TBB, since \c new ignores the alignment before C++17
+    std::vector<Worker, tbb::cache_aligned_allocator<Worker>> m_workers;
+    int m_workerCount;
     Vector2i m_size;
     int m_blockSize;
-    int m_numSteps;
-    int m_blocksLeft;
-    int m_stepsLeft;
-    int m_direction;
-    tbb::mutex m_mutex;
+    std::atomic<uint32_t> m_nextBlock { 0 };  ///< Next entry of m_blocks to be claimed
+    std::atomic<int> m_splits { 0 };
 };
 
 NORI_NAMESPACE_END
@@ -48,6 +48,10 @@ public:
      *    A uniformly distributed 2D vector that is used to sample
      *    a position on the aperture of the sensor if necessary.
      *
+     * \param timeSample
+     *    A uniformly distributed value that is mapped to the time of
+     *    the ray within the shutter interval (see \ref hasMotionBlur())
+     *
      * \return
      *    An importance weight associated with the sampled ray.
      *    This accounts for the difference in the camera response
@@ -55,7 +59,8 @@ public:
      */
     virtual Color3f sampleRay(Ray3f &ray,
         const Point2f &samplePosition,
-        const Point2f &apertureSample) const = 0;
+        const Point2f &apertureSample,
+        float timeSample) const = 0;
 
     /// Return the size of the output image in pixels
     const Vector2i &getOutputSize() const { return m_outputSize; }
@@ -63,6 +68,14 @@ public:
     /// Return the camera's reconstruction filter in image space
     const ReconstructionFilter *getReconstructionFilter() const { return m_rfilter; }
 
+    /**
+     * \brief Does the shutter stay open for a nonempty time interval?
+     *
+     * Only then do the rays need a time sample; otherwise, they are all
+     * traced at the time the shutter opens.
+     */
+    bool hasMotionBlur() const { return m_shutterClose > m_shutterOpen; }
+
     /**
      * \brief Return the type of object (i.e. Mesh/Camera/etc.) 
      * provided by this instance
@@ -71,6 +84,8 @@ public:
 protected:
     Vector2i m_outputSize;
     ReconstructionFilter *m_rfilter;
+    float m_shutterOpen = 0;
+    float m_shutterClose = 0;
 };
 
 NORI_NAMESPACE_END
@@ -0,0 +1,70 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <nori/block.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Progress of a progressive render, as stored in a checkpoint
+ *
+ * Besides this, checkpoints hold the raw accumulation of the image
+ * (colors and filter weights, border included), the sample statistics
+ * of every pixel (see \ref PixelStatistics) and the optional heatmap.
+ * The samplers are seeded from the pixel and the pass (see
+ * \ref Sampler::prepareRow()), so the number of completed passes is all
+ * of their state, and the sums of the pixels don't depend on the schedule
+ * (see \ref RowAccumulator). Continuing from a checkpoint therefore
+ * produces the same image as a render that was never interrupted.
+ */
+struct Checkpoint {
+    /* Settings that a resumed render must share */
+    Vector2i size { 0, 0 };     ///< Size of the image
+    int passSampleCount = 0;    ///< Samples per pixel of a pass
+    bool adaptive = false;      ///< Whether adaptive sampling was used
+
+    /* Progress */
+    int pass = 0;               ///< Number of completed passes
+    uint64_t samples = 0;       ///< Number of samples taken
+    double elapsed = 0;         ///< Time spent rendering (seconds)
+};
+
+/**
+ * \brief Write a checkpoint
+ *
+ * The file is written under a temporary name and then renamed, so that
+ * a crash while saving leaves the previous checkpoint intact.
+ */
+extern void saveCheckpoint(const std::string &filename, const Checkpoint &checkpoint,
+                           const ImageBlock &image, const PixelStatistics &stats,
+                           const Bitmap *heatmap);
+
+/**
+ * \brief Load a checkpoint into an image, its statistics and the heatmap
+ *
+ * The settings in \c checkpoint must match the ones stored in the file,
+ * which then replaces the progress.
+ *
+ * \return \c false if there was no checkpoint
+ */
+extern bool loadCheckpoint(const std::string &filename, Checkpoint &checkpoint,
+                           ImageBlock &image, PixelStatistics &stats, Bitmap *heatmap);
+
+NORI_NAMESPACE_END
@@ -49,6 +49,12 @@
 /* "Ray epsilon": relative error threshold for ray intersection computations */
 #define Epsilon 1e-4f
 
+/* Bound on the relative rounding error of a single float operation */
+#define MachineEpsilon (std::numeric_limits<float>::epsilon() * 0.5f)
+
+/* Shadow rays stop this fraction of the distance short of their target */
+#define ShadowEpsilon 1e-4f
+
 /* A few useful constants */
 #undef M_PI
 
@@ -122,6 +128,7 @@ class Bitmap;
 class BlockGenerator;
 class Camera;
 class ImageBlock;
+class Instance;
 class Integrator;
 class KDTree;
 class Emitter;
@@ -237,6 +244,14 @@ inline int mod(int a, int b) {
     return (r < 0) ? r+b : r;
 }
 
+/**
+ * \brief Conservative bound on the relative error accumulated by
+ * \c n consecutive float operations, i.e. (1 +- eps)^n <= 1 +- errorBound(n)
+ */
+inline float errorBound(int n) {
+    return (n * MachineEpsilon) / (1 - n * MachineEpsilon);
+}
+
 /// Compute a direction for the given coordinates in spherical coordinates
 extern Vector3f sphericalDirection(float theta, float phi);
 
@@ -31,6 +31,12 @@ struct EmitterQueryRecord {
     const Emitter *emitter;
     /// Reference position
     Point3f ref;
+    /// Geometric normal at the reference position (zero if not on a surface)
+    Normal3f refN = Normal3f(0.f);
+    /// Bound on the absolute error of the reference position
+    Vector3f refError = Vector3f::Zero();
+    /// Time of the reference position (inherited by the shadow ray)
+    float time = 0;
     /// Sampled position on the light source
     Point3f p;
     /// Associated surface normal
@@ -50,6 +56,17 @@ struct EmitterQueryRecord {
     /// Create a new query record that can be used to sample a emitter
     EmitterQueryRecord(const Point3f &ref) : ref(ref) { }
 
+    /**
+     * \brief Create a new query record that can be used to sample a
+     * emitter from a surface position
+     *
+     * The shadow ray leaves the surface without self-intersections
+     * (see \ref spawnRayTo())
+     */
+    EmitterQueryRecord(const Point3f &ref, const Normal3f &refN, const Vector3f &refError,
+                       float time = 0)
+        : ref(ref), refN(refN), refError(refError), time(time) { }
+
     /**
      * \brief Create a query record that can be used to query the
      * sampling density after having intersected an area emitter
@@ -0,0 +1,58 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <nori/object.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Copy of a shared mesh placed in the scene
+ *
+ * A mesh that declares an \c id (e.g. <tt>&lt;string name="id"
+ * value="tree"/&gt;</tt>) is not rendered on its own. Instead, every
+ * <tt>&lt;instance&gt;</tt> element that references this id places a
+ * copy of the mesh using its own \c toWorld transformation. All copies
+ * share the geometry, the BSDF and the BVH of the mesh, so that the
+ * memory footprint does not grow with the number of copies.
+ */
+class Instance : public NoriObject {
+public:
+    Instance(const PropertyList &propList);
+
+    /// Return the \c id of the referenced mesh
+    const std::string &getMeshId() const { return m_meshId; }
+
+    /// Return the object-to-world transformation
+    const Transform &getTransform() const { return m_toWorld; }
+
+    /// Return a human-readable summary of this instance
+    std::string toString() const;
+
+    /**
+     * \brief Return the type of object (i.e. Mesh/BSDF/etc.)
+     * provided by this instance
+     * */
+    EClassType getClassType() const { return EInstance; }
+protected:
+    std::string m_meshId; ///< Identifier of the shared mesh
+    Transform m_toWorld;  ///< Object-to-world transformation
+};
+
+NORI_NAMESPACE_END
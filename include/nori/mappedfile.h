@@ -0,0 +1,62 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <nori/common.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Read-only view of a file, memory-mapped where available
+ *
+ * On Windows, the file is read into memory instead. Either way, the
+ * contents start at a 64 byte boundary. Failing to open the file is not
+ * an error; check \ref isOpen() instead.
+ */
+class MappedFile {
+public:
+    /// Map the given file
+    MappedFile(const std::string &filename);
+
+    /// Unmap the file
+    ~MappedFile();
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    /// Could the file be opened? (it may still be empty)
+    bool isOpen() const { return m_open; }
+
+    /// Return a pointer to the contents (\c nullptr if the file is empty)
+    const char *data() const { return m_data; }
+
+    /// Return the size of the file in bytes
+    size_t size() const { return m_size; }
+
+private:
+    const char *m_data = nullptr;
+    size_t m_size = 0;
+    bool m_open = false;
+#if defined(PLATFORM_WINDOWS)
+    struct alignas(64) Line { char bytes[64]; };
+    std::vector<Line> m_buffer;
+#endif
+};
+
+NORI_NAMESPACE_END
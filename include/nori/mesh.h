@@ -36,8 +36,12 @@ NORI_NAMESPACE_BEGIN
 struct Intersection {
     /// Position of the surface intersection
     Point3f p;
+    /// Bound on the absolute floating point error of \ref p
+    Vector3f pError = Vector3f::Zero();
     /// Unoccluded distance along the ray
     float t;
+    /// Time of the ray that found the intersection (see \ref Ray3f::time)
+    float time = 0;
     /// UV coordinates, if any
     Point2f uv;
     /// Shading frame (based on the shading normal)
@@ -46,8 +50,12 @@ struct Intersection {
     Frame geoFrame;
     /// Pointer to the associated mesh
     const Mesh *mesh;
-	/// Number of tries made before closest intersection was found
+    /// BSDF of the intersected triangle (see \ref Mesh::getBSDF(uint32_t))
+    const BSDF *bsdf = nullptr;
+	/// Number of ray-triangle tests made before the closest intersection was found
 	unsigned int attempts = 0;
+	/// Number of BVH nodes visited before the closest intersection was found
+	unsigned int nodeVisits = 0;
 
     /// Create an uninitialized intersection record
     Intersection() : mesh(nullptr) { }
@@ -62,6 +70,16 @@ struct Intersection {
         return shFrame.toWorld(d);
     }
 
+    /// Spawn a ray that leaves the surface in direction \c d
+    Ray3f spawnRay(const Vector3f &d) const {
+        return nori::spawnRay(p, pError, geoFrame.n, d, time);
+    }
+
+    /// Spawn a shadow ray from the surface towards \c target
+    Ray3f spawnRayTo(const Point3f &target) const {
+        return nori::spawnRayTo(p, pError, geoFrame.n, target, time);
+    }
+
     /// Return a human-readable summary of the intersection record
     std::string toString() const;
 };
@@ -92,7 +110,9 @@ public:
     virtual void activate();
 
     /// Return the total number of triangles in this shape
-    uint32_t getTriangleCount() const { return (uint32_t) m_F.cols(); }
+    uint32_t getTriangleCount() const {
+        return m_compactF.empty() ? (uint32_t) m_F.cols() : (uint32_t) (m_compactF.size() / 3);
+    }
 
     /// Return the total number of vertices in this shape
     uint32_t getVertexCount() const { return (uint32_t) m_V.cols(); }
@@ -139,15 +159,99 @@ public:
     /// Return a pointer to the vertex positions
     const MatrixXf &getVertexPositions() const { return m_V; }
 
-    /// Return a pointer to the vertex normals (or \c nullptr if there are none)
+    /// Return a pointer to the vertex normals (empty if there are none, or if they are quantized)
     const MatrixXf &getVertexNormals() const { return m_N; }
 
-    /// Return a pointer to the texture coordinates (or \c nullptr if there are none)
+    /// Return a pointer to the texture coordinates (empty if there are none, or if they are quantized)
     const MatrixXf &getVertexTexCoords() const { return m_UV; }
 
-    /// Return a pointer to the triangle vertex index list
+    /// Return a pointer to the triangle vertex index list (empty if it is quantized)
     const MatrixXu &getIndices() const { return m_F; }
 
+    /// Return the index of vertex \c k (0, 1 or 2) of triangle \c f
+    uint32_t getVertexIndex(uint32_t f, int k) const {
+        return m_compactF.empty() ? m_F(k, f) : (uint32_t) m_compactF[3 * f + k];
+    }
+
+    /// Does the mesh have vertex normals?
+    bool hasVertexNormals() const { return m_N.size() > 0 || !m_compactN.empty(); }
+
+    /// Does the mesh have texture coordinates?
+    bool hasVertexTexCoords() const { return m_UV.size() > 0 || !m_compactUV.empty(); }
+
+    /// Return the normal of a vertex (of keyframe 0)
+    Normal3f getVertexNormal(uint32_t vertex) const {
+        return m_compactN.empty() ? Normal3f(m_N.col(vertex)) : decodeNormal(m_compactN[vertex]);
+    }
+
+    /// Return the texture coordinates of a vertex
+    Point2f getVertexTexCoord(uint32_t vertex) const {
+        if (m_compactUV.empty())
+            return m_UV.col(vertex);
+        uint32_t value = m_compactUV[vertex];
+        return Point2f(m_uvOffset.x() + m_uvScale.x() * (float) (value & 0xFFFF),
+                       m_uvOffset.y() + m_uvScale.y() * (float) (value >> 16));
+    }
+
+    /**
+     * \brief Are the vertex attributes stored in the compact representation?
+     *
+     * Meshes with <tt>&lt;boolean name="quantize" value="true"/&gt;</tt>
+     * replace their normals by an octahedral encoding with 2x16 bits,
+     * their texture coordinates by 2x16-bit fixed point values relative
+     * to their bounding rectangle, and their faces by 16-bit indices if
+     * there are at most 65536 vertices. The positions stay as they are.
+     * The attributes are decoded on access, so \ref getVertexIndex(),
+     * \ref getVertexNormal() and \ref getVertexTexCoord() must be
+     * used instead of the matrices.
+     */
+    bool isQuantized() const { return !m_compactN.empty() || !m_compactUV.empty() || !m_compactF.empty(); }
+
+    /**
+     * \brief Is the mesh animated, i.e. does it have more than one keyframe?
+     *
+     * The keyframes of a moving mesh are spaced uniformly over the times
+     * [0, 1], and the vertices move linearly between them. Keyframe 0 is
+     * the regular vertex data (\ref getVertexPositions()), which is
+     * also what the mesh looks like to everything that is not traced
+     * with a time, e.g. emitter sampling.
+     */
+    bool isMoving() const { return !m_keyframeV.empty(); }
+
+    /**
+     * \brief Is the geometry loaded on demand?
+     *
+     * Meshes with <tt>&lt;boolean name="lazy" value="true"/&gt;</tt>
+     * only determine their bounding box while the scene is parsed. The
+     * acceleration structure calls \ref load() when a ray first enters
+     * that box, and may call \ref unload() again to stay within its
+     * memory budget. Lazy meshes can be neither emitters nor moving.
+     */
+    bool isLazy() const { return m_lazy; }
+
+    /// Read the geometry of a lazy mesh (see \ref isLazy())
+    void load();
+
+    /// Release the geometry of a lazy mesh, keeping its bounding box and BSDFs
+    void unload();
+
+    /// Return the memory used by the vertex attributes and faces
+    size_t getMemoryUsage() const;
+
+    /// Return the number of keyframes (1 for static meshes)
+    uint32_t getKeyframeCount() const { return 1 + (uint32_t) m_keyframeV.size(); }
+
+    /// Return the vertex positions of keyframe \c k
+    const MatrixXf &getKeyframePositions(uint32_t k) const {
+        return k == 0 ? m_V : m_keyframeV[k - 1];
+    }
+
+    /// Return the position of a vertex at the given time
+    Point3f getVertexPosition(uint32_t vertex, float time) const;
+
+    /// Return the (unnormalized) normal of a vertex at the given time
+    Normal3f getVertexNormal(uint32_t vertex, float time) const;
+
     /// Is this mesh an area emitter?
     bool isEmitter() const { return m_emitter != nullptr; }
 
@@ -160,12 +264,36 @@ public:
     /// Return a pointer to the BSDF associated with this mesh
     const BSDF *getBSDF() const { return m_bsdf; }
 
+    /**
+     * \brief Return the BSDF of triangle \c f
+     *
+     * Meshes with several materials (e.g. from the \c usemtl statements
+     * of an OBJ file) store a material index per triangle. Triangles
+     * without a material of their own use \ref getBSDF().
+     */
+    const BSDF *getBSDF(uint32_t f) const {
+        if (m_faceMaterials.empty() || m_faceMaterials[f] == 0)
+            return m_bsdf;
+        return m_materials[m_faceMaterials[f] - 1];
+    }
+
+    /// Return the number of materials in addition to \ref getBSDF()
+    uint32_t getMaterialCount() const { return (uint32_t) m_materials.size(); }
+
     /// Register a child object (e.g. a BSDF) with the mesh
     virtual void addChild(NoriObject *child);
 
     /// Return the name of this mesh
     const std::string &getName() const { return m_name; }
 
+    /**
+     * \brief Return the identifier of a shared mesh
+     *
+     * Meshes with a (non-empty) \c id are not rendered on their own,
+     * but placed in the scene by \ref Instance objects that reference it.
+     */
+    const std::string &getId() const { return m_id; }
+
     const DiscretePDF& getPdf() const { return m_disPdf; }
     
     SampleMeshResult sampleSurfaceUniform(Sampler* sampler) const;
@@ -183,17 +311,54 @@ protected:
     /// Create an empty mesh
     Mesh();
 
+    /// Switch to the compact representation (see \ref isQuantized())
+    void quantize();
+
+    /**
+     * \brief Read the vertex attributes and faces of a lazy mesh
+     *
+     * Subclasses that support lazy loading override this function,
+     * the default implementation throws an exception.
+     */
+    virtual void loadGeometry();
+
+    /// Encode a unit vector with the octahedral mapping
+    static uint32_t encodeNormal(const Vector3f &n);
+
+    /// Decode an octahedral normal
+    static Normal3f decodeNormal(uint32_t value);
+
 protected:
     std::string m_name;                  ///< Identifying name
+    std::string m_id;                    ///< Identifier of a shared mesh (empty if not instanced)
     MatrixXf      m_V;                   ///< Vertex positions
     MatrixXf      m_N;                   ///< Vertex normals
     MatrixXf      m_UV;                  ///< Vertex texture coordinates
     MatrixXu      m_F;                   ///< Faces
+    bool m_quantize = false;             ///< Switch to the compact representation in activate()?
+    bool m_lazy = false;                 ///< Load the geometry on demand (see \ref isLazy())?
+    std::vector<uint32_t> m_compactN;    ///< Quantized vertex normals (if any)
+    std::vector<uint32_t> m_compactUV;   ///< Quantized texture coordinates (if any)
+    std::vector<uint16_t> m_compactF;    ///< Faces with 16-bit indices (if any)
+    Vector2f m_uvOffset, m_uvScale;      ///< Dequantization of the texture coordinates
+    std::vector<MatrixXf> m_keyframeV;   ///< Vertex positions of the keyframes after the first
+    std::vector<MatrixXf> m_keyframeN;   ///< Vertex normals of the keyframes after the first (if any)
     BSDF         *m_bsdf = nullptr;      ///< BSDF of the surface
+    std::vector<BSDF *> m_materials;     ///< BSDFs of the per-triangle materials
+    std::vector<uint16_t> m_faceMaterials; ///< 0 for \ref m_bsdf, or 1 + index into \ref m_materials (empty if unused)
     Emitter    *m_emitter = nullptr;     ///< Associated emitter, if any
     BoundingBox3f m_bbox;                ///< Bounding box of the mesh
     float m_area;
     DiscretePDF m_disPdf;
 };
 
+/**
+ * \brief Write a static mesh to a binary \c .nmesh file
+ *
+ * The file can be loaded with <tt>&lt;mesh type="binary"&gt;</tt>. When
+ * \c compress is set, the arrays are compressed with zlib, which makes
+ * the file smaller but loading it somewhat slower.
+ */
+extern void writeBinaryMesh(const Mesh *mesh, const std::string &filename, bool compress);
+
 NORI_NAMESPACE_END
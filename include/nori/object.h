@@ -42,6 +42,7 @@ public:
         ESampler,
         ETest,
         EReconstructionFilter,
+        EInstance,
         EClassTypeCount,
         ETexture
     };
@@ -99,6 +100,7 @@ public:
             case EIntegrator: return "integrator";
             case ESampler:    return "sampler";
             case ETest:       return "test";
+            case EInstance:   return "instance";
             default:          return "<unknown>";
         }
     }
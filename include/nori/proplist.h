@@ -95,6 +95,9 @@ public:
     /// Get a vector property, and use a default value if it does not exist
     Vector3f getVector(const std::string &name, const Vector3f &defaultValue) const;
 
+    /// Is there a property with the given name (of any type)?
+    bool has(const std::string &name) const { return m_properties.find(name) != m_properties.end(); }
+
     /// Set a transform property
     void setTransform(const std::string &name, const Transform &value);
 
@@ -29,6 +29,8 @@ NORI_NAMESPACE_BEGIN
  * stores a ray segment [mint, maxt] (whose entries may include positive/negative
  * infinity), as well as the componentwise reciprocals of the ray direction.
  * That is just done for convenience, as these values are frequently required.
+ * The \c time of a ray selects the configuration of moving meshes that it
+ * intersects (see \ref Mesh::isMoving()).
  *
  * \remark Important: be careful when changing the ray direction. You must
  * call \ref update() to compute the componentwise reciprocals as well, or Nori's
@@ -44,31 +46,32 @@ template <typename _PointType, typename _VectorType> struct TRay {
     VectorType dRcp; ///< Componentwise reciprocals of the ray direction
     Scalar mint;     ///< Minimum position on the ray segment
     Scalar maxt;     ///< Maximum position on the ray segment
+    Scalar time;     ///< Time at which the ray is traced (for motion blur)
 
     /// Construct a new ray
     TRay() : mint(Epsilon), 
-        maxt(std::numeric_limits<Scalar>::infinity()) { }
+        maxt(std::numeric_limits<Scalar>::infinity()), time(0) { }
     
     /// Construct a new ray
     TRay(const PointType &o, const VectorType &d) : o(o), d(d), 
-            mint(Epsilon), maxt(std::numeric_limits<Scalar>::infinity()) {
+            mint(Epsilon), maxt(std::numeric_limits<Scalar>::infinity()), time(0) {
         update();
     }
 
     /// Construct a new ray
     TRay(const PointType &o, const VectorType &d, 
-        Scalar mint, Scalar maxt) : o(o), d(d), mint(mint), maxt(maxt) {
+        Scalar mint, Scalar maxt, Scalar time = 0) : o(o), d(d), mint(mint), maxt(maxt), time(time) {
         update();
     }
 
     /// Copy constructor
     TRay(const TRay &ray) 
      : o(ray.o), d(ray.d), dRcp(ray.dRcp),
-       mint(ray.mint), maxt(ray.maxt) { }
+       mint(ray.mint), maxt(ray.maxt), time(ray.time) { }
 
     /// Copy a ray, but change the covered segment of the copy
     TRay(const TRay &ray, Scalar mint, Scalar maxt) 
-     : o(ray.o), d(ray.d), dRcp(ray.dRcp), mint(mint), maxt(maxt) { }
+     : o(ray.o), d(ray.d), dRcp(ray.dRcp), mint(mint), maxt(maxt), time(ray.time) { }
 
     /// Update the reciprocal ray directions after changing 'd'
     void update() {
@@ -83,6 +86,7 @@ template <typename _PointType, typename _VectorType> struct TRay {
         TRay result;
         result.o = o; result.d = -d; result.dRcp = -dRcp;
         result.mint = mint; result.maxt = maxt;
+        result.time = time;
         return result;
     }
 
@@ -93,9 +97,58 @@ template <typename _PointType, typename _VectorType> struct TRay {
                 "  o = %s,\n"
                 "  d = %s,\n"
                 "  mint = %f,\n"
-                "  maxt = %f\n"
-                "]", o.toString(), d.toString(), mint, maxt);
+                "  maxt = %f,\n"
+                "  time = %f\n"
+                "]", o.toString(), d.toString(), mint, maxt, time);
     }
 };
 
+/**
+ * \brief Move the origin of a ray that leaves a surface just far enough
+ * to be on the correct side of it
+ *
+ * \c pError bounds the absolute error of the surface position \c p in
+ * every dimension, and \c n is the geometric normal. The origin is pushed
+ * along the normal (towards the side of \c w) beyond that error box and
+ * rounded away from the surface. This avoids self-intersections
+ * without a ray epsilon that depends on the scale of the scene.
+ */
+inline Point3f offsetRayOrigin(const Point3f &p, const Vector3f &pError,
+                               const Vector3f &n, const Vector3f &w) {
+    float dist = n.cwiseAbs().dot(pError);
+    Vector3f offset = dist * n;
+    if (w.dot(n) < 0)
+        offset = -offset;
+
+    Point3f po = p + offset;
+    for (int i = 0; i < 3; ++i) {
+        if (offset[i] > 0)
+            po[i] = std::nextafter(po[i], std::numeric_limits<float>::infinity());
+        else if (offset[i] < 0)
+            po[i] = std::nextafter(po[i], -std::numeric_limits<float>::infinity());
+    }
+    return po;
+}
+
+/// Spawn a ray that leaves a surface position (see \ref offsetRayOrigin())
+inline Ray3f spawnRay(const Point3f &p, const Vector3f &pError,
+                      const Vector3f &n, const Vector3f &d, float time = 0) {
+    return Ray3f(offsetRayOrigin(p, pError, n, d), d,
+                 0.f, std::numeric_limits<float>::infinity(), time);
+}
+
+/**
+ * \brief Spawn a shadow ray that leaves a surface position and stops
+ * just before \c target
+ *
+ * The direction of the ray is normalized, so \c maxt is a distance.
+ */
+inline Ray3f spawnRayTo(const Point3f &p, const Vector3f &pError,
+                        const Vector3f &n, const Point3f &target, float time = 0) {
+    Point3f o = offsetRayOrigin(p, pError, n, target - p);
+    Vector3f d = target - o;
+    float dist = d.norm();
+    return Ray3f(o, d / dist, 0.f, dist * (1 - ShadowEpsilon), time);
+}
+
 NORI_NAMESPACE_END
@@ -77,6 +77,18 @@ public:
      */
     virtual void prepare(const ImageBlock &block) = 0;
 
+    /**
+     * \brief Prepare to render the row of a block that starts at \c offset
+     *
+     * Blocks may be split between threads at row boundaries (see
+     * \ref BlockGenerator). Samplers that initialize themselves here
+     * produce the same image no matter how the blocks were split.
+     * Progressive rendering visits every row once per pass, and
+     * \c pass should then select different samples.
+     * The default implementation does nothing.
+     */
+    virtual void prepareRow(const Point2i &offset, int pass = 0) { }
+
     /**
      * \brief Prepare to generate new samples
      * 
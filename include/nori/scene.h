@@ -97,8 +97,80 @@ public:
      * \return \c true if an intersection was found
      */
     bool rayIntersect(const Ray3f &ray) const {
-        Intersection its; /* Unused */
-        return m_accel->rayIntersect(ray, its, true);
+        return m_accel->occluded(ray);
+    }
+
+    /// Alias of \ref rayIntersect(const Ray3f &) const for shadow rays
+    bool occluded(const Ray3f &ray) const {
+        return m_accel->occluded(ray);
+    }
+
+    /**
+     * \brief Find the closest intersection of a ray, but only record the
+     * distance, the triangle and its barycentric coordinates
+     *
+     * The surface details can be computed later on using
+     * \ref computeIntersection(), e.g. only for the hits that need them.
+     *
+     * \return \c true if an intersection was found
+     */
+    bool rayIntersect(const Ray3f &ray, HitRecord &hit) const {
+        return m_accel->rayIntersect(ray, hit);
+    }
+
+    /// Turn a hit record into a detailed intersection record
+    void computeIntersection(const HitRecord &hit, Intersection &its) const {
+        m_accel->computeIntersection(hit, its);
+    }
+
+    /**
+     * \brief Intersect a packet of up to 16 rays against all triangles
+     * stored in the scene and return detailed intersection information
+     *
+     * \param packet
+     *    A bundle of (ideally coherent) rays, e.g. primary rays of
+     *    neighboring pixels
+     *
+     * \param its
+     *    An array of <tt>packet.size</tt> intersection records, which
+     *    will be filled by the intersection query
+     *
+     * \return A bit mask of the rays that found an intersection
+     */
+    uint32_t rayIntersect(const RayPacket &packet, Intersection *its) const {
+        return m_accel->rayIntersect(packet, its, false);
+    }
+
+    /**
+     * \brief Determine which rays of a packet are occluded
+     *
+     * This is the packet version of the shadow ray query; traversal
+     * terminates as soon as all rays of the packet are occluded.
+     *
+     * \return A bit mask of the rays that found an intersection
+     */
+    uint32_t rayIntersect(const RayPacket &packet) const {
+        return m_accel->rayIntersect(packet, nullptr, true);
+    }
+
+    /**
+     * \brief Intersect a batch of arbitrary rays against all triangles
+     * stored in the scene (see \ref Accel::rayIntersect())
+     *
+     * \param its
+     *    An array of \c count intersection records
+     *
+     * \param hit
+     *    An array of \c count flags that record which rays found an
+     *    intersection
+     */
+    void rayIntersect(const Ray3f *rays, uint32_t count, Intersection *its, bool *hit) const {
+        m_accel->rayIntersect(rays, count, its, hit, false);
+    }
+
+    /// Determine which rays of a batch of shadow rays are occluded
+    void rayIntersect(const Ray3f *rays, uint32_t count, bool *hit) const {
+        m_accel->rayIntersect(rays, count, nullptr, hit, true);
     }
 
     /// \brief Return an axis-aligned box that bounds the scene
@@ -123,6 +195,7 @@ public:
     EClassType getClassType() const { return EScene; }
 private:
     std::vector<Mesh *> m_meshes;
+    std::vector<Instance *> m_instances;
     Integrator *m_integrator = nullptr;
     Sampler *m_sampler = nullptr;
     Camera *m_camera = nullptr;
@@ -0,0 +1,178 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <nori/common.h>
+
+/* ===================================================================
+    This file detects the SIMD instruction sets that are available
+    to the compiler and provides a minimal packed float type for the
+    ray traversal kernels. SSE (always present on x86-64) is used for
+    4 lanes and AVX for 8 lanes when Nori is compiled with
+    NORI_USE_AVX. Other platforms fall back to plain loops over the
+    lanes.
+ * =================================================================== */
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define NORI_SIMD_SSE 1
+#  include <emmintrin.h>
+#endif
+
+#if defined(__AVX__)
+#  define NORI_SIMD_AVX 1
+#  include <immintrin.h>
+#endif
+
+#include <cstring>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief N packed single precision values
+ *
+ * Comparisons return lane masks (all bits set or cleared) of the same
+ * type, which can be combined with <tt>&amp;</tt> and <tt>|</tt>, passed to
+ * \ref select(), or turned into an integer bit mask with \ref movemask().
+ * Like the SSE instructions, <tt>min(a, b)</tt> and <tt>max(a, b)</tt>
+ * return \c b when either argument is NaN.
+ *
+ * The generic version below is a plain loop over the lanes; the 4- and
+ * 8-wide versions are specialized for SSE and AVX.
+ */
+template <int N> struct SimdFloat {
+    float v[N];
+
+    SimdFloat() { }
+    explicit SimdFloat(float value) { for (int i = 0; i < N; ++i) v[i] = value; }
+
+    static SimdFloat load(const float *ptr) { SimdFloat r; memcpy(r.v, ptr, sizeof(r.v)); return r; }
+    void store(float *ptr) const { memcpy(ptr, v, sizeof(v)); }
+
+#define NORI_SIMD_ARITH(op) \
+    friend SimdFloat operator op(const SimdFloat &a, const SimdFloat &b) { \
+        SimdFloat r; for (int i = 0; i < N; ++i) r.v[i] = a.v[i] op b.v[i]; return r; }
+#define NORI_SIMD_CMP(op) \
+    friend SimdFloat operator op(const SimdFloat &a, const SimdFloat &b) { \
+        SimdFloat r; for (int i = 0; i < N; ++i) r.v[i] = mask(a.v[i] op b.v[i]); return r; }
+#define NORI_SIMD_BITS(op) \
+    friend SimdFloat operator op(const SimdFloat &a, const SimdFloat &b) { \
+        SimdFloat r; for (int i = 0; i < N; ++i) r.v[i] = fromBits(bits(a.v[i]) op bits(b.v[i])); return r; }
+    NORI_SIMD_ARITH(+) NORI_SIMD_ARITH(-) NORI_SIMD_ARITH(*) NORI_SIMD_ARITH(/)
+    NORI_SIMD_CMP(<) NORI_SIMD_CMP(<=) NORI_SIMD_CMP(>) NORI_SIMD_CMP(>=)
+    NORI_SIMD_BITS(&) NORI_SIMD_BITS(|)
+#undef NORI_SIMD_ARITH
+#undef NORI_SIMD_CMP
+#undef NORI_SIMD_BITS
+
+    friend SimdFloat min(const SimdFloat &a, const SimdFloat &b) {
+        SimdFloat r; for (int i = 0; i < N; ++i) r.v[i] = a.v[i] < b.v[i] ? a.v[i] : b.v[i]; return r;
+    }
+    friend SimdFloat max(const SimdFloat &a, const SimdFloat &b) {
+        SimdFloat r; for (int i = 0; i < N; ++i) r.v[i] = a.v[i] > b.v[i] ? a.v[i] : b.v[i]; return r;
+    }
+    friend SimdFloat abs(const SimdFloat &a) {
+        SimdFloat r; for (int i = 0; i < N; ++i) r.v[i] = std::abs(a.v[i]); return r;
+    }
+    /// Per lane <tt>m ? a : b</tt>
+    friend SimdFloat select(const SimdFloat &m, const SimdFloat &a, const SimdFloat &b) {
+        SimdFloat r; for (int i = 0; i < N; ++i) r.v[i] = bits(m.v[i]) ? a.v[i] : b.v[i]; return r;
+    }
+    friend uint32_t movemask(const SimdFloat &m) {
+        uint32_t r = 0; for (int i = 0; i < N; ++i) r |= (bits(m.v[i]) >> 31) << i; return r;
+    }
+
+private:
+    static uint32_t bits(float f) { uint32_t b; memcpy(&b, &f, 4); return b; }
+    static float fromBits(uint32_t b) { float f; memcpy(&f, &b, 4); return f; }
+    static float mask(bool value) { return fromBits(value ? 0xFFFFFFFFu : 0u); }
+};
+
+#if defined(NORI_SIMD_SSE)
+template <> struct SimdFloat<4> {
+    __m128 m;
+
+    SimdFloat() { }
+    SimdFloat(__m128 m) : m(m) { }
+    explicit SimdFloat(float value) : m(_mm_set1_ps(value)) { }
+
+    static SimdFloat load(const float *ptr) { return _mm_loadu_ps(ptr); }
+    void store(float *ptr) const { _mm_storeu_ps(ptr, m); }
+
+    friend SimdFloat operator+(const SimdFloat &a, const SimdFloat &b) { return _mm_add_ps(a.m, b.m); }
+    friend SimdFloat operator-(const SimdFloat &a, const SimdFloat &b) { return _mm_sub_ps(a.m, b.m); }
+    friend SimdFloat operator*(const SimdFloat &a, const SimdFloat &b) { return _mm_mul_ps(a.m, b.m); }
+    friend SimdFloat operator/(const SimdFloat &a, const SimdFloat &b) { return _mm_div_ps(a.m, b.m); }
+    friend SimdFloat operator<(const SimdFloat &a, const SimdFloat &b) { return _mm_cmplt_ps(a.m, b.m); }
+    friend SimdFloat operator<=(const SimdFloat &a, const SimdFloat &b) { return _mm_cmple_ps(a.m, b.m); }
+    friend SimdFloat operator>(const SimdFloat &a, const SimdFloat &b) { return _mm_cmpgt_ps(a.m, b.m); }
+    friend SimdFloat operator>=(const SimdFloat &a, const SimdFloat &b) { return _mm_cmpge_ps(a.m, b.m); }
+    friend SimdFloat operator&(const SimdFloat &a, const SimdFloat &b) { return _mm_and_ps(a.m, b.m); }
+    friend SimdFloat operator|(const SimdFloat &a, const SimdFloat &b) { return _mm_or_ps(a.m, b.m); }
+    friend SimdFloat min(const SimdFloat &a, const SimdFloat &b) { return _mm_min_ps(a.m, b.m); }
+    friend SimdFloat max(const SimdFloat &a, const SimdFloat &b) { return _mm_max_ps(a.m, b.m); }
+    friend SimdFloat abs(const SimdFloat &a) { return _mm_andnot_ps(_mm_set1_ps(-0.f), a.m); }
+    friend SimdFloat select(const SimdFloat &m, const SimdFloat &a, const SimdFloat &b) {
+        return _mm_or_ps(_mm_and_ps(m.m, a.m), _mm_andnot_ps(m.m, b.m));
+    }
+    friend uint32_t movemask(const SimdFloat &m) { return (uint32_t) _mm_movemask_ps(m.m); }
+};
+#endif
+
+#if defined(NORI_SIMD_AVX)
+template <> struct SimdFloat<8> {
+    __m256 m;
+
+    SimdFloat() { }
+    SimdFloat(__m256 m) : m(m) { }
+    explicit SimdFloat(float value) : m(_mm256_set1_ps(value)) { }
+
+    static SimdFloat load(const float *ptr) { return _mm256_loadu_ps(ptr); }
+    void store(float *ptr) const { _mm256_storeu_ps(ptr, m); }
+
+    friend SimdFloat operator+(const SimdFloat &a, const SimdFloat &b) { return _mm256_add_ps(a.m, b.m); }
+    friend SimdFloat operator-(const SimdFloat &a, const SimdFloat &b) { return _mm256_sub_ps(a.m, b.m); }
+    friend SimdFloat operator*(const SimdFloat &a, const SimdFloat &b) { return _mm256_mul_ps(a.m, b.m); }
+    friend SimdFloat operator/(const SimdFloat &a, const SimdFloat &b) { return _mm256_div_ps(a.m, b.m); }
+    friend SimdFloat operator<(const SimdFloat &a, const SimdFloat &b) { return _mm256_cmp_ps(a.m, b.m, _CMP_LT_OQ); }
+    friend SimdFloat operator<=(const SimdFloat &a, const SimdFloat &b) { return _mm256_cmp_ps(a.m, b.m, _CMP_LE_OQ); }
+    friend SimdFloat operator>(const SimdFloat &a, const SimdFloat &b) { return _mm256_cmp_ps(a.m, b.m, _CMP_GT_OQ); }
+    friend SimdFloat operator>=(const SimdFloat &a, const SimdFloat &b) { return _mm256_cmp_ps(a.m, b.m, _CMP_GE_OQ); }
+    friend SimdFloat operator&(const SimdFloat &a, const SimdFloat &b) { return _mm256_and_ps(a.m, b.m); }
+    friend SimdFloat operator|(const SimdFloat &a, const SimdFloat &b) { return _mm256_or_ps(a.m, b.m); }
+    friend SimdFloat min(const SimdFloat &a, const SimdFloat &b) { return _mm256_min_ps(a.m, b.m); }
+    friend SimdFloat max(const SimdFloat &a, const SimdFloat &b) { return _mm256_max_ps(a.m, b.m); }
+    friend SimdFloat abs(const SimdFloat &a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.f), a.m); }
+    friend SimdFloat select(const SimdFloat &m, const SimdFloat &a, const SimdFloat &b) {
+        return _mm256_blendv_ps(b.m, a.m, m.m);
+    }
+    friend uint32_t movemask(const SimdFloat &m) { return (uint32_t) _mm256_movemask_ps(m.m); }
+};
+#endif
+
+/// Index of the lowest set bit in a (nonzero) lane mask
+inline int lowestBit(uint32_t mask) {
+    int index = 0;
+    while (!(mask & 1u)) {
+        mask >>= 1;
+        ++index;
+    }
+    return index;
+}
+
+NORI_NAMESPACE_END
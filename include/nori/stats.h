@@ -0,0 +1,68 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <nori/common.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Counters of the ray tracing work done during a render
+ *
+ * Every thread updates its own copy (see \ref local()), so counting
+ * costs a few additions per ray and no synchronization. The copies
+ * are only summed up when the statistics are reported.
+ */
+struct RayStatistics {
+    uint64_t radianceRays = 0;  ///< Closest-hit queries
+    uint64_t shadowRays = 0;    ///< Occlusion queries
+    uint64_t nodeVisits = 0;    ///< BVH nodes visited by single rays
+    uint64_t triangleTests = 0; ///< Ray-triangle tests of single rays
+    uint64_t paths = 0;         ///< Camera samples (one path each)
+    uint64_t pageIns = 0;       ///< Lazy meshes loaded on demand
+    uint64_t evictions = 0;     ///< Lazy meshes released to stay within the memory budget
+
+    /// Total number of rays cast
+    uint64_t rays() const { return radianceRays + shadowRays; }
+
+    /// Accumulate the counters of another record
+    RayStatistics &operator+=(const RayStatistics &stats);
+
+    /// Return the difference between two snapshots of the counters
+    RayStatistics operator-(const RayStatistics &stats) const;
+
+    /// Return the counters of the calling thread
+    static RayStatistics &local();
+
+    /// Return the sum of the counters of all threads
+    static RayStatistics total();
+
+    /// Reset the counters of all threads
+    static void reset();
+
+    /**
+     * \brief Return a human-readable summary
+     *
+     * The average path depth is the number of radiance rays per path,
+     * i.e. the camera ray plus one ray per bounce.
+     */
+    std::string toString() const;
+};
+
+NORI_NAMESPACE_END
@@ -17,10 +17,12 @@
 */
 
 #include <nori/accel.h>
+#include <nori/stats.h>
 #include <nori/timer.h>
 #include <tbb/tbb.h>
 #include <Eigen/Geometry>
 #include <atomic>
+#include <chrono>
 
 /*
  * =======================================================================
@@ -42,20 +44,25 @@ struct Bins {
 };
 
 /**
- * \brief Build task for parallel BVH construction
+ * \brief Parallel binned SAH builder
  *
- * This class uses the task scheduling system of Intel' Thread Building Blocks
- * to parallelize the divide and conquer BVH build at all levels.
+ * Nodes with many triangles are split along their largest axis by sorting
+ * the triangle centroids into 16 bins and evaluating the SAH at the bin
+ * boundaries. The binning and partitioning steps are themselves parallel,
+ * and the two subtrees of every split are built concurrently using
+ * \c tbb::parallel_invoke, so that all threads are busy from the root on.
+ * Below \c SERIAL_THRESHOLD triangles, an exact sweep over all three axes
+ * takes over.
  *
  * The used methodology is roughly that described in
  * "Fast and Parallel Construction of SAH-based Bounding Volume Hierarchies"
  * by Ingo Wald (Proc. IEEE/EG Symposium on Interactive Ray Tracing, 2007)
  */
-class BVHBuildTask : public tbb::task {
+class BVHBuilder {
 private:
     Accel &bvh;
-    uint32_t node_idx;
-    uint32_t *start, *end, *temp;
+    std::vector<Point3f> centroids;      ///< Cached centroid of every triangle
+    std::vector<BoundingBox3f> bboxes;   ///< Cached bounding box of every triangle
 
 public:
     /// Build-related parameters
@@ -74,11 +81,24 @@ public:
     };
 
 public:
+    /// Create a new builder and cache the centroid and bounding box of every triangle
+    BVHBuilder(Accel &bvh) : bvh(bvh) {
+        uint32_t size = bvh.getTriangleCount();
+        centroids.resize(size);
+        bboxes.resize(size);
+        tbb::parallel_for(
+            tbb::blocked_range<uint32_t>(0u, size, GRAIN_SIZE),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                    centroids[i] = bvh.getCentroid(i);
+                    bboxes[i] = bvh.getBoundingBox(i);
+                }
+            }
+        );
+    }
+
     /**
-     * Create a new build task
-     *
-     * \param bvh
-     *    Reference to the underlying BVH
+     * Build the subtree below a node
      *
      * \param node_idx
      *    Index of the BVH node that should be built
@@ -94,19 +114,15 @@ public:
      *    construction purposes. The usable length is <tt>end-start</tt>
      *    unsigned integers.
      */
-    BVHBuildTask(Accel &bvh, uint32_t node_idx, uint32_t *start, uint32_t *end, uint32_t *temp)
-        : bvh(bvh), node_idx(node_idx), start(start), end(end), temp(temp) { }
-
-    task *execute() {
+    void build(uint32_t node_idx, uint32_t *start, uint32_t *end, uint32_t *temp) {
         uint32_t size = (uint32_t) (end-start);
         Accel::BVHNode &node = bvh.m_nodes[node_idx];
 
         /* Switch to a serial build when less than SERIAL_THRESHOLD triangles are left */
         if (size < SERIAL_THRESHOLD) {
-            execute_serially(bvh, node_idx, start, end, temp);
-            return nullptr;
+            build_serially(node_idx, start, end, temp);
+            return;
         }
-
         /* Always split along the largest axis */
         int axis = node.bbox.getLargestAxis();
         float min = node.bbox.min[axis], max = node.bbox.max[axis],
@@ -120,14 +136,14 @@ public:
             [&](const tbb::blocked_range<uint32_t> &range, Bins result) {
                 for (uint32_t i = range.begin(); i != range.end(); ++i) {
                     uint32_t f = start[i];
-                    float centroid = bvh.getCentroid(f)[axis];
+                    float centroid = centroids[f][axis];
 
                     int index = std::min(std::max(
                         (int) ((centroid - min) * inv_bin_size), 0),
                         (Bins::BIN_COUNT - 1));
 
                     result.counts[index]++;
-                    result.bbox[index].expandBy(bvh.getBoundingBox(f));
+                    result.bbox[index].expandBy(bboxes[f]);
                 }
                 return result;
             },
@@ -171,8 +187,8 @@ public:
         if (best_index == -1) {
             /* Could not find a good split plane -- retry with
                more careful serial code just to be sure.. */
-            execute_serially(bvh, node_idx, start, end, temp);
-            return nullptr;
+            build_serially(node_idx, start, end, temp);
+            return;
         }
 
         uint32_t left_count = bins.counts[best_index];
@@ -194,7 +210,7 @@ public:
                 uint32_t count_left = 0, count_right = 0;
                 for (uint32_t i = range.begin(); i != range.end(); ++i) {
                     uint32_t f = start[i];
-                    float centroid = bvh.getCentroid(f)[axis];
+                    float centroid = centroids[f][axis];
                     int index = (int) ((centroid - min) * inv_bin_size);
                     (index <= best_index ? count_left : count_right)++;
                 }
@@ -202,7 +218,7 @@ public:
                 uint32_t idx_r = offset_right.fetch_add(count_right);
                 for (uint32_t i = range.begin(); i != range.end(); ++i) {
                     uint32_t f = start[i];
-                    float centroid = bvh.getCentroid(f)[axis];
+                    float centroid = centroids[f][axis];
                     int index = (int) ((centroid - min) * inv_bin_size);
                     if (index <= best_index)
                         temp[idx_l++] = f;
@@ -214,26 +230,15 @@ public:
         memcpy(start, temp, size * sizeof(uint32_t));
         assert(offset_left == left_count && offset_right == size);
 
-        /* Create an empty parent task */
-        tbb::task& c = *new (allocate_continuation()) tbb::empty_task;
-        c.set_ref_count(2);
-
-        /* Post right subtree to scheduler */
-        BVHBuildTask &b = *new (c.allocate_child())
-            BVHBuildTask(bvh, node_idx_right, start + left_count,
-                         end, temp + left_count);
-        spawn(b);
-
-        /* Directly start working on left subtree */
-        recycle_as_child_of(c);
-        node_idx = node_idx_left;
-        end = start + left_count;
-
-        return this;
+        /* Build both subtrees in parallel */
+        tbb::parallel_invoke(
+            [&] { build(node_idx_left, start, start + left_count, temp); },
+            [&] { build(node_idx_right, start + left_count, end, temp + left_count); }
+        );
     }
 
     /// Single-threaded build function
-    static void execute_serially(Accel &bvh, uint32_t node_idx, uint32_t *start, uint32_t *end, uint32_t *temp) {
+    void build_serially(uint32_t node_idx, uint32_t *start, uint32_t *end, uint32_t *temp) {
         Accel::BVHNode &node = bvh.m_nodes[node_idx];
         uint32_t size = (uint32_t) (end - start);
         float best_cost = (float) INTERSECTION_COST * size;
@@ -244,13 +249,13 @@ public:
         for (int axis=0; axis<3; ++axis) {
             /* Sort all triangles based on their centroid positions projected on the axis */
             std::sort(start, end, [&](uint32_t f1, uint32_t f2) {
-                return bvh.getCentroid(f1)[axis] < bvh.getCentroid(f2)[axis];
+                return centroids[f1][axis] < centroids[f2][axis];
             });
 
             BoundingBox3f bbox;
             for (uint32_t i = 0; i<size; ++i) {
                 uint32_t f = *(start + i);
-                bbox.expandBy(bvh.getBoundingBox(f));
+                bbox.expandBy(bboxes[f]);
                 left_areas[i] = (float) bbox.getSurfaceArea();
             }
             if (axis == 0)
@@ -262,7 +267,7 @@ public:
             float tri_factor = INTERSECTION_COST / node.bbox.getSurfaceArea();
             for (uint32_t i = size-1; i>=1; --i) {
                 uint32_t f = *(start + i);
-                bbox.expandBy(bvh.getBoundingBox(f));
+                bbox.expandBy(bboxes[f]);
 
                 float left_area = left_areas[i-1];
                 float right_area = bbox.getSurfaceArea();
@@ -290,7 +295,7 @@ public:
         }
 
         std::sort(start, end, [&](uint32_t f1, uint32_t f2) {
-            return bvh.getCentroid(f1)[best_axis] < bvh.getCentroid(f2)[best_axis];
+            return centroids[f1][best_axis] < centroids[f2][best_axis];
         });
 
         uint32_t left_count = (uint32_t) best_index;
@@ -300,12 +305,25 @@ public:
         node.inner.axis = best_axis;
         node.inner.flag = 0;
 
-        execute_serially(bvh, node_idx_left, start, start + left_count, temp);
-        execute_serially(bvh, node_idx_right, start+left_count, end, temp + left_count);
+        build_serially(node_idx_left, start, start + left_count, temp);
+        build_serially(node_idx_right, start+left_count, end, temp + left_count);
     }
 };
 
 void Accel::addMesh(Mesh *mesh) {
+    if (mesh->isLazy()) {
+        LazyMeshRef *ref = new LazyMeshRef();
+        ref->mesh = mesh;
+        ref->bbox = mesh->getBoundingBox();
+        m_lazyMeshes.push_back(ref);
+        m_bbox.expandBy(ref->bbox);
+        return;
+    }
+    if (mesh->isMoving()) {
+        m_movingMeshes.push_back(mesh);
+        m_bbox.expandBy(mesh->getBoundingBox());
+        return;
+    }
     m_meshes.push_back(mesh);
     m_meshOffset.push_back(m_meshOffset.back() + mesh->getTriangleCount());
     m_bbox.expandBy(mesh->getBoundingBox());
@@ -314,28 +332,129 @@ void Accel::addMesh(Mesh *mesh) {
 void Accel::clear() {
     for (auto mesh : m_meshes)
         delete mesh;
+    for (auto mesh : m_movingMeshes)
+        delete mesh;
+    for (auto accel : m_sharedMeshes)
+        delete accel;
+    for (auto ref : m_lazyMeshes) {
+        /* The bottom-level BVH does not own the mesh */
+        Accel *accel = ref->accel.load();
+        if (accel) {
+            accel->m_meshes.clear();
+            delete accel;
+        }
+        delete ref->mesh;
+        delete ref;
+    }
     m_meshes.clear();
+    m_movingMeshes.clear();
+    m_motionPrimitives.clear();
+    m_motionSegments.clear();
+    m_motionNodes.clear();
+    m_motionIndices.clear();
+    m_motionTriangles.clear();
+    m_sharedMeshes.clear();
+    m_instances.clear();
+    m_instanceNodes.clear();
+    m_lazyMeshes.clear();
+    m_lazyNodes.clear();
+    m_lazyMemory = 0;
     m_meshOffset.clear();
     m_meshOffset.push_back(0u);
     m_nodes.clear();
     m_indices.clear();
+    m_primitives.clear();
+    m_nodes4.clear();
+    m_nodes8.clear();
+    m_quantized4.clear();
+    m_quantized8.clear();
+    m_triangles.clear();
+    m_triangleStride = 0;
+    m_nodeData = nullptr;
+    m_primitiveData = nullptr;
+    m_triangleData = nullptr;
+    m_wideNodeData = nullptr;
+    m_cacheFile.reset();
     m_bbox.reset();
     m_nodes.shrink_to_fit();
     m_meshes.shrink_to_fit();
+    m_sharedMeshes.shrink_to_fit();
+    m_instances.shrink_to_fit();
+    m_instanceNodes.shrink_to_fit();
+    m_lazyMeshes.shrink_to_fit();
+    m_lazyNodes.shrink_to_fit();
     m_meshOffset.shrink_to_fit();
     m_indices.shrink_to_fit();
+    m_primitives.shrink_to_fit();
+    m_nodes4.shrink_to_fit();
+    m_nodes8.shrink_to_fit();
+    m_quantized4.shrink_to_fit();
+    m_quantized8.shrink_to_fit();
+    m_triangles.shrink_to_fit();
+    m_movingMeshes.shrink_to_fit();
+    m_motionPrimitives.shrink_to_fit();
+    m_motionSegments.shrink_to_fit();
+    m_motionNodes.shrink_to_fit();
+    m_motionIndices.shrink_to_fit();
+    m_motionTriangles.shrink_to_fit();
 }
 
 void Accel::build() {
+    /* Every shared mesh gets a bottom-level BVH of the same kind */
+    for (auto accel : m_sharedMeshes) {
+        accel->setLayout(m_layout);
+        accel->setBuildMethod(m_buildMethod);
+        accel->setCompressed(m_compressed);
+        accel->setWatertight(m_watertight);
+        accel->setCacheDirectory(m_cacheDirectory);
+        accel->build();
+    }
+
+    if (getTriangleCount() > 0) {
+        if (m_cacheDirectory.empty()) {
+            buildGeometry();
+        } else {
+            uint64_t key = cacheKey();
+            std::string filename = tfm::format("%s/bvh-%016x.bin", m_cacheDirectory, key);
+            if (!loadCache(filename, key)) {
+                auto start = std::chrono::system_clock::now();
+                buildGeometry();
+                writeCache(filename, key, std::chrono::duration<double>(
+                    std::chrono::system_clock::now() - start).count());
+            }
+        }
+    }
+
+    if (!m_instances.empty())
+        buildInstances();
+
+    if (!m_lazyMeshes.empty())
+        buildLazy();
+
+    if (!m_movingMeshes.empty())
+        buildMotion();
+}
+
+void Accel::buildGeometry() {
     uint32_t size  = getTriangleCount();
-    if (size == 0)
-        return;
-    cout << "Constructing a SAH BVH (" << m_meshes.size()
-        << (m_meshes.size() == 1 ? " mesh, " : " meshes, ")
-        << size << " triangles) .. ";
-    cout.flush();
+    static const char *methodNames[] = { "SAH BVH", "LBVH", "HLBVH", "SBVH" };
+    if (!m_quiet) {
+        cout << "Constructing a " << methodNames[m_buildMethod] << " (" << m_meshes.size()
+            << (m_meshes.size() == 1 ? " mesh, " : " meshes, ")
+            << size << " triangles) .. ";
+        cout.flush();
+    }
     Timer timer;
 
+    /* Time spent in the individual phases, reported once the build is done */
+    std::vector<std::pair<const char *, double>> phases;
+    auto phaseStart = std::chrono::system_clock::now();
+    auto endPhase = [&](const char *name) {
+        auto now = std::chrono::system_clock::now();
+        phases.emplace_back(name, std::chrono::duration<double>(now - phaseStart).count());
+        phaseStart = now;
+    };
+
     /* Conservative estimate for the total number of nodes */
     m_nodes.resize(2*size);
     memset(m_nodes.data(), 0, sizeof(BVHNode) * m_nodes.size());
@@ -348,11 +467,28 @@ void Accel::build() {
     for (uint32_t i = 0; i < size; ++i)
         m_indices[i] = i;
 
-    uint32_t *indices = m_indices.data(), *temp = new uint32_t[size];
-    BVHBuildTask& task = *new(tbb::task::allocate_root())
-        BVHBuildTask(*this, 0u, indices, indices + size , temp);
-    tbb::task::spawn_root_and_wait(task);
-    delete[] temp;
+    /* Resolve the mesh of every primitive once, so that neither the
+       build nor the traversal has to search m_meshOffset */
+    m_primitives.resize(size);
+    for (uint32_t i = 0; i < (uint32_t) m_meshes.size(); ++i)
+        for (uint32_t j = m_meshOffset[i]; j < m_meshOffset[i+1]; ++j)
+            m_primitives[j] = PrimitiveRef { i, j - m_meshOffset[i] };
+
+    if (m_buildMethod == ESAH) {
+        BVHBuilder builder(*this);
+        endPhase("preparing primitives");
+
+        uint32_t *indices = m_indices.data(), *temp = new uint32_t[size];
+        builder.build(0u, indices, indices + size, temp);
+        delete[] temp;
+        endPhase("binned SAH build");
+    } else if (m_buildMethod == ESBVH) {
+        buildSpatial();
+        endPhase("spatial split build");
+    } else {
+        buildMorton(endPhase);
+    }
+
     std::pair<float, uint32_t> stats = statistics();
 
     /* The node array was allocated conservatively and now contains
@@ -373,18 +509,49 @@ void Accel::build() {
                 (skipped - skipped_accum[new_node.inner.rightChild]));
         }
     }
-    cout << "done (took " << timer.elapsedString() << " and "
-        << memString(sizeof(BVHNode) * m_nodes.size() + sizeof(uint32_t)*m_indices.size())
-        << ", SAH cost = " << stats.first
-        << ")." << endl;
+    endPhase("compaction");
+
+    buildTriangleStore();
+    endPhase("triangle store");
+
+    if (!m_quiet) {
+        cout << "done (took " << timer.elapsedString() << " and "
+            << memString(sizeof(BVHNode) * m_nodes.size() + sizeof(uint32_t)*m_indices.size())
+            << " + " << memString(sizeof(float) * m_triangles.size()
+                                  + sizeof(PrimitiveRef) * m_primitives.size()) << " triangle data"
+            << ", SAH cost = " << stats.first
+            << ", " << stats.second << " nodes";
+        if (m_indices.size() > size)
+            cout << ", " << m_indices.size() - size << " duplicate references";
+        cout << ")." << endl;
+
+        for (const auto &phase : phases)
+            cout << "# benchmark # BVH phase \"" << phase.first << "\" took: "
+                 << phase.second << " s" << endl;
+    }
 
     m_nodes = std::move(compactified);
+
+    if (m_layout != EBinary)
+        buildWide();
+
+    setTraversalData();
+}
+
+void Accel::setTraversalData() {
+    m_nodeData = m_nodes.data();
+    m_primitiveData = m_primitives.data();
+    m_triangleData = m_triangles.data();
+    if (m_layout == EWide8)
+        m_wideNodeData = m_compressed ? (const void *) m_quantized8.data() : (const void *) m_nodes8.data();
+    else if (m_layout == EWide4)
+        m_wideNodeData = m_compressed ? (const void *) m_quantized4.data() : (const void *) m_nodes4.data();
 }
 
 std::pair<float, uint32_t> Accel::statistics(uint32_t node_idx) const {
     const BVHNode &node = m_nodes[node_idx];
     if (node.isLeaf()) {
-        return std::make_pair((float) BVHBuildTask::INTERSECTION_COST * node.leaf.size, 1u);
+        return std::make_pair((float) BVHBuilder::INTERSECTION_COST * node.leaf.size, 1u);
     } else {
         std::pair<float, uint32_t> stats_left = statistics(node_idx + 1u);
         std::pair<float, uint32_t> stats_right = statistics(node.inner.rightChild);
@@ -392,7 +559,7 @@ std::pair<float, uint32_t> Accel::statistics(uint32_t node_idx) const {
         float saRight = m_nodes[node.inner.rightChild].bbox.getSurfaceArea();
         float saCur = node.bbox.getSurfaceArea();
         float sahCost =
-            2 * BVHBuildTask::TRAVERSAL_COST +
+            2 * BVHBuilder::TRAVERSAL_COST +
             (saLeft * stats_left.first + saRight * stats_right.first) / saCur;
         return std::make_pair(
             sahCost,
@@ -401,106 +568,226 @@ std::pair<float, uint32_t> Accel::statistics(uint32_t node_idx) const {
     }
 }
 
-bool Accel::rayIntersect(const Ray3f &_ray, Intersection &its, bool shadowRay) const {
-    uint32_t node_idx = 0, stack_idx = 0, stack[64];
+size_t Accel::getMemoryUsage() const {
+    return sizeof(BVHNode) * m_nodes.size() + sizeof(uint32_t) * m_indices.size()
+        + sizeof(PrimitiveRef) * m_primitives.size() + sizeof(float) * m_triangles.size()
+        + sizeof(WideBVHNode<4>) * m_nodes4.size() + sizeof(WideBVHNode<8>) * m_nodes8.size()
+        + sizeof(QuantizedWideBVHNode<4>) * m_quantized4.size()
+        + sizeof(QuantizedWideBVHNode<8>) * m_quantized8.size()
+        + (m_cacheFile ? m_cacheFile->size() : 0);
+}
 
+bool Accel::rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay) const {
     its.t = std::numeric_limits<float>::infinity();
 
-    /* Use an adaptive ray epsilon */
+    if (shadowRay)
+        return occluded(ray);
+
+    HitRecord hit;
+    if (!rayIntersect(ray, hit))
+        return false;
+
+    computeIntersection(hit, its);
+    return true;
+}
+
+bool Accel::rayIntersect(const Ray3f &_ray, HitRecord &hit) const {
+    Ray3f ray(_ray);
+    hit = HitRecord();
+    hit.time = ray.time;
+    bool result = traverse(ray, hit, false);
+
+    RayStatistics &stats = RayStatistics::local();
+    stats.radianceRays++;
+    stats.nodeVisits += hit.nodeVisits;
+    stats.triangleTests += hit.triangleTests;
+    return result;
+}
+
+bool Accel::occluded(const Ray3f &_ray) const {
     Ray3f ray(_ray);
+    HitRecord hit;
+    bool result = traverse(ray, hit, true);
+
+    RayStatistics &stats = RayStatistics::local();
+    stats.shadowRays++;
+    stats.nodeVisits += hit.nodeVisits;
+    stats.triangleTests += hit.triangleTests;
+    return result;
+}
+
+bool Accel::traverse(Ray3f &ray, HitRecord &hit, bool shadowRay) const {
+    /* Use an adaptive ray epsilon */
     if (ray.mint == Epsilon)
         ray.mint = std::max(ray.mint, ray.mint * ray.o.array().abs().maxCoeff());
 
-    if (m_nodes.empty() || ray.maxt < ray.mint)
+    if (ray.maxt < ray.mint)
         return false;
 
     bool foundIntersection = false;
-    uint32_t f = 0;
+    if (m_nodeData)
+        foundIntersection = rayIntersectBVH(ray, hit, shadowRay);
 
-    while (true) {
-        const BVHNode &node = m_nodes[node_idx];
+    /* The top-level BVH only has to look for closer hits */
+    if (!m_instances.empty() && !(foundIntersection && shadowRay)) {
+        if (rayIntersectInstances(ray, hit, shadowRay))
+            foundIntersection = true;
+    }
 
-        if (!node.bbox.rayIntersect(ray)) {
-            if (stack_idx == 0)
-                break;
-            node_idx = stack[--stack_idx];
-            continue;
-        }
+    /* Same for the moving meshes */
+    if (!m_motionSegments.empty() && !(foundIntersection && shadowRay)) {
+        if (rayIntersectMotion(ray, hit, shadowRay))
+            foundIntersection = true;
+    }
 
-        if (node.isInner()) {
-            stack[stack_idx++] = node.inner.rightChild;
-            node_idx++;
-            assert(stack_idx<64);
-        } else {
-            for (uint32_t i = node.start(), end = node.end(); i < end; ++i) {
-                uint32_t idx = m_indices[i];
-                const Mesh *mesh = m_meshes[findMesh(idx)];
-
-                float u, v, t;
-                if (mesh->rayIntersect(idx, ray, u, v, t)) {
-                    if (shadowRay)
-                        return true;
-                    foundIntersection = true;
-                    ray.maxt = its.t = t;
-                    its.uv = Point2f(u, v);
-                    its.mesh = mesh;
-                    f = idx;
-                }
-            }
-            if (stack_idx == 0)
-                break;
-            node_idx = stack[--stack_idx];
-            continue;
-        }
+    /* The lazy meshes come last, so that the closer hits found above
+       keep the meshes behind them from being loaded */
+    if (!m_lazyMeshes.empty() && !(foundIntersection && shadowRay)) {
+        if (rayIntersectLazy(ray, hit, shadowRay))
+            foundIntersection = true;
     }
 
-    if (foundIntersection) {
-        /* Find the barycentric coordinates */
-        Vector3f bary;
-        bary << 1-its.uv.sum(), its.uv;
+    return foundIntersection;
+}
 
-        /* References to all relevant mesh buffers */
-        const Mesh *mesh   = its.mesh;
-        const MatrixXf &V  = mesh->getVertexPositions();
-        const MatrixXf &N  = mesh->getVertexNormals();
-        const MatrixXf &UV = mesh->getVertexTexCoords();
-        const MatrixXu &F  = mesh->getIndices();
+void Accel::computeIntersection(const HitRecord &hit, Intersection &its) const {
+    its.t = hit.t;
+    its.uv = Point2f(hit.u, hit.v);
+    its.attempts = hit.triangleTests;
+    its.nodeVisits = hit.nodeVisits;
+    its.time = hit.time;
+    if (hit.instance == HitRecord::Moving)
+        resolveMotionIntersection(its, hit.prim);
+    else if (hit.instance == HitRecord::NoInstance)
+        resolveIntersection(its, hit.prim);
+    else if (hit.instance & HitRecord::Lazy)
+        resolveLazyIntersection(its, hit.instance & ~HitRecord::Lazy, hit.prim);
+    else
+        resolveInstanceIntersection(its, hit.instance, hit.prim);
+}
 
-        /* Vertex indices of the triangle */
-        uint32_t idx0 = F(0, f), idx1 = F(1, f), idx2 = F(2, f);
+/// Test a ray segment against a box, also returning the entry distance
+static inline bool rayIntersectBox(const BoundingBox3f &bbox, const Ray3f &ray, float &nearT) {
+    float farT;
+    return bbox.rayIntersect(ray, nearT, farT) && ray.mint <= farT && nearT <= ray.maxt;
+}
 
-        Point3f p0 = V.col(idx0), p1 = V.col(idx1), p2 = V.col(idx2);
+bool Accel::rayIntersectBinary(Ray3f &ray, HitRecord &hit, bool shadowRay) const {
+    struct StackEntry {
+        uint32_t node_idx;
+        float tnear;
+    };
+    StackEntry stack[64];
+    uint32_t node_idx = 0, stack_idx = 0;
+    bool foundIntersection = false;
+    float tnear;
 
-        /* Compute the intersection positon accurately
-           using barycentric coordinates */
-        its.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
+    hit.nodeVisits++;
+    if (!rayIntersectBox(m_nodeData[0].bbox, ray, tnear))
+        return false;
 
-        /* Compute proper texture coordinates if provided by the mesh */
-        if (UV.size() > 0)
-            its.uv = bary.x() * UV.col(idx0) +
-                bary.y() * UV.col(idx1) +
-                bary.z() * UV.col(idx2);
+    while (true) {
+        const BVHNode &node = m_nodeData[node_idx];
 
-        /* Compute the geometry frame */
-        its.geoFrame = Frame((p1-p0).cross(p2-p0).normalized());
+        if (node.isInner()) {
+            /* Visit the child on the near side of the split plane first,
+               so that its hits can cull the far side */
+            uint32_t nearChild = node_idx + 1, farChild = node.inner.rightChild;
+            if (ray.d[node.inner.axis] < 0)
+                std::swap(nearChild, farChild);
+
+            float tnearNear, tnearFar;
+            bool hitNear = rayIntersectBox(m_nodeData[nearChild].bbox, ray, tnearNear);
+            bool hitFar = rayIntersectBox(m_nodeData[farChild].bbox, ray, tnearFar);
+            hit.nodeVisits += 2;
+
+            if (hitNear) {
+                if (hitFar) {
+                    stack[stack_idx++] = StackEntry { farChild, tnearFar };
+                    assert(stack_idx < 64);
+                }
+                node_idx = nearChild;
+                continue;
+            } else if (hitFar) {
+                node_idx = farChild;
+                continue;
+            }
+        } else if (intersectLeaf(node.start(), node.end(), ray, hit, shadowRay)) {
+            if (shadowRay)
+                return true;
+            foundIntersection = true;
+        }
 
-        if (N.size() > 0) {
-            /* Compute the shading frame. Note that for simplicity,
-               the current implementation doesn't attempt to provide
-               tangents that are continuous across the surface. That
-               means that this code will need to be modified to be able
-               use anisotropic BRDFs, which need tangent continuity */
+        /* Pop the next subtree, skipping the ones that start
+           behind the closest hit found so far */
+        do {
+            if (stack_idx == 0)
+                return foundIntersection;
+            --stack_idx;
+        } while (stack[stack_idx].tnear > ray.maxt);
+        node_idx = stack[stack_idx].node_idx;
+    }
+}
 
+void Accel::computeGeometry(Intersection &its, uint32_t f) const {
+    const Mesh *mesh = its.mesh;
+    const MatrixXf &V = mesh->getVertexPositions();
+    computeGeometry(its, f, V.col(mesh->getVertexIndex(f, 0)), V.col(mesh->getVertexIndex(f, 1)),
+                    V.col(mesh->getVertexIndex(f, 2)));
+}
+
+void Accel::computeGeometry(Intersection &its, uint32_t f, const Point3f &p0,
+                            const Point3f &p1, const Point3f &p2) const {
+    /* Find the barycentric coordinates */
+    Vector3f bary;
+    bary << 1-its.uv.sum(), its.uv;
+
+    /* Vertex indices of the triangle (quantized attributes are decoded below) */
+    const Mesh *mesh = its.mesh;
+    its.bsdf = mesh->getBSDF(f);
+    uint32_t idx0 = mesh->getVertexIndex(f, 0), idx1 = mesh->getVertexIndex(f, 1),
+             idx2 = mesh->getVertexIndex(f, 2);
+
+    /* Compute the intersection positon accurately
+       using barycentric coordinates */
+    its.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
+
+    /* Bound the rounding error of the interpolation, plus the error of
+       the weights themselves (1-u-v does not sum up to one exactly) */
+    Vector3f pAbsSum = (bary.x() * p0).cwiseAbs() + (bary.y() * p1).cwiseAbs() +
+                       (bary.z() * p2).cwiseAbs();
+    its.pError = errorBound(7) * pAbsSum + errorBound(3) * its.p.cwiseAbs();
+
+    /* Compute proper texture coordinates if provided by the mesh */
+    if (mesh->hasVertexTexCoords())
+        its.uv = bary.x() * mesh->getVertexTexCoord(idx0) +
+            bary.y() * mesh->getVertexTexCoord(idx1) +
+            bary.z() * mesh->getVertexTexCoord(idx2);
+
+    /* Compute the geometry frame */
+    its.geoFrame = Frame((p1-p0).cross(p2-p0).normalized());
+
+    if (mesh->hasVertexNormals()) {
+        /* Compute the shading frame. Note that for simplicity,
+           the current implementation doesn't attempt to provide
+           tangents that are continuous across the surface. That
+           means that this code will need to be modified to be able
+           use anisotropic BRDFs, which need tangent continuity */
+
+        const MatrixXf &N = mesh->getVertexNormals();
+        if (mesh->isMoving() || mesh->isQuantized())
+            its.shFrame = Frame(
+                (bary.x() * mesh->getVertexNormal(idx0, its.time) +
+                 bary.y() * mesh->getVertexNormal(idx1, its.time) +
+                 bary.z() * mesh->getVertexNormal(idx2, its.time)).normalized());
+        else
             its.shFrame = Frame(
                 (bary.x() * N.col(idx0) +
                  bary.y() * N.col(idx1) +
                  bary.z() * N.col(idx2)).normalized());
-        } else {
-            its.shFrame = its.geoFrame;
-        }
+    } else {
+        its.shFrame = its.geoFrame;
     }
-
-    return foundIntersection;
 }
 
 NORI_NAMESPACE_END
@@ -0,0 +1,237 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/accel.h>
+#include <nori/mappedfile.h>
+#include <nori/simd.h>
+#include <nori/timer.h>
+#include <filesystem/path.h>
+#include <chrono>
+#include <cstdio>
+
+/* ===================================================================
+    BVH cache: the compacted nodes, the index and primitive references
+    and the triangle store are written to a binary file whose name
+    contains a hash of the triangle data and of the build settings.
+    On the next run, the file is memory-mapped and the traversal reads
+    its sections in place instead of building the tree again, so that
+    the tree only occupies the page cache. Changing the
+    meshes, the build method, the node layout (including the node
+    compression) or the SIMD width yields
+    a different key, so that a stale file is simply never looked up.
+ * =================================================================== */
+
+NORI_NAMESPACE_BEGIN
+
+/// Increment whenever the builders or the file layout change
+static const uint32_t CacheVersion = 2;
+
+struct CacheHeader {
+    char magic[8];           ///< "NORIBVH"
+    uint32_t version;        ///< \ref CacheVersion
+    uint32_t triangleStride; ///< Number of entries per triangle store component
+    uint64_t key;            ///< Hash of the input (see Accel::cacheKey())
+    uint64_t nodeCount;      ///< Number of binary nodes
+    uint64_t indexCount;     ///< Number of index references (including duplicates)
+    uint64_t triangleCount;  ///< Number of floats in the triangle store
+    uint64_t wideNodeCount;  ///< Number of wide nodes (of the cached layout)
+    double buildTime;        ///< Time taken by the original build in seconds
+};
+
+/* Every section starts at a multiple of 64 bytes */
+static size_t alignSection(size_t offset) {
+    return (offset + 63) & ~(size_t) 63;
+}
+
+/* 64-bit FNV-1a that consumes 8 bytes per step, with some
+   extra mixing since the words are not random */
+static uint64_t hashBytes(uint64_t hash, const void *data, size_t size) {
+    const uint8_t *ptr = (const uint8_t *) data;
+    for (; size >= 8; ptr += 8, size -= 8) {
+        uint64_t word;
+        memcpy(&word, ptr, 8);
+        hash = (hash ^ word) * 0x100000001b3ull;
+        hash ^= hash >> 29;
+    }
+    for (; size > 0; ++ptr, --size)
+        hash = (hash ^ *ptr) * 0x100000001b3ull;
+    return hash;
+}
+
+template <typename T> static uint64_t hashValue(uint64_t hash, const T &value) {
+    return hashBytes(hash, &value, sizeof(T));
+}
+
+uint64_t Accel::cacheKey() const {
+#if defined(NORI_SIMD_AVX)
+    uint32_t simdWidth = 8;
+#else
+    uint32_t simdWidth = 4;
+#endif
+    uint64_t hash = 0xcbf29ce484222325ull;
+    hash = hashValue(hash, CacheVersion);
+    hash = hashValue(hash, simdWidth);
+    hash = hashValue(hash, (uint32_t) m_layout);
+    hash = hashValue(hash, (uint32_t) m_buildMethod);
+    hash = hashValue(hash, (uint32_t) m_compressed);
+    hash = hashValue(hash, (uint32_t) m_meshes.size());
+
+    /* Only the positions and the faces affect the tree and the triangle store */
+    for (const Mesh *mesh : m_meshes) {
+        const MatrixXf &V = mesh->getVertexPositions();
+        const MatrixXu &F = mesh->getIndices();
+        hash = hashValue(hash, (uint64_t) V.cols());
+        hash = hashValue(hash, (uint64_t) mesh->getTriangleCount());
+        hash = hashBytes(hash, V.data(), sizeof(float) * V.size());
+        if (F.size() > 0) {
+            hash = hashBytes(hash, F.data(), sizeof(uint32_t) * F.size());
+        } else {
+            /* Quantized faces */
+            for (uint32_t f = 0; f < mesh->getTriangleCount(); ++f) {
+                uint32_t indices[3] = { mesh->getVertexIndex(f, 0), mesh->getVertexIndex(f, 1),
+                                        mesh->getVertexIndex(f, 2) };
+                hash = hashBytes(hash, indices, sizeof(indices));
+            }
+        }
+    }
+    return hash;
+}
+
+bool Accel::loadCache(const std::string &filename, uint64_t key) {
+    Timer timer;
+    auto start = std::chrono::system_clock::now();
+
+    std::unique_ptr<MappedFile> file(new MappedFile(filename));
+    if (file->size() < sizeof(CacheHeader))
+        return false;
+
+    CacheHeader header;
+    memcpy(&header, file->data(), sizeof(CacheHeader));
+    if (memcmp(header.magic, "NORIBVH", 8) != 0 || header.version != CacheVersion ||
+        header.key != key || header.indexCount < getTriangleCount())
+        return false;
+
+    size_t wideNodeSize = 0;
+    if (m_layout == EWide8)
+        wideNodeSize = m_compressed ? sizeof(QuantizedWideBVHNode<8>) : sizeof(WideBVHNode<8>);
+    else if (m_layout == EWide4)
+        wideNodeSize = m_compressed ? sizeof(QuantizedWideBVHNode<4>) : sizeof(WideBVHNode<4>);
+
+    /* Locate the sections and check that the file is complete */
+    size_t nodeOffset = alignSection(sizeof(CacheHeader));
+    size_t indexOffset = alignSection(nodeOffset + sizeof(BVHNode) * header.nodeCount);
+    size_t primitiveOffset = alignSection(indexOffset + sizeof(uint32_t) * header.indexCount);
+    size_t triangleOffset = alignSection(primitiveOffset + sizeof(PrimitiveRef) * header.indexCount);
+    size_t wideOffset = alignSection(triangleOffset + sizeof(float) * header.triangleCount);
+    size_t end = wideOffset + wideNodeSize * header.wideNodeCount;
+    if (end > file->size())
+        return false;
+
+    cout << "Loading the BVH from \"" << filename << "\" .. ";
+    cout.flush();
+
+    /* The sections are aligned like the vectors they were written from,
+       since the mapping starts at a page boundary. The index references
+       are only needed by the builders */
+    m_nodeData = (const BVHNode *) (file->data() + nodeOffset);
+    m_primitiveData = (const PrimitiveRef *) (file->data() + primitiveOffset);
+    m_triangleData = (const float *) (file->data() + triangleOffset);
+    m_wideNodeData = m_layout != EBinary ? file->data() + wideOffset : nullptr;
+    m_triangleStride = header.triangleStride;
+    m_cacheFile = std::move(file);
+
+    double loadTime = std::chrono::duration<double>(std::chrono::system_clock::now() - start).count();
+    cout << "done (took " << timer.elapsedString() << " instead of "
+         << timeString(header.buildTime * 1000) << " for a rebuild, "
+         << memString(end) << " mapped, " << header.nodeCount << " nodes)." << endl;
+    cout << "# benchmark # BVH cache load took: " << loadTime << " s (rebuild took: "
+         << header.buildTime << " s)" << endl;
+    return true;
+}
+
+void Accel::writeCache(const std::string &filename, uint64_t key, double buildTime) const {
+    Timer timer;
+    filesystem::path directory(m_cacheDirectory);
+    if (!directory.exists() && !filesystem::create_directories(directory)) {
+        cerr << "Warning: unable to create the BVH cache directory \""
+             << m_cacheDirectory << "\"!" << endl;
+        return;
+    }
+
+    CacheHeader header;
+    memset(&header, 0, sizeof(CacheHeader));
+    memcpy(header.magic, "NORIBVH", 8);
+    header.version = CacheVersion;
+    header.triangleStride = m_triangleStride;
+    header.key = key;
+    header.nodeCount = m_nodes.size();
+    header.indexCount = m_indices.size();
+    header.triangleCount = m_triangles.size();
+    header.wideNodeCount = m_layout == EWide8 ? std::max(m_nodes8.size(), m_quantized8.size())
+        : (m_layout == EWide4 ? std::max(m_nodes4.size(), m_quantized4.size()) : 0);
+    header.buildTime = buildTime;
+
+    /* Write to a temporary file first, so that concurrent runs
+       never observe a partially written cache file */
+    std::string tempFilename = tfm::format("%s.%x.tmp", filename,
+        (uint64_t) std::chrono::steady_clock::now().time_since_epoch().count());
+    FILE *file = fopen(tempFilename.c_str(), "wb");
+    if (!file) {
+        cerr << "Warning: unable to write the BVH cache file \"" << filename << "\"!" << endl;
+        return;
+    }
+
+    size_t offset = 0;
+    bool success = true;
+    auto writeSection = [&](const void *data, size_t size) {
+        static const char padding[64] = { 0 };
+        size_t aligned = alignSection(offset);
+        if (aligned != offset)
+            success &= fwrite(padding, aligned - offset, 1, file) == 1;
+        if (size > 0)
+            success &= fwrite(data, size, 1, file) == 1;
+        offset = aligned + size;
+    };
+    writeSection(&header, sizeof(CacheHeader));
+    writeSection(m_nodes.data(), sizeof(BVHNode) * m_nodes.size());
+    writeSection(m_indices.data(), sizeof(uint32_t) * m_indices.size());
+    writeSection(m_primitives.data(), sizeof(PrimitiveRef) * m_primitives.size());
+    writeSection(m_triangles.data(), sizeof(float) * m_triangles.size());
+    if (m_layout == EWide8 && m_compressed)
+        writeSection(m_quantized8.data(), sizeof(QuantizedWideBVHNode<8>) * m_quantized8.size());
+    else if (m_layout == EWide8)
+        writeSection(m_nodes8.data(), sizeof(WideBVHNode<8>) * m_nodes8.size());
+    else if (m_layout == EWide4 && m_compressed)
+        writeSection(m_quantized4.data(), sizeof(QuantizedWideBVHNode<4>) * m_quantized4.size());
+    else if (m_layout == EWide4)
+        writeSection(m_nodes4.data(), sizeof(WideBVHNode<4>) * m_nodes4.size());
+    else
+        writeSection(nullptr, 0);
+    success &= fclose(file) == 0;
+
+    if (!success || std::rename(tempFilename.c_str(), filename.c_str()) != 0) {
+        std::remove(tempFilename.c_str());
+        cerr << "Warning: unable to write the BVH cache file \"" << filename << "\"!" << endl;
+        return;
+    }
+
+    cout << "Wrote the BVH to \"" << filename << "\" (took " << timer.elapsedString()
+         << " and " << memString(offset) << ")." << endl;
+}
+
+NORI_NAMESPACE_END
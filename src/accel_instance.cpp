@@ -0,0 +1,253 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/accel.h>
+#include <nori/timer.h>
+#include <Eigen/LU>
+#include <chrono>
+
+/* ===================================================================
+    Two-level BVH: every shared mesh has its own bottom-level BVH, and
+    a top-level BVH over the world space boxes of the instances finds
+    the copies that a ray may hit. The ray is then transformed into
+    the object space of the copy and traverses the bottom-level BVH.
+    The direction is not normalized after the transformation, so the
+    ray parameter t (and thus mint, maxt and the hit distance) is the
+    same in both spaces.
+ * =================================================================== */
+
+NORI_NAMESPACE_BEGIN
+
+void Accel::addSharedMesh(Mesh *mesh) {
+    for (auto accel : m_sharedMeshes) {
+        if (accel->getMesh(0)->getId() == mesh->getId())
+            throw NoriException("Accel::addSharedMesh(): there already is a mesh with id \"%s\"!",
+                                mesh->getId());
+    }
+
+    Accel *accel = new Accel();
+    accel->addMesh(mesh);
+    m_sharedMeshes.push_back(accel);
+}
+
+void Accel::addInstance(const std::string &id, const Transform &toWorld) {
+    for (auto accel : m_sharedMeshes) {
+        if (accel->getMesh(0)->getId() != id)
+            continue;
+
+        InstanceRef instance { accel, toWorld.inverse(), BoundingBox3f() };
+        const BoundingBox3f &bbox = accel->getBoundingBox();
+        for (int i = 0; i < 8; ++i)
+            instance.bbox.expandBy(toWorld * bbox.getCorner(i));
+        m_instances.push_back(instance);
+        return;
+    }
+
+    throw NoriException("Accel::addInstance(): unknown mesh \"%s\" (shared meshes "
+                        "must be declared before their instances)!", id);
+}
+
+void Accel::buildTopLevel(const std::vector<BoundingBox3f> &boxes, std::vector<BVHNode> &nodes,
+                          std::vector<uint32_t> &order) const {
+    uint32_t size = (uint32_t) boxes.size();
+    std::vector<Point3f> centroids(size);
+    order.resize(size);
+    for (uint32_t i = 0; i < size; ++i) {
+        order[i] = i;
+        centroids[i] = boxes[i].getCenter();
+    }
+
+    /* Top-down build that places the left child right after its parent.
+       Instances are expensive to intersect, so every leaf references a
+       single one, and a sweep over the sorted centroids finds the split
+       with the lowest SAH cost */
+    std::vector<float> rightArea(size);
+    nodes.clear();
+    nodes.reserve(2 * size - 1);
+
+    std::function<void(uint32_t, uint32_t)> buildNode = [&](uint32_t begin, uint32_t end) {
+        uint32_t node_idx = (uint32_t) nodes.size();
+        nodes.emplace_back();
+        BVHNode node;
+        node.data = 0;
+        node.bbox.reset();
+        BoundingBox3f centroidBBox;
+        for (uint32_t i = begin; i < end; ++i) {
+            node.bbox.expandBy(boxes[order[i]]);
+            centroidBBox.expandBy(centroids[order[i]]);
+        }
+
+        if (end - begin == 1) {
+            node.leaf.flag = 1;
+            node.leaf.size = 1;
+            node.leaf.start = begin;
+            nodes[node_idx] = node;
+            return;
+        }
+
+        int bestAxis = centroidBBox.getLargestAxis();
+        uint32_t bestSplit = (begin + end) / 2;
+
+        auto sortAlong = [&](int axis) {
+            std::sort(order.begin() + begin, order.begin() + end,
+                [&](uint32_t a, uint32_t b) { return centroids[a][axis] < centroids[b][axis]; });
+        };
+
+        /* Copies at the same position can't be told apart by the SAH,
+           split them in the middle to keep the tree balanced */
+        if (centroidBBox.getExtents().maxCoeff() > 0) {
+            float bestCost = std::numeric_limits<float>::infinity();
+            for (int axis = 0; axis < 3; ++axis) {
+                sortAlong(axis);
+
+                BoundingBox3f bbox;
+                for (uint32_t i = end - 1; i > begin; --i) {
+                    bbox.expandBy(boxes[order[i]]);
+                    rightArea[i] = bbox.getSurfaceArea();
+                }
+
+                bbox.reset();
+                for (uint32_t i = begin; i < end - 1; ++i) {
+                    bbox.expandBy(boxes[order[i]]);
+                    float cost = bbox.getSurfaceArea() * (i - begin + 1)
+                               + rightArea[i + 1] * (end - i - 1);
+                    if (cost < bestCost) {
+                        bestCost = cost;
+                        bestAxis = axis;
+                        bestSplit = i + 1;
+                    }
+                }
+            }
+        }
+        sortAlong(bestAxis);
+
+        node.inner.flag = 0;
+        node.inner.axis = (uint32_t) bestAxis;
+        nodes[node_idx] = node;
+
+        buildNode(begin, bestSplit);
+        nodes[node_idx].inner.rightChild = (uint32_t) nodes.size();
+        buildNode(bestSplit, end);
+    };
+    buildNode(0u, size);
+}
+
+void Accel::buildInstances() {
+    uint32_t size = (uint32_t) m_instances.size();
+    cout << "Constructing the top-level BVH (" << size
+         << (size == 1 ? " instance of " : " instances of ") << m_sharedMeshes.size()
+         << (m_sharedMeshes.size() == 1 ? " shared mesh) .. " : " shared meshes) .. ");
+    cout.flush();
+    Timer timer;
+    auto start = std::chrono::system_clock::now();
+
+    std::vector<BoundingBox3f> boxes(size);
+    for (uint32_t i = 0; i < size; ++i) {
+        boxes[i] = m_instances[i].bbox;
+        m_bbox.expandBy(boxes[i]);
+    }
+
+    std::vector<uint32_t> order;
+    buildTopLevel(boxes, m_instanceNodes, order);
+
+    /* Store the instances in the order referenced by the leaves */
+    std::vector<InstanceRef> instances;
+    instances.reserve(size);
+    for (uint32_t i = 0; i < size; ++i)
+        instances.push_back(m_instances[order[i]]);
+    m_instances = std::move(instances);
+
+    cout << "done (took " << timer.elapsedString() << " and "
+         << memString(sizeof(BVHNode) * m_instanceNodes.size() + sizeof(InstanceRef) * size)
+         << ", " << m_instanceNodes.size() << " nodes)." << endl;
+    cout << "# benchmark # BVH phase \"top level\" took: "
+         << std::chrono::duration<double>(std::chrono::system_clock::now() - start).count()
+         << " s" << endl;
+}
+
+bool Accel::rayIntersectInstances(Ray3f &ray, HitRecord &hit, bool shadowRay) const {
+    uint32_t node_idx = 0, stack_idx = 0, stack[64];
+    bool foundIntersection = false;
+
+    while (true) {
+        const BVHNode &node = m_instanceNodes[node_idx];
+        hit.nodeVisits++;
+
+        if (node.bbox.rayIntersect(ray)) {
+            if (node.isInner()) {
+                /* Visit the child on the near side of the split first,
+                   so that its hits can cull the far side */
+                uint32_t left = node_idx + 1, right = node.inner.rightChild;
+                bool reverse = ray.d[node.inner.axis] < 0;
+                stack[stack_idx++] = reverse ? left : right;
+                node_idx = reverse ? right : left;
+                assert(stack_idx < 64);
+                continue;
+            }
+
+            for (uint32_t i = node.start(); i < node.end(); ++i) {
+                const InstanceRef &ref = m_instances[i];
+                Ray3f localRay = ref.toObject * ray;
+
+                if (ref.accel->rayIntersectBVH(localRay, hit, shadowRay)) {
+                    if (shadowRay)
+                        return true;
+                    ray.maxt = localRay.maxt;
+                    hit.instance = i;
+                    foundIntersection = true;
+                }
+            }
+        }
+
+        if (stack_idx == 0)
+            break;
+        node_idx = stack[--stack_idx];
+    }
+
+    return foundIntersection;
+}
+
+void Accel::resolveInstanceIntersection(Intersection &its, uint32_t instance, uint32_t f) const {
+    const InstanceRef &ref = m_instances[instance];
+    ref.accel->resolveIntersection(its, f);
+
+    /* Normals transform with the inverse transpose. A mirroring
+       transformation also flips the winding of the triangles, which
+       determines the direction of the geometric normal */
+    Transform toWorld = ref.toObject.inverse();
+    bool mirrored = toWorld.getMatrix().topLeftCorner<3, 3>().determinant() < 0;
+    bool hasNormals = its.mesh->hasVertexNormals();
+
+    /* Error of the transformed position: the transformed error box of
+       the object space position plus the rounding error of the product */
+    Eigen::Matrix4f absMatrix = toWorld.getMatrix().cwiseAbs();
+    Vector3f absP = absMatrix.topLeftCorner<3, 3>() * its.p.cwiseAbs() + absMatrix.topRightCorner<3, 1>();
+    its.pError = (errorBound(3) + 1) * (absMatrix.topLeftCorner<3, 3>() * its.pError)
+        + errorBound(3) * absP;
+    its.p = toWorld * its.p;
+
+    Vector3f n = (toWorld * its.geoFrame.n).normalized();
+    its.geoFrame = Frame(mirrored ? Vector3f(-n) : n);
+
+    if (hasNormals)
+        its.shFrame = Frame(Vector3f((toWorld * its.shFrame.n).normalized()));
+    else
+        its.shFrame = its.geoFrame;
+}
+
+NORI_NAMESPACE_END
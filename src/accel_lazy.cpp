@@ -0,0 +1,216 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/accel.h>
+#include <nori/stats.h>
+#include <nori/timer.h>
+#include <tbb/task_arena.h>
+#include <chrono>
+
+/* ===================================================================
+    Lazy meshes: only the bounding boxes are known after parsing, and a
+    top-level BVH over them finds the meshes that a ray may hit. The
+    geometry and a bottom-level BVH of a mesh are created when the first
+    ray enters its box. Both live in world space, so unlike instances,
+    rays are not transformed.
+
+    Traversals pin the geometry while they use it. Once the resident
+    meshes exceed the memory budget, the least recently used unpinned
+    ones are released again. Hits only record the triangle index within
+    the mesh, so that a mesh evicted between the traversal and the
+    computation of the intersection can simply be loaded again.
+ * =================================================================== */
+
+NORI_NAMESPACE_BEGIN
+
+void Accel::buildLazy() {
+    uint32_t size = (uint32_t) m_lazyMeshes.size();
+    cout << "Constructing the BVH over the bounds of " << size
+         << (size == 1 ? " lazy mesh" : " lazy meshes");
+    if (m_memoryBudget > 0)
+        cout << " (budget: " << memString(m_memoryBudget) << ")";
+    cout << " .. ";
+    cout.flush();
+    Timer timer;
+    auto start = std::chrono::system_clock::now();
+
+    std::vector<BoundingBox3f> boxes(size);
+    for (uint32_t i = 0; i < size; ++i)
+        boxes[i] = m_lazyMeshes[i]->bbox;
+
+    std::vector<uint32_t> order;
+    buildTopLevel(boxes, m_lazyNodes, order);
+
+    /* Store the meshes in the order referenced by the leaves */
+    std::vector<LazyMeshRef *> meshes(size);
+    for (uint32_t i = 0; i < size; ++i)
+        meshes[i] = m_lazyMeshes[order[i]];
+    m_lazyMeshes = std::move(meshes);
+
+    cout << "done (took " << timer.elapsedString() << " and "
+         << memString(sizeof(BVHNode) * m_lazyNodes.size() + sizeof(LazyMeshRef) * size)
+         << ", " << m_lazyNodes.size() << " nodes)." << endl;
+    cout << "# benchmark # BVH phase \"lazy top level\" took: "
+         << std::chrono::duration<double>(std::chrono::system_clock::now() - start).count()
+         << " s" << endl;
+}
+
+const Accel *Accel::acquireLazy(uint32_t index) const {
+    LazyMeshRef &ref = *m_lazyMeshes[index];
+
+    /* Pin first, then check residency: an eviction that clears 'accel'
+       afterwards sees the pin and backs off (see pageIn()) */
+    ref.users.fetch_add(1);
+
+    /* Only write the time stamp if it changed, so that threads sharing
+       a mesh mostly read its cache line */
+    uint64_t epoch = m_lazyEpoch.load(std::memory_order_relaxed);
+    if (ref.lastUse.load(std::memory_order_relaxed) != epoch)
+        ref.lastUse.store(epoch, std::memory_order_relaxed);
+
+    Accel *accel = ref.accel.load();
+    if (!accel)
+        accel = pageIn(index);
+    return accel;
+}
+
+Accel *Accel::pageIn(uint32_t index) const {
+    std::lock_guard<std::mutex> guard(m_lazyMutex);
+    LazyMeshRef &ref = *m_lazyMeshes[index];
+
+    /* Another thread may have loaded it while this one was waiting */
+    Accel *accel = ref.accel.load();
+    if (accel)
+        return accel;
+
+    /* The parallel loops of the loader and the build must not pick up
+       render tasks of this thread, which could wait for the lock again */
+    tbb::this_task_arena::isolate([&] {
+        ref.mesh->load();
+        accel = new Accel();
+        accel->setLayout(m_layout);
+        accel->setBuildMethod(m_buildMethod);
+        accel->setCompressed(m_compressed);
+        accel->setWatertight(m_watertight);
+        accel->m_quiet = true;
+
+        /* Bypass addMesh(), which would defer the mesh once more */
+        accel->m_meshes.push_back(ref.mesh);
+        accel->m_meshOffset.push_back(ref.mesh->getTriangleCount());
+        accel->m_bbox = ref.bbox;
+        accel->build();
+    });
+
+    ref.memory = ref.mesh->getMemoryUsage() + accel->getMemoryUsage();
+    m_lazyMemory += ref.memory;
+    ref.lastUse.store(m_lazyEpoch.fetch_add(1) + 1, std::memory_order_relaxed);
+    ref.accel.store(accel);
+    RayStatistics::local().pageIns++;
+
+    if (m_memoryBudget == 0 || m_lazyMemory <= m_memoryBudget)
+        return accel;
+
+    /* Evict the least recently used meshes until the budget is met */
+    std::vector<uint32_t> candidates;
+    for (uint32_t i = 0; i < (uint32_t) m_lazyMeshes.size(); ++i) {
+        if (i != index && m_lazyMeshes[i]->accel.load(std::memory_order_relaxed))
+            candidates.push_back(i);
+    }
+    std::sort(candidates.begin(), candidates.end(), [&](uint32_t a, uint32_t b) {
+        return m_lazyMeshes[a]->lastUse.load(std::memory_order_relaxed) <
+               m_lazyMeshes[b]->lastUse.load(std::memory_order_relaxed);
+    });
+
+    for (uint32_t i : candidates) {
+        if (m_lazyMemory <= m_memoryBudget)
+            break;
+        LazyMeshRef &victim = *m_lazyMeshes[i];
+        if (victim.users.load() != 0)
+            continue;
+
+        /* A traversal that pinned the mesh in the meantime may already
+           use the geometry, so put it back in that case */
+        Accel *victimAccel = victim.accel.exchange(nullptr);
+        if (victim.users.load() != 0) {
+            victim.accel.store(victimAccel);
+            continue;
+        }
+
+        victimAccel->m_meshes.clear();
+        delete victimAccel;
+        victim.mesh->unload();
+        m_lazyMemory -= victim.memory;
+        victim.memory = 0;
+        RayStatistics::local().evictions++;
+    }
+
+    return accel;
+}
+
+bool Accel::rayIntersectLazy(Ray3f &ray, HitRecord &hit, bool shadowRay) const {
+    uint32_t node_idx = 0, stack_idx = 0, stack[64];
+    bool foundIntersection = false;
+
+    while (true) {
+        const BVHNode &node = m_lazyNodes[node_idx];
+        hit.nodeVisits++;
+
+        if (node.bbox.rayIntersect(ray)) {
+            if (node.isInner()) {
+                /* Visit the child on the near side of the split first,
+                   so that its hits keep the far side from being loaded */
+                uint32_t left = node_idx + 1, right = node.inner.rightChild;
+                bool reverse = ray.d[node.inner.axis] < 0;
+                stack[stack_idx++] = reverse ? left : right;
+                node_idx = reverse ? right : left;
+                assert(stack_idx < 64);
+                continue;
+            }
+
+            for (uint32_t i = node.start(); i < node.end(); ++i) {
+                const Accel *accel = acquireLazy(i);
+                bool found = accel->rayIntersectBVH(ray, hit, shadowRay);
+                if (found && !shadowRay)
+                    hit.prim = accel->m_primitiveData[hit.prim].index;
+                releaseLazy(i);
+
+                if (found) {
+                    if (shadowRay)
+                        return true;
+                    hit.instance = HitRecord::Lazy | i;
+                    foundIntersection = true;
+                }
+            }
+        }
+
+        if (stack_idx == 0)
+            break;
+        node_idx = stack[--stack_idx];
+    }
+
+    return foundIntersection;
+}
+
+void Accel::resolveLazyIntersection(Intersection &its, uint32_t index, uint32_t f) const {
+    acquireLazy(index);
+    its.mesh = m_lazyMeshes[index]->mesh;
+    computeGeometry(its, f);
+    releaseLazy(index);
+}
+
+NORI_NAMESPACE_END
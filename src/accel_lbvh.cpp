@@ -0,0 +1,418 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/accel.h>
+#include <tbb/tbb.h>
+
+/* ===================================================================
+    Fast BVH construction based on Morton codes (LBVH), see
+
+    "Fast BVH Construction on GPUs" by Lauterbach et al. (Eurographics 2009)
+
+    The triangle centroids are quantized to a 2^21 grid per axis and
+    their coordinates interleaved into 63-bit Morton codes. After a
+    parallel radix sort, every node is split where the highest bit in
+    which the codes of its range differ changes, which only takes a
+    binary search. The HLBVH variant ("HLBVH: Hierarchical LBVH
+    Construction for Real-Time Ray Tracing of Dynamic Geometry" by
+    Pantaleoni and Luebke, HPG 2010) groups the triangles into clusters
+    that share the top Morton bits and builds the levels above these
+    clusters with a full SAH sweep instead.
+ * =================================================================== */
+
+NORI_NAMESPACE_BEGIN
+
+class LBVHBuilder {
+public:
+    /// Build-related parameters
+    enum {
+        /// Maximum number of triangles per leaf
+        LEAF_SIZE = 4,
+
+        /// Build subtrees with less than this many triangles on one thread
+        SERIAL_THRESHOLD = 4096,
+
+        /// Process triangles in batches of 64K for the purpose of parallelization
+        GRAIN_SIZE = 65536,
+
+        /// Number of bits per axis of the Morton codes
+        BITS_PER_AXIS = 21,
+
+        /// Number of leading Morton bits shared by the triangles of an HLBVH cluster
+        CLUSTER_BITS = 15,
+
+        /// Always create a leaf at this depth (traversal stacks hold 64 entries)
+        MAX_DEPTH = 56
+    };
+
+    struct Primitive {
+        uint64_t code;   ///< Morton code of the centroid
+        uint32_t index;  ///< Global primitive index
+    };
+
+    LBVHBuilder(Accel &bvh) : bvh(bvh) { }
+
+    /// Compute the Morton codes of all triangles and sort them
+    void sort(const std::function<void(const char *)> &endPhase) {
+        uint32_t size = bvh.getTriangleCount();
+
+        /* Bounding box of the triangle centroids */
+        std::vector<Point3f> centroids(size);
+        BoundingBox3f bounds = tbb::parallel_reduce(
+            tbb::blocked_range<uint32_t>(0u, size, GRAIN_SIZE / 16),
+            BoundingBox3f(),
+            [&](const tbb::blocked_range<uint32_t> &range, BoundingBox3f result) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                    centroids[i] = bvh.getCentroid(i);
+                    result.expandBy(centroids[i]);
+                }
+                return result;
+            },
+            [](const BoundingBox3f &b1, const BoundingBox3f &b2) {
+                return BoundingBox3f::merge(b1, b2);
+            }
+        );
+
+        /* Quantize and interleave */
+        prims.resize(size);
+        Vector3f extents = bounds.getExtents();
+        Vector3f scale;
+        for (int axis = 0; axis < 3; ++axis)
+            scale[axis] = extents[axis] > 0 ? (1u << BITS_PER_AXIS) / extents[axis] : 0.f;
+        tbb::parallel_for(
+            tbb::blocked_range<uint32_t>(0u, size, GRAIN_SIZE / 16),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                    uint64_t q[3];
+                    for (int axis = 0; axis < 3; ++axis) {
+                        float value = (centroids[i][axis] - bounds.min[axis]) * scale[axis];
+                        q[axis] = (uint64_t) std::min(std::max(value, 0.f),
+                                                      (float) ((1u << BITS_PER_AXIS) - 1));
+                    }
+                    prims[i].code = (spreadBits(q[0]) << 2) | (spreadBits(q[1]) << 1) | spreadBits(q[2]);
+                    prims[i].index = i;
+                }
+            }
+        );
+        endPhase("morton codes");
+
+        radixSort();
+        endPhase("radix sort");
+    }
+
+    /// Build a plain LBVH below the root node
+    void buildLBVH() {
+        uint32_t size = (uint32_t) prims.size();
+        for (uint32_t i = 0; i < size; ++i)
+            bvh.m_indices[i] = prims[i].index;
+        build(0u, 0u, size, 0);
+    }
+
+    /// Build an HLBVH: SAH over clusters of triangles, LBVH within every cluster
+    void buildHLBVH() {
+        uint32_t size = (uint32_t) prims.size();
+        const int shift = 3 * BITS_PER_AXIS - CLUSTER_BITS;
+
+        /* Find runs of triangles that share the top Morton bits */
+        std::vector<Cluster> clusters;
+        for (uint32_t i = 0; i < size; ) {
+            uint32_t j = i + 1;
+            while (j < size && (prims[j].code >> shift) == (prims[i].code >> shift))
+                ++j;
+            clusters.push_back(Cluster { i, j - i, 0u, 0u, 0, BoundingBox3f() });
+            i = j;
+        }
+
+        tbb::parallel_for(
+            tbb::blocked_range<size_t>(0u, clusters.size()),
+            [&](const tbb::blocked_range<size_t> &range) {
+                for (size_t i = range.begin(); i != range.end(); ++i) {
+                    Cluster &cluster = clusters[i];
+                    for (uint32_t j = cluster.start; j < cluster.start + cluster.count; ++j)
+                        cluster.bbox.expandBy(bvh.getBoundingBox(prims[j].index));
+                }
+            }
+        );
+
+        /* SAH over the clusters, which places them in the node array */
+        std::vector<uint32_t> order(clusters.size());
+        for (uint32_t i = 0; i < (uint32_t) order.size(); ++i)
+            order[i] = i;
+        buildTop(clusters, 0u, order.data(), order.data() + order.size(), 0u, 0);
+
+        /* Move the triangles into the final order and build each cluster */
+        std::vector<Primitive> sorted(size);
+        for (const Cluster &cluster : clusters)
+            memcpy(&sorted[cluster.offset], &prims[cluster.start], sizeof(Primitive) * cluster.count);
+        prims = std::move(sorted);
+        for (uint32_t i = 0; i < size; ++i)
+            bvh.m_indices[i] = prims[i].index;
+
+        tbb::parallel_for(
+            tbb::blocked_range<size_t>(0u, clusters.size(), 1),
+            [&](const tbb::blocked_range<size_t> &range) {
+                for (size_t i = range.begin(); i != range.end(); ++i) {
+                    const Cluster &cluster = clusters[i];
+                    if (cluster.node_idx != NoNode)
+                        build(cluster.node_idx, cluster.offset, cluster.offset + cluster.count, cluster.depth);
+                }
+            }
+        );
+    }
+
+protected:
+    struct Cluster {
+        uint32_t start;      ///< First triangle in Morton order
+        uint32_t count;      ///< Number of triangles
+        uint32_t offset;     ///< First triangle in the final order
+        uint32_t node_idx;   ///< Root node of the cluster's subtree (\ref NoNode if part of a leaf)
+        int depth;           ///< Depth of that node
+        BoundingBox3f bbox;  ///< Bounding box of the triangles
+    };
+
+    /// Marks clusters that \ref buildTop() merged into a leaf at the maximum depth
+    static const uint32_t NoNode = 0xFFFFFFFFu;
+
+    /// Insert two zero bits between each of the lower 21 bits of \c x
+    static uint64_t spreadBits(uint64_t x) {
+        x &= 0x1fffff;
+        x = (x | x << 32) & 0x1f00000000ffffull;
+        x = (x | x << 16) & 0x1f0000ff0000ffull;
+        x = (x | x << 8)  & 0x100f00f00f00f00full;
+        x = (x | x << 4)  & 0x10c30c30c30c30c3ull;
+        x = (x | x << 2)  & 0x1249249249249249ull;
+        return x;
+    }
+
+    /// Stable parallel LSD radix sort of \ref prims by Morton code (8 bits per pass)
+    void radixSort() {
+        size_t size = prims.size(), blocks = (size + GRAIN_SIZE - 1) / GRAIN_SIZE;
+        std::vector<Primitive> temp(size);
+        std::vector<size_t> offsets(blocks * 256);
+
+        for (int shift = 0; shift < 3 * BITS_PER_AXIS; shift += 8) {
+            /* Histogram of the current digit within every block */
+            tbb::parallel_for(size_t(0), blocks, [&](size_t block) {
+                size_t *histogram = &offsets[block * 256];
+                memset(histogram, 0, sizeof(size_t) * 256);
+                for (size_t i = block * GRAIN_SIZE, end = std::min(size, i + GRAIN_SIZE); i < end; ++i)
+                    histogram[(prims[i].code >> shift) & 0xFF]++;
+            });
+
+            /* Exclusive prefix sum over (digit, block) */
+            size_t sum = 0;
+            for (size_t digit = 0; digit < 256; ++digit) {
+                for (size_t block = 0; block < blocks; ++block) {
+                    size_t count = offsets[block * 256 + digit];
+                    offsets[block * 256 + digit] = sum;
+                    sum += count;
+                }
+            }
+
+            /* Scatter */
+            tbb::parallel_for(size_t(0), blocks, [&](size_t block) {
+                size_t *offset = &offsets[block * 256];
+                for (size_t i = block * GRAIN_SIZE, end = std::min(size, i + GRAIN_SIZE); i < end; ++i)
+                    temp[offset[(prims[i].code >> shift) & 0xFF]++] = prims[i];
+            });
+
+            prims.swap(temp);
+        }
+    }
+
+    /**
+     * \brief Emit the LBVH over <tt>prims[start, end)</tt> into the subtree
+     * rooted at \c node_idx, and return its bounding box
+     *
+     * Like the SAH builder, a subtree over \c n triangles occupies at most
+     * <tt>2n-1</tt> consecutive nodes, so the right child of a node with
+     * \c k triangles on the left can be placed at <tt>node_idx + 2k</tt>.
+     *
+     * Every differing Morton bit and every middle split of equal codes adds
+     * a level, so clustered input is cut off with a leaf at \ref MAX_DEPTH.
+     */
+    BoundingBox3f build(uint32_t node_idx, uint32_t start, uint32_t end, int depth) {
+        Accel::BVHNode &node = bvh.m_nodes[node_idx];
+        uint32_t size = end - start;
+
+        if (size <= LEAF_SIZE || depth >= MAX_DEPTH) {
+            node.leaf.flag = 1;
+            node.leaf.start = start;
+            node.leaf.size = size;
+            node.bbox.reset();
+            for (uint32_t i = start; i < end; ++i)
+                node.bbox.expandBy(bvh.getBoundingBox(prims[i].index));
+            return node.bbox;
+        }
+
+        /* Split where the highest differing bit of the range changes */
+        uint64_t diff = prims[start].code ^ prims[end - 1].code;
+        uint32_t mid;
+        int axis = -1;
+        if (diff == 0) {
+            /* All codes are equal -- split in the middle */
+            mid = start + size / 2;
+        } else {
+            int bit = 63;
+            while (!(diff >> bit))
+                --bit;
+            uint64_t mask = (uint64_t) 1 << bit;
+            mid = (uint32_t) (std::partition_point(prims.begin() + start, prims.begin() + end,
+                [mask](const Primitive &p) { return !(p.code & mask); }) - prims.begin());
+            /* Bits are interleaved as ..xyzxyz */
+            axis = 2 - bit % 3;
+        }
+
+        uint32_t left_count = mid - start;
+        uint32_t node_idx_left = node_idx + 1;
+        uint32_t node_idx_right = node_idx + 2 * left_count;
+
+        BoundingBox3f bbox_left, bbox_right;
+        if (size < SERIAL_THRESHOLD) {
+            bbox_left = build(node_idx_left, start, mid, depth + 1);
+            bbox_right = build(node_idx_right, mid, end, depth + 1);
+        } else {
+            tbb::parallel_invoke(
+                [&] { bbox_left = build(node_idx_left, start, mid, depth + 1); },
+                [&] { bbox_right = build(node_idx_right, mid, end, depth + 1); }
+            );
+        }
+
+        node.bbox = BoundingBox3f::merge(bbox_left, bbox_right);
+        node.inner.rightChild = node_idx_right;
+        node.inner.axis = axis >= 0 ? axis : node.bbox.getLargestAxis();
+        node.inner.flag = 0;
+        return node.bbox;
+    }
+
+    /**
+     * \brief Build the top levels of an HLBVH over the clusters
+     * <tt>[start, end)</tt> with an exact SAH sweep
+     *
+     * Assigns the final triangle offset and root node of every cluster.
+     * The clusters that are left at \ref MAX_DEPTH become a single leaf.
+     */
+    void buildTop(std::vector<Cluster> &clusters, uint32_t node_idx,
+                  uint32_t *start, uint32_t *end, uint32_t offset, int depth) {
+        Accel::BVHNode &node = bvh.m_nodes[node_idx];
+        uint32_t count = (uint32_t) (end - start);
+
+        if (count == 1) {
+            clusters[*start].node_idx = node_idx;
+            clusters[*start].offset = offset;
+            clusters[*start].depth = depth;
+            return;
+        }
+
+        node.bbox.reset();
+        uint32_t size = 0;
+        for (uint32_t *it = start; it != end; ++it) {
+            node.bbox.expandBy(clusters[*it].bbox);
+            size += clusters[*it].count;
+        }
+
+        if (depth >= MAX_DEPTH) {
+            node.leaf.flag = 1;
+            node.leaf.start = offset;
+            node.leaf.size = size;
+            for (uint32_t *it = start; it != end; ++it) {
+                clusters[*it].node_idx = NoNode;
+                clusters[*it].offset = offset;
+                offset += clusters[*it].count;
+            }
+            return;
+        }
+
+        auto centroid = [&](uint32_t c, int axis) {
+            const BoundingBox3f &bbox = clusters[c].bbox;
+            return bbox.min[axis] + bbox.max[axis];
+        };
+
+        /* Try splitting along every axis */
+        std::vector<float> left_areas(count);
+        std::vector<uint32_t> left_sizes(count);
+        float best_cost = std::numeric_limits<float>::infinity();
+        uint32_t best_index = 1;
+        int best_axis = 0;
+        float tri_factor = 1.f / node.bbox.getSurfaceArea();
+
+        for (int axis = 0; axis < 3; ++axis) {
+            std::sort(start, end, [&](uint32_t c1, uint32_t c2) {
+                return centroid(c1, axis) < centroid(c2, axis);
+            });
+
+            BoundingBox3f bbox;
+            uint32_t prims_left = 0;
+            for (uint32_t i = 0; i < count; ++i) {
+                bbox.expandBy(clusters[start[i]].bbox);
+                prims_left += clusters[start[i]].count;
+                left_areas[i] = bbox.getSurfaceArea();
+                left_sizes[i] = prims_left;
+            }
+
+            bbox.reset();
+            for (uint32_t i = count - 1; i >= 1; --i) {
+                bbox.expandBy(clusters[start[i]].bbox);
+                uint32_t prims_left = left_sizes[i-1];
+                float sah_cost = tri_factor * (prims_left * left_areas[i-1] +
+                                               (size - prims_left) * bbox.getSurfaceArea());
+                if (sah_cost < best_cost) {
+                    best_cost = sah_cost;
+                    best_index = i;
+                    best_axis = axis;
+                }
+            }
+        }
+
+        std::sort(start, end, [&](uint32_t c1, uint32_t c2) {
+            return centroid(c1, best_axis) < centroid(c2, best_axis);
+        });
+
+        uint32_t left_count = 0;
+        for (uint32_t i = 0; i < best_index; ++i)
+            left_count += clusters[start[i]].count;
+
+        uint32_t node_idx_left = node_idx + 1;
+        uint32_t node_idx_right = node_idx + 2 * left_count;
+        node.inner.rightChild = node_idx_right;
+        node.inner.axis = best_axis;
+        node.inner.flag = 0;
+
+        buildTop(clusters, node_idx_left, start, start + best_index, offset, depth + 1);
+        buildTop(clusters, node_idx_right, start + best_index, end, offset + left_count, depth + 1);
+    }
+
+private:
+    Accel &bvh;
+    std::vector<Primitive> prims;
+};
+
+void Accel::buildMorton(const std::function<void(const char *)> &endPhase) {
+    LBVHBuilder builder(*this);
+    builder.sort(endPhase);
+
+    if (m_buildMethod == EHLBVH) {
+        builder.buildHLBVH();
+        endPhase("HLBVH hierarchy");
+    } else {
+        builder.buildLBVH();
+        endPhase("LBVH hierarchy");
+    }
+}
+
+NORI_NAMESPACE_END
@@ -0,0 +1,486 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/accel.h>
+#include <nori/timer.h>
+#include <tbb/tbb.h>
+#include <Eigen/Geometry>
+#include <chrono>
+#include <memory>
+
+/* ===================================================================
+    Motion BVH: the keyframe times of all moving meshes split [0, 1]
+    into segments, within which every vertex moves linearly. Each
+    segment gets a binary BVH whose nodes store the boxes of their
+    subtree at the start and at the end of the segment. A ray lerps
+    the two boxes to its time, so it only visits the nodes whose
+    triangles actually pass by at that time.
+ * =================================================================== */
+
+NORI_NAMESPACE_BEGIN
+
+/// Linear interpolation between two points
+static inline Point3f lerp(float alpha, const Point3f &p0, const Point3f &p1) {
+    return (1 - alpha) * p0 + alpha * p1;
+}
+
+/// Interpolate the vertices of an entry of the motion triangle store
+static inline void lerpTriangle(const float *data, float alpha, Point3f *p) {
+    for (int k = 0; k < 3; ++k)
+        p[k] = lerp(alpha, Point3f(data[3*k], data[3*k + 1], data[3*k + 2]),
+                    Point3f(data[3*k + 9], data[3*k + 10], data[3*k + 11]));
+}
+
+/// Moeller-Trumbore test, evaluated in the same order as \ref Mesh::rayIntersect()
+static inline bool intersectTriangle(const Point3f &p0, const Point3f &p1, const Point3f &p2,
+                                     const Ray3f &ray, float &u, float &v, float &t) {
+    Vector3f edge1 = p1 - p0, edge2 = p2 - p0;
+    Vector3f pvec = ray.d.cross(edge2);
+
+    float det = edge1.dot(pvec);
+    if (det > -1e-8f && det < 1e-8f)
+        return false;
+    float inv_det = 1.0f / det;
+
+    Vector3f tvec = ray.o - p0;
+    u = tvec.dot(pvec) * inv_det;
+    if (u < 0.0 || u > 1.0)
+        return false;
+
+    Vector3f qvec = tvec.cross(edge1);
+    v = ray.d.dot(qvec) * inv_det;
+    if (v < 0.0 || u + v > 1.0)
+        return false;
+
+    t = edge2.dot(qvec) * inv_det;
+    return t > ray.mint && t <= ray.maxt;
+}
+
+/**
+ * Scalar version of the watertight test of \ref Accel::intersectLeafWatertight().
+ * Shared vertices interpolate to the same positions, so the interpolated
+ * triangles stay watertight as well
+ */
+static inline bool intersectTriangleWatertight(const Point3f &p0, const Point3f &p1, const Point3f &p2,
+                                               const Ray3f &ray, float &u, float &v, float &t) {
+    const Vector3f absD = ray.d.cwiseAbs();
+    int kz = absD.x() > absD.y() ? (absD.x() > absD.z() ? 0 : 2) : (absD.y() > absD.z() ? 1 : 2);
+    int kx = (kz + 1) % 3, ky = (kx + 1) % 3;
+    float sx = -ray.d[kx] / ray.d[kz], sy = -ray.d[ky] / ray.d[kz], sz = 1.f / ray.d[kz];
+
+    /* Translate, permute and shear the vertices */
+    const Point3f *p[3] = { &p0, &p1, &p2 };
+    float x[3], y[3], z[3];
+    for (int j = 0; j < 3; ++j) {
+        z[j] = (*p[j])[kz] - ray.o[kz];
+        x[j] = ((*p[j])[kx] - ray.o[kx]) + sx * z[j];
+        y[j] = ((*p[j])[ky] - ray.o[ky]) + sy * z[j];
+    }
+
+    float e0 = x[1] * y[2] - y[1] * x[2];
+    float e1 = x[2] * y[0] - y[2] * x[0];
+    float e2 = x[0] * y[1] - y[0] * x[1];
+    if ((e0 < 0 || e1 < 0 || e2 < 0) && (e0 > 0 || e1 > 0 || e2 > 0))
+        return false;
+
+    float det = e0 + e1 + e2;
+    if (det == 0)
+        return false;
+
+    for (int j = 0; j < 3; ++j)
+        z[j] *= sz;
+    float invDet = 1.f / det;
+    t = (e0 * z[0] + e1 * z[1] + e2 * z[2]) * invDet;
+    if (t < ray.mint || t > ray.maxt)
+        return false;
+
+    /* Only accept distances that are larger than their error bound */
+    float maxX = std::max(std::max(std::abs(x[0]), std::abs(x[1])), std::abs(x[2]));
+    float maxY = std::max(std::max(std::abs(y[0]), std::abs(y[1])), std::abs(y[2]));
+    float maxZ = std::max(std::max(std::abs(z[0]), std::abs(z[1])), std::abs(z[2]));
+    float maxE = std::max(std::max(std::abs(e0), std::abs(e1)), std::abs(e2));
+    float deltaX = errorBound(5) * (maxX + maxZ), deltaY = errorBound(5) * (maxY + maxZ);
+    float deltaZ = errorBound(3) * maxZ;
+    float deltaE = 2.f * (errorBound(2) * maxX * maxY + deltaY * maxX + deltaX * maxY);
+    float deltaT = 3.f * (errorBound(3) * maxE * maxZ + deltaE * maxZ + deltaZ * maxE) * std::abs(invDet);
+    if (t <= deltaT)
+        return false;
+
+    /* e1 and e2 weight the second and the third vertex */
+    u = e1 * invDet;
+    v = e2 * invDet;
+    return true;
+}
+
+/**
+ * \brief Binned SAH builder for the motion BVH of one time segment
+ *
+ * The cost of a subtree is weighted by the average surface area of its
+ * boxes at the start and at the end of the segment, which approximates
+ * the probability that a ray at a random time enters it.
+ */
+class MotionBVHBuilder {
+public:
+    enum {
+        /// Number of bins per axis
+        BIN_COUNT = 16,
+
+        /// Leaves with more triangles are always split
+        MAX_LEAF_SIZE = 8,
+
+        /// Heuristic cost value for traversal operations (relative to a triangle test)
+        TRAVERSAL_COST = 1
+    };
+
+    MotionBVHBuilder(const Accel &accel, float start, float end) {
+        uint32_t size = (uint32_t) accel.m_motionPrimitives.size();
+        bboxes[0].resize(size);
+        bboxes[1].resize(size);
+        centroids.resize(size);
+        order.resize(size);
+
+        for (uint32_t i = 0; i < size; ++i) {
+            const Accel::PrimitiveRef &prim = accel.m_motionPrimitives[i];
+            const Mesh *mesh = accel.m_movingMeshes[prim.mesh];
+            for (int k = 0; k < 3; ++k) {
+                uint32_t vertex = mesh->getVertexIndex(prim.index, k);
+                bboxes[0][i].expandBy(mesh->getVertexPosition(vertex, start));
+                bboxes[1][i].expandBy(mesh->getVertexPosition(vertex, end));
+            }
+            centroids[i] = 0.5f * (bboxes[0][i].getCenter() + bboxes[1][i].getCenter());
+            order[i] = i;
+        }
+    }
+
+    /// Build the tree; leaves reference positions in \ref order
+    void build() {
+        nodes.reserve(2 * order.size());
+        build(0u, (uint32_t) order.size());
+    }
+
+    std::vector<Accel::MotionBVHNode> nodes;
+    std::vector<uint32_t> order;
+
+private:
+    /// Average area of the boxes at the start and the end of the segment
+    static float area(const BoundingBox3f *bbox) {
+        return 0.5f * (bbox[0].getSurfaceArea() + bbox[1].getSurfaceArea());
+    }
+
+    void makeLeaf(uint32_t node_idx, uint32_t begin, uint32_t end) {
+        Accel::MotionBVHNode &node = nodes[node_idx];
+        node.leaf.flag = 1;
+        node.leaf.size = end - begin;
+        node.leaf.start = begin;
+    }
+
+    void build(uint32_t begin, uint32_t end) {
+        uint32_t node_idx = (uint32_t) nodes.size(), size = end - begin;
+        nodes.emplace_back();
+        Accel::MotionBVHNode &node = nodes[node_idx];
+        node.data = 0;
+
+        BoundingBox3f centroidBBox;
+        for (uint32_t i = begin; i < end; ++i) {
+            node.bbox[0].expandBy(bboxes[0][order[i]]);
+            node.bbox[1].expandBy(bboxes[1][order[i]]);
+            centroidBBox.expandBy(centroids[order[i]]);
+        }
+
+        if (size <= 2) {
+            makeLeaf(node_idx, begin, end);
+            return;
+        }
+
+        /* Evaluate the SAH at the bin boundaries of all three axes */
+        float bestCost = std::numeric_limits<float>::infinity();
+        int bestAxis = -1, bestBin = 0;
+        Vector3f extents = centroidBBox.getExtents();
+
+        for (int axis = 0; axis < 3; ++axis) {
+            if (extents[axis] <= 0)
+                continue;
+
+            uint32_t counts[BIN_COUNT] = { 0 };
+            BoundingBox3f bins[BIN_COUNT][2];
+            float scale = BIN_COUNT / extents[axis];
+            for (uint32_t i = begin; i < end; ++i) {
+                uint32_t idx = order[i];
+                int bin = binIndex(centroids[idx][axis], centroidBBox.min[axis], scale);
+                counts[bin]++;
+                bins[bin][0].expandBy(bboxes[0][idx]);
+                bins[bin][1].expandBy(bboxes[1][idx]);
+            }
+
+            float rightArea[BIN_COUNT];
+            uint32_t rightCount[BIN_COUNT];
+            BoundingBox3f bbox[2];
+            uint32_t count = 0;
+            for (int i = BIN_COUNT - 1; i > 0; --i) {
+                bbox[0].expandBy(bins[i][0]);
+                bbox[1].expandBy(bins[i][1]);
+                count += counts[i];
+                rightArea[i] = area(bbox);
+                rightCount[i] = count;
+            }
+
+            bbox[0].reset();
+            bbox[1].reset();
+            count = 0;
+            for (int i = 0; i < BIN_COUNT - 1; ++i) {
+                bbox[0].expandBy(bins[i][0]);
+                bbox[1].expandBy(bins[i][1]);
+                count += counts[i];
+                if (count == 0 || rightCount[i + 1] == 0)
+                    continue;
+                float cost = area(bbox) * count + rightArea[i + 1] * rightCount[i + 1];
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestBin = i;
+                }
+            }
+        }
+
+        uint32_t split;
+        if (bestAxis < 0) {
+            /* All centroids coincide, split in the middle */
+            if (size <= MAX_LEAF_SIZE) {
+                makeLeaf(node_idx, begin, end);
+                return;
+            }
+            bestAxis = centroidBBox.getLargestAxis();
+            split = (begin + end) / 2;
+        } else {
+            bestCost = TRAVERSAL_COST + bestCost / area(node.bbox);
+            if (bestCost >= size && size <= MAX_LEAF_SIZE) {
+                makeLeaf(node_idx, begin, end);
+                return;
+            }
+
+            float scale = BIN_COUNT / extents[bestAxis], min = centroidBBox.min[bestAxis];
+            split = (uint32_t) (std::partition(order.begin() + begin, order.begin() + end,
+                [&](uint32_t idx) {
+                    return binIndex(centroids[idx][bestAxis], min, scale) <= bestBin;
+                }) - order.begin());
+        }
+
+        node.inner.flag = 0;
+        node.inner.axis = (uint32_t) bestAxis;
+
+        build(begin, split);
+        uint32_t rightChild = (uint32_t) nodes.size();
+        build(split, end);
+        nodes[node_idx].inner.rightChild = rightChild;
+    }
+
+    static int binIndex(float value, float min, float scale) {
+        return std::min((int) ((value - min) * scale), (int) BIN_COUNT - 1);
+    }
+
+    std::vector<BoundingBox3f> bboxes[2]; ///< Box of every triangle at the start and end
+    std::vector<Point3f> centroids;       ///< Centroid of the two boxes of every triangle
+};
+
+void Accel::buildMotion() {
+    m_motionPrimitives.clear();
+    for (uint32_t i = 0; i < (uint32_t) m_movingMeshes.size(); ++i)
+        for (uint32_t j = 0; j < m_movingMeshes[i]->getTriangleCount(); ++j)
+            m_motionPrimitives.push_back(PrimitiveRef { i, j });
+    uint32_t size = (uint32_t) m_motionPrimitives.size();
+    if (size == 0)
+        return;
+
+    /* The keyframe times of all meshes delimit the segments */
+    std::vector<float> times;
+    for (auto mesh : m_movingMeshes) {
+        uint32_t count = mesh->getKeyframeCount();
+        for (uint32_t k = 0; k < count; ++k)
+            times.push_back((float) k / (float) (count - 1));
+    }
+    std::sort(times.begin(), times.end());
+    times.erase(std::unique(times.begin(), times.end()), times.end());
+    uint32_t segmentCount = (uint32_t) times.size() - 1;
+
+    cout << "Constructing the motion BVH (" << m_movingMeshes.size()
+         << (m_movingMeshes.size() == 1 ? " mesh, " : " meshes, ") << size
+         << " triangles, " << segmentCount
+         << (segmentCount == 1 ? " time segment) .. " : " time segments) .. ");
+    cout.flush();
+    Timer timer;
+    auto start = std::chrono::system_clock::now();
+
+    /* The segments are independent, build them in parallel */
+    std::vector<std::unique_ptr<MotionBVHBuilder>> builders(segmentCount);
+    tbb::parallel_for(0u, segmentCount, [&](uint32_t s) {
+        builders[s].reset(new MotionBVHBuilder(*this, times[s], times[s + 1]));
+        builders[s]->build();
+    });
+
+    /* Concatenate the trees, and store the vertices at both ends of
+       the segment in the order referenced by the leaves */
+    m_motionSegments.clear();
+    m_motionNodes.clear();
+    m_motionIndices.clear();
+    m_motionTriangles.clear();
+    m_motionTriangles.reserve((size_t) 18 * size * segmentCount);
+    for (uint32_t s = 0; s < segmentCount; ++s) {
+        const MotionBVHBuilder &builder = *builders[s];
+        uint32_t nodeOffset = (uint32_t) m_motionNodes.size(),
+                 indexOffset = (uint32_t) m_motionIndices.size();
+        m_motionSegments.push_back(MotionSegment { times[s], times[s + 1], nodeOffset });
+
+        for (MotionBVHNode node : builder.nodes) {
+            if (node.isLeaf())
+                node.leaf.start += indexOffset;
+            else
+                node.inner.rightChild += nodeOffset;
+            m_motionNodes.push_back(node);
+        }
+
+        for (uint32_t idx : builder.order) {
+            m_motionIndices.push_back(idx);
+            const PrimitiveRef &prim = m_motionPrimitives[idx];
+            const Mesh *mesh = m_movingMeshes[prim.mesh];
+            for (float time : { times[s], times[s + 1] }) {
+                for (int k = 0; k < 3; ++k) {
+                    Point3f p = mesh->getVertexPosition(mesh->getVertexIndex(prim.index, k), time);
+                    m_motionTriangles.insert(m_motionTriangles.end(), p.data(), p.data() + 3);
+                }
+            }
+        }
+    }
+
+    cout << "done (took " << timer.elapsedString() << " and "
+         << memString(sizeof(MotionBVHNode) * m_motionNodes.size() +
+                      sizeof(uint32_t) * m_motionIndices.size() +
+                      sizeof(float) * m_motionTriangles.size())
+         << ", " << m_motionNodes.size() << " nodes)." << endl;
+    cout << "# benchmark # BVH phase \"motion\" took: "
+         << std::chrono::duration<double>(std::chrono::system_clock::now() - start).count()
+         << " s" << endl;
+}
+
+uint32_t Accel::findMotionSegment(float time, float &alpha) const {
+    time = clamp(time, 0.f, 1.f);
+    uint32_t s = 0;
+    while (s + 1 < (uint32_t) m_motionSegments.size() && time > m_motionSegments[s].end)
+        ++s;
+    const MotionSegment &segment = m_motionSegments[s];
+    alpha = clamp((time - segment.start) / (segment.end - segment.start), 0.f, 1.f);
+    return s;
+}
+
+bool Accel::rayIntersectMotion(Ray3f &ray, HitRecord &hit, bool shadowRay) const {
+    float alpha;
+    const MotionSegment &segment = m_motionSegments[findMotionSegment(ray.time, alpha)];
+
+    auto nodeBox = [&](const MotionBVHNode &node) {
+        return BoundingBox3f(lerp(alpha, node.bbox[0].min, node.bbox[1].min),
+                             lerp(alpha, node.bbox[0].max, node.bbox[1].max));
+    };
+    auto intersectBox = [&](const MotionBVHNode &node, float &nearT) {
+        float farT;
+        return nodeBox(node).rayIntersect(ray, nearT, farT) && ray.mint <= farT && nearT <= ray.maxt;
+    };
+
+    struct StackEntry {
+        uint32_t node_idx;
+        float tnear;
+    };
+    StackEntry stack[64];
+    uint32_t node_idx = segment.root, stack_idx = 0;
+    bool foundIntersection = false;
+    float tnear;
+
+    hit.nodeVisits++;
+    if (!intersectBox(m_motionNodes[node_idx], tnear))
+        return false;
+
+    while (true) {
+        const MotionBVHNode &node = m_motionNodes[node_idx];
+
+        if (node.isInner()) {
+            /* Visit the child on the near side of the split plane first */
+            uint32_t nearChild = node_idx + 1, farChild = node.inner.rightChild;
+            if (ray.d[node.inner.axis] < 0)
+                std::swap(nearChild, farChild);
+
+            float tnearNear, tnearFar;
+            bool hitNear = intersectBox(m_motionNodes[nearChild], tnearNear);
+            bool hitFar = intersectBox(m_motionNodes[farChild], tnearFar);
+            hit.nodeVisits += 2;
+
+            if (hitNear) {
+                if (hitFar) {
+                    stack[stack_idx++] = StackEntry { farChild, tnearFar };
+                    assert(stack_idx < 64);
+                }
+                node_idx = nearChild;
+                continue;
+            } else if (hitFar) {
+                node_idx = farChild;
+                continue;
+            }
+        } else {
+            for (uint32_t i = node.start(); i < node.end(); ++i) {
+                Point3f p[3];
+                lerpTriangle(m_motionTriangles.data() + (size_t) 18 * i, alpha, p);
+
+                float u, v, t;
+                hit.triangleTests++;
+                bool found = m_watertight ? intersectTriangleWatertight(p[0], p[1], p[2], ray, u, v, t)
+                                          : intersectTriangle(p[0], p[1], p[2], ray, u, v, t);
+                if (!found)
+                    continue;
+                if (shadowRay)
+                    return true;
+
+                ray.maxt = hit.t = t;
+                hit.u = u;
+                hit.v = v;
+                hit.prim = i;
+                hit.instance = HitRecord::Moving;
+                foundIntersection = true;
+            }
+        }
+
+        /* Pop the next subtree, skipping the ones that start
+           behind the closest hit found so far */
+        do {
+            if (stack_idx == 0)
+                return foundIntersection;
+            --stack_idx;
+        } while (stack[stack_idx].tnear > ray.maxt);
+        node_idx = stack[stack_idx].node_idx;
+    }
+}
+
+void Accel::resolveMotionIntersection(Intersection &its, uint32_t f) const {
+    /* Interpolate the vertices exactly like the traversal did */
+    float alpha;
+    findMotionSegment(its.time, alpha);
+    Point3f p[3];
+    lerpTriangle(m_motionTriangles.data() + (size_t) 18 * f, alpha, p);
+
+    const PrimitiveRef &prim = m_motionPrimitives[m_motionIndices[f]];
+    its.mesh = m_movingMeshes[prim.mesh];
+    computeGeometry(its, prim.index, p[0], p[1], p[2]);
+}
+
+NORI_NAMESPACE_END
@@ -0,0 +1,321 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/accel.h>
+#include <nori/simd.h>
+#include <nori/stats.h>
+
+/* ===================================================================
+    Packet and stream traversal: up to 16 rays walk the binary BVH
+    together. Box and triangle tests run on Width rays at a time
+    (4 with SSE, 8 with AVX), and each stack entry carries the bit mask
+    of the rays that are still interested in the subtree.
+ * =================================================================== */
+
+NORI_NAMESPACE_BEGIN
+
+struct PacketTraversal {
+#if defined(NORI_SIMD_AVX)
+    enum { Width = 8 };
+#else
+    enum { Width = 4 };
+#endif
+    enum {
+        Size = RayPacket::MaxSize,
+        Groups = Size / Width,
+        GroupMask = (1u << Width) - 1
+    };
+    typedef SimdFloat<Width> Float;
+
+    /* SoA copy of the packet. Unused lanes have an empty [mint, maxt] */
+    float o[3][Size], d[3][Size], dRcp[3][Size];
+    float mint[Size], maxt[Size], u[Size], v[Size];
+    uint32_t f[Size];
+    uint32_t valid, found;
+
+    PacketTraversal(const RayPacket &packet) {
+        valid = found = 0;
+        for (uint32_t i = 0; i < (uint32_t) Size; ++i) {
+            f[i] = 0;
+            u[i] = v[i] = 0;
+            if (i >= packet.size) {
+                for (int k = 0; k < 3; ++k)
+                    o[k][i] = d[k][i] = dRcp[k][i] = 0;
+                mint[i] = std::numeric_limits<float>::infinity();
+                maxt[i] = -std::numeric_limits<float>::infinity();
+                continue;
+            }
+
+            const Ray3f &ray = packet.rays[i];
+            for (int k = 0; k < 3; ++k) {
+                o[k][i] = ray.o[k];
+                d[k][i] = ray.d[k];
+                /* Avoid 0 * inf = NaN in the slab test for axis-parallel rays */
+                dRcp[k][i] = std::isinf(ray.dRcp[k])
+                    ? std::copysign(std::numeric_limits<float>::max(), ray.dRcp[k])
+                    : ray.dRcp[k];
+            }
+
+            /* Use an adaptive ray epsilon (same as the single ray version) */
+            mint[i] = ray.mint;
+            if (mint[i] == Epsilon)
+                mint[i] = std::max(mint[i], mint[i] * ray.o.array().abs().maxCoeff());
+            maxt[i] = ray.maxt;
+
+            if (maxt[i] >= mint[i])
+                valid |= 1u << i;
+        }
+    }
+
+    /// Return the subset of \c active rays whose segment overlaps the box
+    uint32_t boxTest(const BoundingBox3f &bbox, uint32_t active) const {
+        uint32_t result = 0;
+        for (int g = 0; g < Groups; ++g) {
+            if (!((active >> (g * Width)) & GroupMask))
+                continue;
+            int offset = g * Width;
+            Float tn = Float::load(mint + offset), tf = Float::load(maxt + offset);
+            for (int k = 0; k < 3; ++k) {
+                Float ok = Float::load(o[k] + offset), rcp = Float::load(dRcp[k] + offset);
+                Float t0 = (Float(bbox.min[k]) - ok) * rcp;
+                Float t1 = (Float(bbox.max[k]) - ok) * rcp;
+                tn = max(tn, min(t0, t1));
+                tf = min(tf, max(t0, t1));
+            }
+            result |= movemask(tn <= tf) << offset;
+        }
+        return result & active;
+    }
+
+    /**
+     * Moeller-Trumbore test of one triangle against the \c active rays,
+     * evaluated in the same order as \ref Mesh::rayIntersect(). Updates
+     * the closest hit of every ray that intersects the triangle and
+     * returns their mask. \c triIdx is the position of the triangle in
+     * the triangle store.
+     */
+    uint32_t triangleTest(const Point3f &p0, const Vector3f &edge1, const Vector3f &edge2,
+                          uint32_t active, uint32_t triIdx) {
+        uint32_t result = 0;
+        const Float e1x(edge1.x()), e1y(edge1.y()), e1z(edge1.z());
+        const Float e2x(edge2.x()), e2y(edge2.y()), e2z(edge2.z());
+        const Float zero(0.f), one(1.f);
+
+        for (int g = 0; g < Groups; ++g) {
+            if (!((active >> (g * Width)) & GroupMask))
+                continue;
+            int offset = g * Width;
+            Float dx = Float::load(d[0] + offset), dy = Float::load(d[1] + offset), dz = Float::load(d[2] + offset);
+
+            /* Begin calculating determinant - also used to calculate U parameter */
+            Float px = dy * e2z - dz * e2y, py = dz * e2x - dx * e2z, pz = dx * e2y - dy * e2x;
+
+            /* If determinant is near zero, ray lies in plane of triangle */
+            Float det = e1x * px + (e1y * py + e1z * pz);
+            Float mask = abs(det) >= Float(1e-8f);
+            Float invDet = one / det;
+
+            /* Calculate distance from v[0] to ray origin */
+            Float tx = Float::load(o[0] + offset) - Float(p0.x()),
+                  ty = Float::load(o[1] + offset) - Float(p0.y()),
+                  tz = Float::load(o[2] + offset) - Float(p0.z());
+
+            /* Calculate U parameter and test bounds */
+            Float uu = (tx * px + (ty * py + tz * pz)) * invDet;
+            mask = mask & (uu >= zero) & (uu <= one);
+
+            /* Calculate V parameter and test bounds */
+            Float qx = ty * e1z - tz * e1y, qy = tz * e1x - tx * e1z, qz = tx * e1y - ty * e1x;
+            Float vv = (dx * qx + (dy * qy + dz * qz)) * invDet;
+            mask = mask & (vv >= zero) & (uu + vv <= one);
+
+            /* Ray intersects triangle -> compute t */
+            Float t = (e2x * qx + (e2y * qy + e2z * qz)) * invDet;
+            mask = mask & (t > Float::load(mint + offset)) & (t <= Float::load(maxt + offset));
+
+            uint32_t hits = movemask(mask) & ((active >> offset) & GroupMask);
+            if (!hits)
+                continue;
+
+            /* Only update the rays that are active in this subtree */
+            float tValues[Width], uValues[Width], vValues[Width];
+            t.store(tValues);
+            uu.store(uValues);
+            vv.store(vValues);
+            for (uint32_t m = hits; m; m &= m - 1) {
+                int k = lowestBit(m), i = offset + k;
+                maxt[i] = tValues[k];
+                u[i] = uValues[k];
+                v[i] = vValues[k];
+                f[i] = triIdx;
+            }
+            result |= hits << offset;
+        }
+        return result;
+    }
+
+    /// Traverse the binary tree; returns the mask of rays that found a hit
+    uint32_t traverse(const Accel &accel, bool shadowRay) {
+        struct StackEntry {
+            uint32_t node_idx, mask;
+        };
+        StackEntry stack[64];
+        uint32_t stack_idx = 0, active = valid, occluded = 0;
+
+        if (!active)
+            return 0;
+
+        const float *data[9];
+        for (int k = 0; k < 9; ++k)
+            data[k] = accel.getTriangleData(k);
+
+        stack[stack_idx++] = StackEntry { 0u, active };
+
+        while (stack_idx > 0) {
+            StackEntry entry = stack[--stack_idx];
+            const Accel::BVHNode &node = accel.m_nodeData[entry.node_idx];
+
+            /* Shadow rays that are already occluded stop participating */
+            uint32_t mask = boxTest(node.bbox, entry.mask & active);
+            if (!mask)
+                continue;
+
+            if (node.isInner()) {
+                /* Visit the child on the near side of the split plane first,
+                   using the direction of the first ray as a representative */
+                uint32_t left = entry.node_idx + 1, right = node.inner.rightChild;
+                bool reverse = d[node.inner.axis][lowestBit(mask)] < 0;
+                stack[stack_idx++] = StackEntry { reverse ? left : right, mask };
+                stack[stack_idx++] = StackEntry { reverse ? right : left, mask };
+                assert(stack_idx < 64);
+                continue;
+            }
+
+            for (uint32_t i = node.start(), end = node.end(); i < end && mask; ++i) {
+                const Point3f p0(data[0][i], data[1][i], data[2][i]);
+                const Vector3f edge1 = Point3f(data[3][i], data[4][i], data[5][i]) - p0;
+                const Vector3f edge2 = Point3f(data[6][i], data[7][i], data[8][i]) - p0;
+
+                uint32_t hits = triangleTest(p0, edge1, edge2, mask, i);
+                found |= hits;
+                if (shadowRay && hits) {
+                    occluded |= hits;
+                    active &= ~hits;
+                    mask &= ~hits;
+                    if (!active)
+                        return occluded;
+                }
+            }
+        }
+
+        return shadowRay ? occluded : found;
+    }
+};
+
+uint32_t Accel::rayIntersect(const RayPacket &packet, Intersection *its, bool shadowRay) const {
+    if (!shadowRay) {
+        for (uint32_t i = 0; i < packet.size; ++i)
+            its[i].t = std::numeric_limits<float>::infinity();
+    }
+
+    /* The packet traversal does not handle the object spaces of
+       instances, moving meshes, lazy meshes or the watertight test,
+       so trace the rays one by one in those cases */
+    if (!m_instances.empty() || !m_movingMeshes.empty() || !m_lazyMeshes.empty() || m_watertight) {
+        uint32_t result = 0;
+        Intersection unused;
+        for (uint32_t i = 0; i < packet.size; ++i) {
+            if (rayIntersect(packet.rays[i], shadowRay ? unused : its[i], shadowRay))
+                result |= 1u << i;
+        }
+        return result;
+    }
+
+    if (!m_nodeData || packet.size == 0)
+        return 0;
+
+    /* Packets only count their rays (the work is shared) */
+    RayStatistics &stats = RayStatistics::local();
+    if (shadowRay)
+        stats.shadowRays += packet.size;
+    else
+        stats.radianceRays += packet.size;
+
+    PacketTraversal traversal(packet);
+    uint32_t result = traversal.traverse(*this, shadowRay);
+
+    if (!shadowRay) {
+        for (uint32_t m = result; m; m &= m - 1) {
+            int i = lowestBit(m);
+            HitRecord hit;
+            hit.t = traversal.maxt[i];
+            hit.u = traversal.u[i];
+            hit.v = traversal.v[i];
+            hit.prim = traversal.f[i];
+            hit.time = packet.rays[i].time;
+            computeIntersection(hit, its[i]);
+        }
+    }
+
+    return result;
+}
+
+void Accel::rayIntersect(const Ray3f *rays, uint32_t count, Intersection *its,
+                         bool *hit, bool shadowRay) const {
+    /* Bucket the rays by the octant of their direction. The counting
+       sort keeps the original order (and coherence) within a bucket */
+    auto octant = [](const Ray3f &ray) {
+        return (ray.d.x() < 0 ? 1 : 0) | (ray.d.y() < 0 ? 2 : 0) | (ray.d.z() < 0 ? 4 : 0);
+    };
+
+    uint32_t offsets[9] = { 0 };
+    for (uint32_t i = 0; i < count; ++i)
+        offsets[octant(rays[i]) + 1]++;
+    for (int i = 0; i < 8; ++i)
+        offsets[i + 1] += offsets[i];
+
+    std::vector<uint32_t> order(count);
+    uint32_t fill[8];
+    memcpy(fill, offsets, sizeof(fill));
+    for (uint32_t i = 0; i < count; ++i)
+        order[fill[octant(rays[i])]++] = i;
+
+    RayPacket packet;
+    Intersection packetIts[RayPacket::MaxSize];
+
+    for (int oct = 0; oct < 8; ++oct) {
+        for (uint32_t start = offsets[oct]; start < offsets[oct + 1]; start += RayPacket::MaxSize) {
+            uint32_t end = std::min(start + (uint32_t) RayPacket::MaxSize, offsets[oct + 1]);
+
+            packet.clear();
+            for (uint32_t i = start; i < end; ++i)
+                packet.append(rays[order[i]]);
+
+            uint32_t mask = rayIntersect(packet, packetIts, shadowRay);
+
+            for (uint32_t i = start; i < end; ++i) {
+                uint32_t lane = i - start, idx = order[i];
+                hit[idx] = (mask >> lane) & 1;
+                if (!shadowRay)
+                    its[idx] = packetIts[lane];
+            }
+        }
+    }
+}
+
+NORI_NAMESPACE_END
@@ -0,0 +1,421 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/accel.h>
+#include <tbb/tbb.h>
+#include <atomic>
+
+/* ===================================================================
+    Spatial split BVH construction, see
+
+    "Spatial Splits in Bounding Volume Hierarchies" by Martin Stich,
+    Heiko Friedrich and Andreas Dietrich (HPG 2009)
+
+    Besides the usual object splits, every node also considers splitting
+    space itself: triangles that straddle the split plane are clipped
+    and referenced from both children. This gives much tighter boxes for
+    large and thin triangles, at the cost of duplicate references in
+    m_indices. Spatial splits are only attempted when the children of
+    the best object split overlap noticeably, and the total number of
+    duplicates is capped.
+ * =================================================================== */
+
+NORI_NAMESPACE_BEGIN
+
+class SBVHBuilder {
+public:
+    /// Build-related parameters
+    enum {
+        /// Number of bins for object and spatial splits
+        BIN_COUNT = 32,
+
+        /// Build subtrees with less than this many references on one thread
+        SERIAL_THRESHOLD = 4096,
+
+        /// Always create a leaf at this depth (traversal stacks hold 64 entries)
+        MAX_DEPTH = 56,
+
+        /// Heuristic cost value for traversal operations
+        TRAVERSAL_COST = 1,
+
+        /// Heuristic cost value for intersection operations
+        INTERSECTION_COST = 1
+    };
+
+    /// Only try spatial splits when the object split children overlap by this fraction of the root area
+    static constexpr float OVERLAP_THRESHOLD = 1e-5f;
+
+    /// Cap on the number of duplicate references, relative to the triangle count
+    static constexpr float MAX_DUPLICATION = 0.5f;
+
+    SBVHBuilder(Accel &bvh) : bvh(bvh) { }
+
+    void build() {
+        uint32_t size = bvh.getTriangleCount();
+        std::vector<Reference> refs(size);
+        tbb::parallel_for(
+            tbb::blocked_range<uint32_t>(0u, size, 1000u),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i)
+                    refs[i] = Reference { bvh.getBoundingBox(i), i };
+            }
+        );
+
+        rootArea = bvh.m_bbox.getSurfaceArea();
+        budget = (int64_t) (MAX_DUPLICATION * size);
+
+        Subtree tree;
+        build(refs, tree, 0);
+
+        bvh.m_nodes = std::move(tree.nodes);
+        bvh.m_indices = std::move(tree.indices);
+    }
+
+protected:
+    /// Reference to a (possibly clipped) triangle
+    struct Reference {
+        BoundingBox3f bbox;
+        uint32_t prim;
+    };
+
+    /// Nodes and indices of a subtree; node and index references are relative
+    struct Subtree {
+        std::vector<Accel::BVHNode> nodes;
+        std::vector<uint32_t> indices;
+    };
+
+    struct Split {
+        float cost = std::numeric_limits<float>::infinity();
+        int axis = -1;
+        float position;               ///< Spatial splits: location of the split plane
+        uint32_t index;               ///< Object splits: last bin on the left side
+        BoundingBox3f bbox_left, bbox_right;
+    };
+
+    /// SAH cost of a split into boxes with the given triangle counts
+    static float sahCost(float inv_area, uint32_t prims_left, const BoundingBox3f &bbox_left,
+                         uint32_t prims_right, const BoundingBox3f &bbox_right) {
+        return 2.0f * TRAVERSAL_COST + INTERSECTION_COST * inv_area *
+            (prims_left * bbox_left.getSurfaceArea() + prims_right * bbox_right.getSurfaceArea());
+    }
+
+    /// Bounding box of the part of a triangle between two planes along \c axis
+    BoundingBox3f clip(uint32_t prim, int axis, float min, float max) const {
+        const Accel::PrimitiveRef &ref = bvh.m_primitives[prim];
+        const Mesh *mesh = bvh.m_meshes[ref.mesh];
+        const MatrixXf &V = mesh->getVertexPositions();
+
+        BoundingBox3f result;
+        for (int i = 0; i < 3; ++i) {
+            Point3f a = V.col(mesh->getVertexIndex(ref.index, i)),
+                    b = V.col(mesh->getVertexIndex(ref.index, (i + 1) % 3));
+            if (a[axis] >= min && a[axis] <= max)
+                result.expandBy(a);
+
+            /* Intersections of the edge with both planes */
+            for (float plane : { min, max }) {
+                if ((a[axis] < plane && b[axis] > plane) || (a[axis] > plane && b[axis] < plane)) {
+                    float t = (plane - a[axis]) / (b[axis] - a[axis]);
+                    Point3f p = a + t * (b - a);
+                    p[axis] = plane;
+                    result.expandBy(p);
+                }
+            }
+        }
+        return result;
+    }
+
+    /// Binned SAH over the reference centroids
+    Split findObjectSplit(const std::vector<Reference> &refs, const BoundingBox3f &centroids,
+                          float inv_area) const {
+        Split best;
+        for (int axis = 0; axis < 3; ++axis) {
+            float min = centroids.min[axis], extent = centroids.max[axis] - min;
+            if (!(extent > 0))
+                continue;
+            float inv_bin_size = BIN_COUNT / extent;
+
+            uint32_t counts[BIN_COUNT] = { 0 };
+            BoundingBox3f bins[BIN_COUNT];
+            for (const Reference &ref : refs) {
+                int index = objectBin(ref, axis, min, inv_bin_size);
+                counts[index]++;
+                bins[index].expandBy(ref.bbox);
+            }
+
+            BoundingBox3f bbox_left[BIN_COUNT];
+            uint32_t counts_left[BIN_COUNT];
+            bbox_left[0] = bins[0];
+            counts_left[0] = counts[0];
+            for (int i = 1; i < BIN_COUNT; ++i) {
+                bbox_left[i] = BoundingBox3f::merge(bbox_left[i-1], bins[i]);
+                counts_left[i] = counts_left[i-1] + counts[i];
+            }
+
+            BoundingBox3f bbox_right;
+            uint32_t prims_right = 0;
+            for (int i = BIN_COUNT - 1; i >= 1; --i) {
+                bbox_right.expandBy(bins[i]);
+                prims_right += counts[i];
+                uint32_t prims_left = counts_left[i-1];
+                if (prims_left == 0 || prims_right == 0)
+                    continue;
+                float cost = sahCost(inv_area, prims_left, bbox_left[i-1], prims_right, bbox_right);
+                if (cost < best.cost) {
+                    best.cost = cost;
+                    best.axis = axis;
+                    best.index = (uint32_t) i - 1;
+                    best.position = min;
+                    best.bbox_left = bbox_left[i-1];
+                    best.bbox_right = bbox_right;
+                }
+            }
+        }
+        return best;
+    }
+
+    static int objectBin(const Reference &ref, int axis, float min, float inv_bin_size) {
+        float centroid = 0.5f * (ref.bbox.min[axis] + ref.bbox.max[axis]);
+        return std::min(std::max((int) ((centroid - min) * inv_bin_size), 0), (int) BIN_COUNT - 1);
+    }
+
+    /// Binned SAH over spatial split planes, with clipped references
+    Split findSpatialSplit(const std::vector<Reference> &refs, const BoundingBox3f &bbox,
+                           float inv_area) const {
+        Split best;
+        for (int axis = 0; axis < 3; ++axis) {
+            float min = bbox.min[axis], extent = bbox.max[axis] - min;
+            if (!(extent > 0))
+                continue;
+            float bin_size = extent / BIN_COUNT, inv_bin_size = BIN_COUNT / extent;
+            auto binOf = [&](float value) {
+                return std::min(std::max((int) ((value - min) * inv_bin_size), 0), (int) BIN_COUNT - 1);
+            };
+
+            uint32_t entries[BIN_COUNT] = { 0 }, exits[BIN_COUNT] = { 0 };
+            BoundingBox3f bins[BIN_COUNT];
+            for (const Reference &ref : refs) {
+                int first = binOf(ref.bbox.min[axis]), last = binOf(ref.bbox.max[axis]);
+                entries[first]++;
+                exits[last]++;
+                if (first == last) {
+                    bins[first].expandBy(ref.bbox);
+                    continue;
+                }
+                for (int i = first; i <= last; ++i) {
+                    BoundingBox3f part = clip(ref.prim, axis, min + i * bin_size,
+                        i == BIN_COUNT - 1 ? bbox.max[axis] : min + (i + 1) * bin_size);
+                    part.clip(ref.bbox);
+                    if (part.isValid())
+                        bins[i].expandBy(part);
+                }
+            }
+
+            BoundingBox3f bbox_left[BIN_COUNT];
+            uint32_t counts_left[BIN_COUNT];
+            bbox_left[0] = bins[0];
+            counts_left[0] = entries[0];
+            for (int i = 1; i < BIN_COUNT; ++i) {
+                bbox_left[i] = BoundingBox3f::merge(bbox_left[i-1], bins[i]);
+                counts_left[i] = counts_left[i-1] + entries[i];
+            }
+
+            BoundingBox3f bbox_right;
+            uint32_t prims_right = 0;
+            for (int i = BIN_COUNT - 1; i >= 1; --i) {
+                bbox_right.expandBy(bins[i]);
+                prims_right += exits[i];
+                uint32_t prims_left = counts_left[i-1];
+                if (prims_left == 0 || prims_right == 0)
+                    continue;
+                float cost = sahCost(inv_area, prims_left, bbox_left[i-1], prims_right, bbox_right);
+                if (cost < best.cost) {
+                    best.cost = cost;
+                    best.axis = axis;
+                    best.position = min + i * bin_size;
+                    best.bbox_left = bbox_left[i-1];
+                    best.bbox_right = bbox_right;
+                }
+            }
+        }
+        return best;
+    }
+
+    /// Partition the references according to an object split
+    void partitionObject(const std::vector<Reference> &refs, const Split &split, const BoundingBox3f &centroids,
+                         std::vector<Reference> &left, std::vector<Reference> &right) const {
+        float min = centroids.min[split.axis];
+        float inv_bin_size = BIN_COUNT / (centroids.max[split.axis] - min);
+        for (const Reference &ref : refs) {
+            if (objectBin(ref, split.axis, min, inv_bin_size) <= (int) split.index)
+                left.push_back(ref);
+            else
+                right.push_back(ref);
+        }
+    }
+
+    /**
+     * \brief Partition the references according to a spatial split, and
+     * clip the ones that straddle the plane. Returns \c false (and leaves
+     * \c left and \c right empty) if this would exceed the duplication budget.
+     */
+    bool partitionSpatial(const std::vector<Reference> &refs, const Split &split,
+                          std::vector<Reference> &left, std::vector<Reference> &right) {
+        int axis = split.axis;
+        float plane = split.position;
+
+        int64_t straddling = 0;
+        for (const Reference &ref : refs)
+            if (ref.bbox.min[axis] < plane && ref.bbox.max[axis] > plane)
+                straddling++;
+        if (budget.fetch_sub(straddling) < straddling) {
+            budget.fetch_add(straddling);
+            return false;
+        }
+
+        for (const Reference &ref : refs) {
+            if (ref.bbox.max[axis] <= plane) {
+                left.push_back(ref);
+            } else if (ref.bbox.min[axis] >= plane) {
+                right.push_back(ref);
+            } else {
+                float inf = std::numeric_limits<float>::infinity();
+                BoundingBox3f bbox_left = clip(ref.prim, axis, -inf, plane),
+                              bbox_right = clip(ref.prim, axis, plane, inf);
+                bbox_left.clip(ref.bbox);
+                bbox_right.clip(ref.bbox);
+                if (bbox_left.isValid())
+                    left.push_back(Reference { bbox_left, ref.prim });
+                if (bbox_right.isValid())
+                    right.push_back(Reference { bbox_right, ref.prim });
+            }
+        }
+
+        if (left.empty() || right.empty()) {
+            left.clear();
+            right.clear();
+            return false;
+        }
+        return true;
+    }
+
+    /// Append a subtree that was built separately and relocate its references
+    static void append(Subtree &out, Subtree &sub) {
+        uint32_t node_offset = (uint32_t) out.nodes.size(),
+                 index_offset = (uint32_t) out.indices.size();
+        for (Accel::BVHNode node : sub.nodes) {
+            if (node.isInner())
+                node.inner.rightChild += node_offset;
+            else
+                node.leaf.start += index_offset;
+            out.nodes.push_back(node);
+        }
+        out.indices.insert(out.indices.end(), sub.indices.begin(), sub.indices.end());
+        sub = Subtree();
+    }
+
+    /// Recursively build a subtree over \c refs (which is consumed)
+    void build(std::vector<Reference> &refs, Subtree &out, int depth) {
+        BoundingBox3f bbox, centroids;
+        for (const Reference &ref : refs) {
+            bbox.expandBy(ref.bbox);
+            centroids.expandBy(ref.bbox.getCenter());
+        }
+
+        uint32_t size = (uint32_t) refs.size();
+        uint32_t node_idx = (uint32_t) out.nodes.size();
+        out.nodes.emplace_back();
+        memset(&out.nodes[node_idx], 0, sizeof(Accel::BVHNode));
+        out.nodes[node_idx].bbox = bbox;
+
+        Split split;
+        bool spatial = false;
+        if (size > 1 && depth < MAX_DEPTH) {
+            float inv_area = 1.f / bbox.getSurfaceArea();
+            split = findObjectSplit(refs, centroids, inv_area);
+
+            /* Only look for spatial splits if the object split leaves a lot of overlap */
+            BoundingBox3f overlap = split.bbox_left;
+            overlap.clip(split.bbox_right);
+            if (budget > 0 && (split.axis < 0 ||
+                    (overlap.isValid() && overlap.getSurfaceArea() > OVERLAP_THRESHOLD * rootArea))) {
+                Split spatialSplit = findSpatialSplit(refs, bbox, inv_area);
+                if (spatialSplit.cost < split.cost) {
+                    split = spatialSplit;
+                    spatial = true;
+                }
+            }
+        }
+
+        std::vector<Reference> left, right;
+        if (split.cost < INTERSECTION_COST * size) {
+            if (spatial && !partitionSpatial(refs, split, left, right)) {
+                /* Over budget -- fall back to the object split */
+                split = findObjectSplit(refs, centroids, 1.f / bbox.getSurfaceArea());
+                spatial = false;
+            }
+            if (!spatial && split.axis >= 0 && split.cost < INTERSECTION_COST * size)
+                partitionObject(refs, split, centroids, left, right);
+        }
+
+        if (left.empty() || right.empty()) {
+            /* Splitting does not reduce the cost, make a leaf */
+            Accel::BVHNode &node = out.nodes[node_idx];
+            node.leaf.flag = 1;
+            node.leaf.start = (uint32_t) out.indices.size();
+            node.leaf.size = size;
+            for (const Reference &ref : refs)
+                out.indices.push_back(ref.prim);
+            return;
+        }
+
+        std::vector<Reference>().swap(refs);
+
+        uint32_t node_idx_right;
+        if (size >= SERIAL_THRESHOLD) {
+            Subtree subtree_left, subtree_right;
+            tbb::parallel_invoke(
+                [&] { build(left, subtree_left, depth + 1); },
+                [&] { build(right, subtree_right, depth + 1); }
+            );
+            append(out, subtree_left);
+            node_idx_right = (uint32_t) out.nodes.size();
+            append(out, subtree_right);
+        } else {
+            build(left, out, depth + 1);
+            node_idx_right = (uint32_t) out.nodes.size();
+            build(right, out, depth + 1);
+        }
+
+        Accel::BVHNode &node = out.nodes[node_idx];
+        node.inner.rightChild = node_idx_right;
+        node.inner.axis = split.axis;
+        node.inner.flag = 0;
+    }
+
+private:
+    Accel &bvh;
+    float rootArea;
+    std::atomic<int64_t> budget;
+};
+
+void Accel::buildSpatial() {
+    SBVHBuilder(*this).build();
+}
+
+NORI_NAMESPACE_END
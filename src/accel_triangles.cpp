@@ -0,0 +1,248 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/accel.h>
+#include <nori/simd.h>
+#include <tbb/tbb.h>
+
+/* ===================================================================
+    Triangle store: once the tree is built, the three vertices of
+    every triangle are copied into SoA arrays that follow the order of
+    m_indices. A leaf covers a contiguous range of these arrays, so its
+    triangles can be loaded and tested 4 (SSE) or 8 (AVX) at a time
+    without touching the meshes.
+
+    Two kernels are available: Moeller-Trumbore (the default) and the
+    watertight test of Woop et al. [2013], which never lets a ray slip
+    through the shared edge of two triangles and only reports hits
+    that are provably in front of the origin. The latter makes the
+    error-bounded ray origins of Intersection::spawnRay() safe.
+ * =================================================================== */
+
+NORI_NAMESPACE_BEGIN
+
+#if defined(NORI_SIMD_AVX)
+static const int TriangleWidth = 8;
+#else
+static const int TriangleWidth = 4;
+#endif
+
+void Accel::buildTriangleStore() {
+    uint32_t size = (uint32_t) m_indices.size();
+
+    /* Pad every component so that a full SIMD load starting at any
+       valid entry stays within the array */
+    m_triangleStride = (size + 2 * TriangleWidth - 1) & ~(uint32_t) (TriangleWidth - 1);
+    m_triangles.clear();
+    m_triangles.resize(9 * (size_t) m_triangleStride, 0.f);
+    m_triangles.shrink_to_fit();
+
+    float *data = m_triangles.data();
+    uint32_t stride = m_triangleStride;
+    std::vector<PrimitiveRef> primitives(std::move(m_primitives));
+    m_primitives.resize(size);
+
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0u, size, 1000u),
+        [&](const tbb::blocked_range<uint32_t> &range) {
+            for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                const PrimitiveRef &prim = primitives[m_indices[i]];
+                const Mesh *mesh = m_meshes[prim.mesh];
+                uint32_t idx = prim.index;
+                const MatrixXf &V = mesh->getVertexPositions();
+
+                for (int j = 0; j < 3; ++j) {
+                    const Point3f p = V.col(mesh->getVertexIndex(idx, j));
+                    for (int k = 0; k < 3; ++k)
+                        data[(3 * j + k) * stride + i] = p[k];
+                }
+                m_primitives[i] = prim;
+            }
+        }
+    );
+}
+
+/**
+ * Accept the hits of one batch of triangles in order, like a sequential
+ * loop over the triangles. Returns \c false if none is left
+ */
+template <typename Float> static bool acceptHits(uint32_t i, uint32_t hits, const Float &t,
+        const Float &u, const Float &v, Ray3f &ray, HitRecord &hit) {
+    float tValues[TriangleWidth], uValues[TriangleWidth], vValues[TriangleWidth];
+    t.store(tValues);
+    u.store(uValues);
+    v.store(vValues);
+    bool found = false;
+    for (; hits; hits &= hits - 1) {
+        int k = lowestBit(hits);
+        if (tValues[k] > ray.maxt)
+            continue;
+        ray.maxt = hit.t = tValues[k];
+        hit.u = uValues[k];
+        hit.v = vValues[k];
+        hit.prim = i + k;
+        found = true;
+    }
+    return found;
+}
+
+bool Accel::intersectLeaf(uint32_t start, uint32_t end, Ray3f &ray,
+                          HitRecord &hit, bool shadowRay) const {
+    if (m_watertight)
+        return intersectLeafWatertight(start, end, ray, hit, shadowRay);
+
+    typedef SimdFloat<TriangleWidth> Float;
+
+    const Float ox(ray.o.x()), oy(ray.o.y()), oz(ray.o.z());
+    const Float dx(ray.d.x()), dy(ray.d.y()), dz(ray.d.z());
+    const Float zero(0.f), one(1.f), mint(ray.mint);
+    const float *p0x = getTriangleData(0), *p0y = getTriangleData(1), *p0z = getTriangleData(2),
+                *p1x = getTriangleData(3), *p1y = getTriangleData(4), *p1z = getTriangleData(5),
+                *p2x = getTriangleData(6), *p2y = getTriangleData(7), *p2z = getTriangleData(8);
+    bool foundIntersection = false;
+
+    for (uint32_t i = start; i < end; i += TriangleWidth) {
+        /* Same sequence of operations as Mesh::rayIntersect() (including the
+           association used by Eigen's dot product) to get identical results */
+        const Float v0x = Float::load(p0x + i), v0y = Float::load(p0y + i), v0z = Float::load(p0z + i);
+        const Float edge1x = Float::load(p1x + i) - v0x, edge1y = Float::load(p1y + i) - v0y,
+                    edge1z = Float::load(p1z + i) - v0z;
+        const Float edge2x = Float::load(p2x + i) - v0x, edge2y = Float::load(p2y + i) - v0y,
+                    edge2z = Float::load(p2z + i) - v0z;
+
+        /* Begin calculating determinant - also used to calculate U parameter */
+        Float px = dy * edge2z - dz * edge2y, py = dz * edge2x - dx * edge2z, pz = dx * edge2y - dy * edge2x;
+
+        /* If determinant is near zero, ray lies in plane of triangle */
+        Float det = edge1x * px + (edge1y * py + edge1z * pz);
+        Float mask = abs(det) >= Float(1e-8f);
+        Float invDet = one / det;
+
+        /* Calculate distance from v[0] to ray origin */
+        Float tx = ox - v0x, ty = oy - v0y, tz = oz - v0z;
+
+        /* Calculate U parameter and test bounds */
+        Float u = (tx * px + (ty * py + tz * pz)) * invDet;
+        mask = mask & (u >= zero) & (u <= one);
+
+        /* Calculate V parameter and test bounds */
+        Float qx = ty * edge1z - tz * edge1y, qy = tz * edge1x - tx * edge1z, qz = tx * edge1y - ty * edge1x;
+        Float v = (dx * qx + (dy * qy + dz * qz)) * invDet;
+        mask = mask & (v >= zero) & (u + v <= one);
+
+        /* Ray intersects triangle -> compute t */
+        Float t = (edge2x * qx + (edge2y * qy + edge2z * qz)) * invDet;
+        /* Exclusive at mint: a ray that starts exactly on the plane of
+           the triangle (see Intersection::spawnRay()) gets t = 0 */
+        mask = mask & (t > mint) & (t <= Float(ray.maxt));
+
+        uint32_t hits = movemask(mask);
+        hit.triangleTests += std::min(end - i, (uint32_t) TriangleWidth);
+        if (end - i < (uint32_t) TriangleWidth)
+            hits &= (1u << (end - i)) - 1;
+        if (!hits)
+            continue;
+        if (shadowRay)
+            return true;
+
+        acceptHits(i, hits, t, u, v, ray, hit);
+        foundIntersection = true;
+    }
+
+    return foundIntersection;
+}
+
+bool Accel::intersectLeafWatertight(uint32_t start, uint32_t end, Ray3f &ray,
+                                    HitRecord &hit, bool shadowRay) const {
+    typedef SimdFloat<TriangleWidth> Float;
+
+    /* Permute the axes so that the dominant direction becomes z, and
+       shear the triangles so that the ray points along +z. Each
+       triangle is then tested in 2D against the origin, using edge
+       functions that are evaluated identically for shared edges */
+    const Vector3f absD = ray.d.cwiseAbs();
+    int kz = absD.x() > absD.y() ? (absD.x() > absD.z() ? 0 : 2) : (absD.y() > absD.z() ? 1 : 2);
+    int kx = (kz + 1) % 3, ky = (kx + 1) % 3;
+    const Float sx(-ray.d[kx] / ray.d[kz]), sy(-ray.d[ky] / ray.d[kz]), sz(1.f / ray.d[kz]);
+    const Float ox(ray.o[kx]), oy(ray.o[ky]), oz(ray.o[kz]);
+    const Float zero(0.f), mint(ray.mint);
+    const Float gamma2(errorBound(2)), gamma3(errorBound(3)), gamma5(errorBound(5));
+
+    const float *p[3][3];
+    for (int j = 0; j < 3; ++j) {
+        p[j][0] = getTriangleData(3 * j + kx);
+        p[j][1] = getTriangleData(3 * j + ky);
+        p[j][2] = getTriangleData(3 * j + kz);
+    }
+    bool foundIntersection = false;
+
+    for (uint32_t i = start; i < end; i += TriangleWidth) {
+        /* Translate, permute and shear the vertices */
+        Float x[3], y[3], z[3];
+        for (int j = 0; j < 3; ++j) {
+            z[j] = Float::load(p[j][2] + i) - oz;
+            x[j] = (Float::load(p[j][0] + i) - ox) + sx * z[j];
+            y[j] = (Float::load(p[j][1] + i) - oy) + sy * z[j];
+        }
+
+        /* Edge functions: the ray passes through the triangle if they
+           all have the same sign */
+        Float e0 = x[1] * y[2] - y[1] * x[2];
+        Float e1 = x[2] * y[0] - y[2] * x[0];
+        Float e2 = x[0] * y[1] - y[0] * x[1];
+        Float mask = ((e0 >= zero) & (e1 >= zero) & (e2 >= zero)) |
+                     ((e0 <= zero) & (e1 <= zero) & (e2 <= zero));
+
+        Float det = e0 + e1 + e2;
+        mask = mask & ((det < zero) | (det > zero));
+
+        /* Interpolate the scaled z coordinates to get the distance */
+        for (int j = 0; j < 3; ++j)
+            z[j] = z[j] * sz;
+        Float invDet = Float(1.f) / det;
+        Float t = (e0 * z[0] + e1 * z[1] + e2 * z[2]) * invDet;
+        mask = mask & (t >= mint) & (t <= Float(ray.maxt));
+
+        /* Only accept distances that are larger than their error bound
+           (Pharr et al., "Physically Based Rendering", 3rd ed., 3.9.6) */
+        Float maxX = max(max(abs(x[0]), abs(x[1])), abs(x[2]));
+        Float maxY = max(max(abs(y[0]), abs(y[1])), abs(y[2]));
+        Float maxZ = max(max(abs(z[0]), abs(z[1])), abs(z[2]));
+        Float maxE = max(max(abs(e0), abs(e1)), abs(e2));
+        Float deltaX = gamma5 * (maxX + maxZ), deltaY = gamma5 * (maxY + maxZ), deltaZ = gamma3 * maxZ;
+        Float deltaE = Float(2.f) * (gamma2 * maxX * maxY + deltaY * maxX + deltaX * maxY);
+        Float deltaT = Float(3.f) * (gamma3 * maxE * maxZ + deltaE * maxZ + deltaZ * maxE) * abs(invDet);
+        mask = mask & (t > deltaT);
+
+        uint32_t hits = movemask(mask);
+        hit.triangleTests += std::min(end - i, (uint32_t) TriangleWidth);
+        if (end - i < (uint32_t) TriangleWidth)
+            hits &= (1u << (end - i)) - 1;
+        if (!hits)
+            continue;
+        if (shadowRay)
+            return true;
+
+        /* e1 and e2 weight the second and the third vertex */
+        acceptHits(i, hits, t, e1 * invDet, e2 * invDet, ray, hit);
+        foundIntersection = true;
+    }
+
+    return foundIntersection;
+}
+
+NORI_NAMESPACE_END
@@ -0,0 +1,503 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/accel.h>
+#include <nori/simd.h>
+#include <nori/timer.h>
+#include <tbb/tbb.h>
+#include <chrono>
+
+/* ===================================================================
+    Wide BVH support: the binary SAH tree built in accel.cpp is
+    collapsed into a tree with up to 4 or 8 children per node, whose
+    boxes are stored in SoA form so that one traversal step can test
+    all of them with a handful of SIMD instructions. Children that are
+    hit are visited front to back. Optionally, the child boxes are
+    quantized to 8 bits relative to the box of their parent, which
+    halves the size of the nodes.
+ * =================================================================== */
+
+NORI_NAMESPACE_BEGIN
+
+/// Per-ray data that is shared by all slab tests of a traversal
+struct WideRay {
+    float o[3];      ///< Ray origin
+    float dRcp[3];   ///< Reciprocal ray direction
+    int nearRow[3];  ///< Row of \c bounds that holds the near plane along each axis
+    int farRow[3];   ///< Row of \c bounds that holds the far plane along each axis
+
+    WideRay(const Ray3f &ray) {
+        for (int i = 0; i < 3; ++i) {
+            o[i] = ray.o[i];
+            dRcp[i] = ray.dRcp[i];
+            nearRow[i] = 2 * i + (ray.d[i] < 0 ? 1 : 0);
+            farRow[i] = 2 * i + (ray.d[i] < 0 ? 0 : 1);
+        }
+    }
+};
+
+/*
+ * Slab tests against the children [offset, offset+4) of a wide node. Returns
+ * a bit mask of the children whose box overlaps [mint, maxt] and stores the
+ * entry distances in 'tnear'. The operand order of min/max is chosen so that
+ * NaNs (0 * inf for axis-parallel rays that graze a plane) are ignored, which
+ * keeps the test conservative.
+ */
+template <int N> static inline uint32_t slabTest4(const float (&bounds)[6][N], int offset,
+        const WideRay &ray, float mint, float maxt, float *tnear) {
+#if defined(NORI_SIMD_SSE)
+    __m128 tn = _mm_set1_ps(mint), tf = _mm_set1_ps(maxt);
+    for (int i = 0; i < 3; ++i) {
+        __m128 o = _mm_set1_ps(ray.o[i]), dRcp = _mm_set1_ps(ray.dRcp[i]);
+        __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(bounds[ray.nearRow[i]] + offset), o), dRcp);
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(bounds[ray.farRow[i]] + offset), o), dRcp);
+        tn = _mm_max_ps(t0, tn);
+        tf = _mm_min_ps(t1, tf);
+    }
+    _mm_storeu_ps(tnear, tn);
+    return (uint32_t) _mm_movemask_ps(_mm_cmple_ps(tn, tf));
+#else
+    uint32_t mask = 0;
+    for (int k = 0; k < 4; ++k) {
+        float tn = mint, tf = maxt;
+        for (int i = 0; i < 3; ++i) {
+            float t0 = (bounds[ray.nearRow[i]][offset + k] - ray.o[i]) * ray.dRcp[i];
+            float t1 = (bounds[ray.farRow[i]][offset + k] - ray.o[i]) * ray.dRcp[i];
+            tn = t0 > tn ? t0 : tn;
+            tf = t1 < tf ? t1 : tf;
+        }
+        tnear[k] = tn;
+        if (tn <= tf)
+            mask |= 1u << k;
+    }
+    return mask;
+#endif
+}
+
+template <int N> static inline uint32_t slabTest(const float (&bounds)[6][N],
+        const WideRay &ray, float mint, float maxt, float *tnear) {
+    uint32_t mask = 0;
+    for (int offset = 0; offset < N; offset += 4)
+        mask |= slabTest4(bounds, offset, ray, mint, maxt, tnear + offset) << offset;
+    return mask;
+}
+
+#if defined(NORI_SIMD_AVX)
+template <> inline uint32_t slabTest<8>(const float (&bounds)[6][8],
+        const WideRay &ray, float mint, float maxt, float *tnear) {
+    __m256 tn = _mm256_set1_ps(mint), tf = _mm256_set1_ps(maxt);
+    for (int i = 0; i < 3; ++i) {
+        __m256 o = _mm256_set1_ps(ray.o[i]), dRcp = _mm256_set1_ps(ray.dRcp[i]);
+        __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(bounds[ray.nearRow[i]]), o), dRcp);
+        __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(bounds[ray.farRow[i]]), o), dRcp);
+        tn = _mm256_max_ps(t0, tn);
+        tf = _mm256_min_ps(t1, tf);
+    }
+    _mm256_storeu_ps(tnear, tn);
+    return (uint32_t) _mm256_movemask_ps(_mm256_cmp_ps(tn, tf, _CMP_LE_OQ));
+}
+#endif
+
+/// Collapses the binary tree of an \ref Accel into a wide tree
+template <int N> class WideBVHBuilder {
+public:
+    typedef Accel::WideBVHNode<N> Node;
+
+    WideBVHBuilder(const std::vector<Accel::BVHNode> &binary, std::vector<Node> &nodes)
+        : m_binary(binary), m_nodes(nodes) { }
+
+    void build() {
+        m_nodes.clear();
+        m_nodes.emplace_back();
+
+        const Accel::BVHNode &root = m_binary[0];
+        uint32_t children[N], childCount = 0;
+        if (root.isLeaf())
+            children[childCount++] = 0; /* Degenerate case: the entire scene is a single leaf */
+        else
+            childCount = gather(0, children);
+        fill(0, children, childCount);
+    }
+
+protected:
+    /**
+     * Collect up to N descendants of a binary inner node by repeatedly
+     * opening the inner child with the largest surface area
+     */
+    uint32_t gather(uint32_t node_idx, uint32_t *children) const {
+        const Accel::BVHNode &node = m_binary[node_idx];
+        uint32_t count = 2;
+        children[0] = node_idx + 1;
+        children[1] = node.inner.rightChild;
+
+        while (count < N) {
+            int best = -1;
+            float bestArea = -1;
+            for (uint32_t i = 0; i < count; ++i) {
+                const Accel::BVHNode &child = m_binary[children[i]];
+                if (child.isInner() && child.bbox.getSurfaceArea() > bestArea) {
+                    best = (int) i;
+                    bestArea = child.bbox.getSurfaceArea();
+                }
+            }
+            if (best < 0)
+                break;
+            uint32_t opened = children[best];
+            children[best] = opened + 1;
+            children[count++] = m_binary[opened].inner.rightChild;
+        }
+        return count;
+    }
+
+    /// Initialize the wide node \c wide_idx from a list of binary nodes and recurse
+    void fill(uint32_t wide_idx, const uint32_t *children, uint32_t childCount) {
+        uint32_t first = (uint32_t) m_nodes.size(), innerCount = 0;
+        for (uint32_t i = 0; i < childCount; ++i)
+            innerCount += m_binary[children[i]].isInner() ? 1 : 0;
+
+        /* Allocate the wide children of this node contiguously */
+        m_nodes.resize(m_nodes.size() + innerCount);
+
+        Node &node = m_nodes[wide_idx];
+        for (int i = 0; i < N; ++i) {
+            for (int axis = 0; axis < 3; ++axis) {
+                node.bounds[2*axis][i] = std::numeric_limits<float>::infinity();
+                node.bounds[2*axis+1][i] = -std::numeric_limits<float>::infinity();
+            }
+            node.child[i] = 0;
+            node.count[i] = 0;
+        }
+
+        for (uint32_t i = 0, next = first; i < childCount; ++i) {
+            const Accel::BVHNode &child = m_binary[children[i]];
+            for (int axis = 0; axis < 3; ++axis) {
+                node.bounds[2*axis][i] = child.bbox.min[axis];
+                node.bounds[2*axis+1][i] = child.bbox.max[axis];
+            }
+            if (child.isLeaf()) {
+                node.child[i] = child.start();
+                node.count[i] = child.leaf.size;
+            } else {
+                node.child[i] = next++;
+            }
+        }
+
+        for (uint32_t i = 0, next = first; i < childCount; ++i) {
+            if (m_binary[children[i]].isLeaf())
+                continue;
+            uint32_t grandChildren[N];
+            uint32_t count = gather(children[i], grandChildren);
+            fill(next++, grandChildren, count);
+        }
+    }
+
+private:
+    const std::vector<Accel::BVHNode> &m_binary;
+    std::vector<Node> &m_nodes;
+};
+
+/// Converts the nodes of a wide tree into nodes with quantized child boxes
+template <int N> class QuantizedWideBVHBuilder {
+public:
+    typedef Accel::WideBVHNode<N> Node;
+    typedef Accel::QuantizedWideBVHNode<N> QuantizedNode;
+
+    /// Return the power of two <tt>2^exponent</tt> (normal range only)
+    static inline float scale(int exponent) {
+        uint32_t bits = (uint32_t) (exponent + 127) << 23;
+        float result;
+        memcpy(&result, &bits, sizeof(float));
+        return result;
+    }
+
+    /**
+     * Decode the child boxes of a quantized node. The builder checks the
+     * offsets with this very function, and <tt>q * 2^e</tt> is exact, so
+     * the decoded boxes are conservative whether or not the compiler
+     * contracts the operations into fused multiply-adds.
+     */
+    static inline void decode(const QuantizedNode &node, float (&bounds)[6][N]) {
+        for (int axis = 0; axis < 3; ++axis) {
+            float origin = node.origin[axis], s = scale(node.exponent[axis]);
+            for (int i = 0; i < N; ++i) {
+                bounds[2*axis][i] = origin + (float) node.qmin[axis][i] * s;
+                bounds[2*axis+1][i] = origin + (float) node.qmax[axis][i] * s;
+            }
+        }
+    }
+
+    static void build(const std::vector<Node> &nodes, std::vector<QuantizedNode> &quantized) {
+        quantized.resize(nodes.size());
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, nodes.size(), 1000),
+            [&](const tbb::blocked_range<size_t> &range) {
+                for (size_t i = range.begin(); i != range.end(); ++i)
+                    quantize(nodes[i], quantized[i]);
+            }
+        );
+    }
+
+protected:
+    static void quantize(const Node &node, QuantizedNode &result) {
+        memset(&result, 0, sizeof(QuantizedNode));
+        for (int i = 0; i < N; ++i) {
+            /* Unused slots have an inverted box */
+            if (node.bounds[0][i] <= node.bounds[1][i])
+                result.valid |= (uint8_t) (1u << i);
+            result.child[i] = node.child[i];
+            result.count[i] = node.count[i];
+        }
+
+        for (int axis = 0; axis < 3; ++axis) {
+            const float *lower = node.bounds[2*axis], *upper = node.bounds[2*axis+1];
+            float lo = std::numeric_limits<float>::infinity(), hi = -lo;
+            for (int i = 0; i < N; ++i) {
+                if (result.valid & (1u << i)) {
+                    lo = std::min(lo, lower[i]);
+                    hi = std::max(hi, upper[i]);
+                }
+            }
+
+            /* Smallest power of two for which 255 steps span the box */
+            int exponent = -100;
+            if (hi > lo) {
+                std::frexp((hi - lo) / 255.f, &exponent);
+                exponent = std::max(exponent, -100);
+            }
+            while (lo + 255.f * scale(exponent) < hi)
+                ++exponent;
+            if (exponent > 127)
+                throw NoriException("QuantizedWideBVHBuilder: the scene is too large!");
+
+            float s = scale(exponent);
+            result.origin[axis] = lo;
+            result.exponent[axis] = (int8_t) exponent;
+
+            for (int i = 0; i < N; ++i) {
+                if (!(result.valid & (1u << i)))
+                    continue;
+
+                int qmin = (int) std::floor((lower[i] - lo) / s);
+                int qmax = (int) std::ceil((upper[i] - lo) / s);
+                qmin = std::min(std::max(qmin, 0), 255);
+                qmax = std::min(std::max(qmax, 0), 255);
+
+                /* Round outwards until the decoded box contains the exact one */
+                while (qmin > 0 && lo + (float) qmin * s > lower[i])
+                    --qmin;
+                while (qmax < 255 && lo + (float) qmax * s < upper[i])
+                    ++qmax;
+
+                result.qmin[axis][i] = (uint8_t) qmin;
+                result.qmax[axis][i] = (uint8_t) qmax;
+            }
+        }
+    }
+};
+
+/// Front-to-back traversal of a wide tree
+template <int N> struct WideBVHTraversal {
+    struct StackEntry {
+        uint32_t child, count;
+        float tnear;
+    };
+
+    /// Slab test against the children of a node (see \ref slabTest())
+    static inline uint32_t intersectChildren(const Accel::WideBVHNode<N> &node,
+            const WideRay &ray, float mint, float maxt, float *tnear) {
+        return slabTest<N>(node.bounds, ray, mint, maxt, tnear);
+    }
+
+#if defined(NORI_SIMD_SSE)
+    /**
+     * Slab tests against the children of a quantized node. The offsets
+     * of all planes are converted 16 at a time, and the planes are then
+     * decoded with the same operations as in \ref QuantizedWideBVHBuilder::decode()
+     * before they are intersected.
+     */
+    static inline uint32_t quantizedSlabTest(const Accel::QuantizedWideBVHNode<N> &node,
+            const WideRay &ray, float mint, float maxt, float *tnear) {
+        /* qmin and qmax are adjacent: 6*N offsets in total */
+        alignas(16) float q[6][N];
+        const __m128i zero = _mm_setzero_si128();
+        const uint8_t *offsets = node.qmin[0];
+        for (int i = 0; i < 6 * N; i += 16) {
+            __m128i v = 6 * N - i >= 16
+                ? _mm_loadu_si128((const __m128i *) (offsets + i))
+                : _mm_loadl_epi64((const __m128i *) (offsets + i));
+            __m128i lo = _mm_unpacklo_epi8(v, zero), hi = _mm_unpackhi_epi8(v, zero);
+            float *dst = q[0] + i;
+            _mm_store_ps(dst, _mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)));
+            _mm_store_ps(dst + 4, _mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)));
+            if (6 * N - i >= 16) {
+                _mm_store_ps(dst + 8, _mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)));
+                _mm_store_ps(dst + 12, _mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero)));
+            }
+        }
+
+        uint32_t mask = 0;
+        for (int offset = 0; offset < N; offset += 4) {
+            __m128 tn = _mm_set1_ps(mint), tf = _mm_set1_ps(maxt);
+            for (int i = 0; i < 3; ++i) {
+                /* Row 2*i holds qmin, row 2*i+1 qmax (as in WideBVHNode::bounds) */
+                const float *nearPlanes = q[3 * (ray.nearRow[i] & 1) + i] + offset;
+                const float *farPlanes = q[3 * (ray.farRow[i] & 1) + i] + offset;
+                __m128 origin = _mm_set1_ps(node.origin[i]);
+                __m128 s = _mm_set1_ps(QuantizedWideBVHBuilder<N>::scale(node.exponent[i]));
+                __m128 o = _mm_set1_ps(ray.o[i]), dRcp = _mm_set1_ps(ray.dRcp[i]);
+                __m128 b0 = _mm_add_ps(origin, _mm_mul_ps(_mm_load_ps(nearPlanes), s));
+                __m128 b1 = _mm_add_ps(origin, _mm_mul_ps(_mm_load_ps(farPlanes), s));
+                __m128 t0 = _mm_mul_ps(_mm_sub_ps(b0, o), dRcp);
+                __m128 t1 = _mm_mul_ps(_mm_sub_ps(b1, o), dRcp);
+                tn = _mm_max_ps(t0, tn);
+                tf = _mm_min_ps(t1, tf);
+            }
+            _mm_storeu_ps(tnear + offset, tn);
+            mask |= (uint32_t) _mm_movemask_ps(_mm_cmple_ps(tn, tf)) << offset;
+        }
+        return mask;
+    }
+#endif
+
+    /// Slab test against the decoded children of a quantized node
+    static inline uint32_t intersectChildren(const Accel::QuantizedWideBVHNode<N> &node,
+            const WideRay &ray, float mint, float maxt, float *tnear) {
+#if defined(NORI_SIMD_SSE)
+        return quantizedSlabTest(node, ray, mint, maxt, tnear) & node.valid;
+#else
+        float bounds[6][N];
+        QuantizedWideBVHBuilder<N>::decode(node, bounds);
+        return slabTest<N>(bounds, ray, mint, maxt, tnear) & node.valid;
+#endif
+    }
+
+    template <typename Node> static bool rayIntersect(const Accel &accel, const Node *nodes,
+            Ray3f &ray, HitRecord &hit, bool shadowRay) {
+        /* Every level pushes at most N-1 entries beyond the one it consumes */
+        StackEntry stack[64 * N];
+        uint32_t stack_idx = 0;
+        bool foundIntersection = false;
+        WideRay wray(ray);
+
+        stack[stack_idx++] = StackEntry { 0u, 0u, ray.mint };
+
+        while (stack_idx > 0) {
+            const StackEntry entry = stack[--stack_idx];
+
+            /* Skip subtrees that lie behind the closest hit found so far */
+            if (entry.tnear > ray.maxt)
+                continue;
+
+            if (entry.count > 0) {
+                if (accel.intersectLeaf(entry.child, entry.child + entry.count, ray, hit, shadowRay)) {
+                    if (shadowRay)
+                        return true;
+                    foundIntersection = true;
+                }
+                continue;
+            }
+
+            const Node &node = nodes[entry.child];
+            hit.nodeVisits++;
+            float tnear[N];
+            uint32_t mask = intersectChildren(node, wray, ray.mint, ray.maxt, tnear);
+
+            /* Sort the hit children by decreasing entry distance (insertion
+               sort), so that the closest one ends up on top of the stack */
+            uint32_t first = stack_idx;
+            for (; mask; mask &= mask - 1) {
+                int i = lowestBit(mask);
+                StackEntry e { node.child[i], node.count[i], tnear[i] };
+                uint32_t j = stack_idx++;
+                while (j > first && stack[j-1].tnear < e.tnear) {
+                    stack[j] = stack[j-1];
+                    --j;
+                }
+                stack[j] = e;
+            }
+            assert(stack_idx <= 64 * N);
+        }
+
+        return foundIntersection;
+    }
+};
+
+void Accel::buildWide() {
+    if (!m_quiet) {
+        cout << "Collapsing into a " << (int) m_layout << "-wide BVH .. ";
+        cout.flush();
+    }
+    Timer timer;
+    auto before = std::chrono::system_clock::now();
+
+    size_t nodeCount, memory;
+    if (m_layout == EWide8) {
+        WideBVHBuilder<8>(m_nodes, m_nodes8).build();
+        m_nodes8.shrink_to_fit();
+        nodeCount = m_nodes8.size();
+        memory = sizeof(WideBVHNode<8>) * nodeCount;
+    } else {
+        WideBVHBuilder<4>(m_nodes, m_nodes4).build();
+        m_nodes4.shrink_to_fit();
+        nodeCount = m_nodes4.size();
+        memory = sizeof(WideBVHNode<4>) * nodeCount;
+    }
+
+    /* Only the quantized nodes are kept for traversal */
+    size_t quantizedMemory = 0;
+    if (m_compressed) {
+        if (m_layout == EWide8) {
+            QuantizedWideBVHBuilder<8>::build(m_nodes8, m_quantized8);
+            quantizedMemory = sizeof(QuantizedWideBVHNode<8>) * nodeCount;
+            m_nodes8 = std::vector<WideBVHNode<8>>();
+        } else {
+            QuantizedWideBVHBuilder<4>::build(m_nodes4, m_quantized4);
+            quantizedMemory = sizeof(QuantizedWideBVHNode<4>) * nodeCount;
+            m_nodes4 = std::vector<WideBVHNode<4>>();
+        }
+    }
+
+    if (m_quiet)
+        return;
+    cout << "done (took " << timer.elapsedString() << ", " << nodeCount << " nodes and ";
+    if (m_compressed)
+        cout << memString(quantizedMemory) << " quantized, " << memString(memory) << " uncompressed";
+    else
+        cout << memString(memory);
+    cout << ")." << endl;
+    auto after = std::chrono::system_clock::now();
+    cout << "# benchmark # BVH phase \"wide collapse\" took: "
+         << std::chrono::duration<double>(after - before).count() << " s" << endl;
+}
+
+bool Accel::rayIntersectWide(Ray3f &ray, HitRecord &hit, bool shadowRay) const {
+    if (m_compressed) {
+        if (m_layout == EWide8)
+            return WideBVHTraversal<8>::rayIntersect(*this,
+                (const QuantizedWideBVHNode<8> *) m_wideNodeData, ray, hit, shadowRay);
+        else
+            return WideBVHTraversal<4>::rayIntersect(*this,
+                (const QuantizedWideBVHNode<4> *) m_wideNodeData, ray, hit, shadowRay);
+    }
+
+    if (m_layout == EWide8)
+        return WideBVHTraversal<8>::rayIntersect(*this, (const WideBVHNode<8> *) m_wideNodeData, ray, hit, shadowRay);
+    else
+        return WideBVHTraversal<4>::rayIntersect(*this, (const WideBVHNode<4> *) m_wideNodeData, ray, hit, shadowRay);
+}
+
+NORI_NAMESPACE_END
@@ -54,14 +54,15 @@ ImageBlock::~ImageBlock() {
     delete[] m_weightsY;
 }
 
-Bitmap *ImageBlock::toBitmap() const
+Bitmap *ImageBlock::toBitmap(bool divideByWeight) const
 {
     Bitmap *result = new Bitmap(m_size);
     for (int y=0; y<m_size.y(); ++y)
     {
         for (int x=0; x<m_size.x(); ++x)
         {
-            result->coeffRef(y, x) = coeff(y + m_borderSize, x + m_borderSize).head<3>();
+            const Color4f &pixel = coeff(y + m_borderSize, x + m_borderSize);
+            result->coeffRef(y, x) = divideByWeight ? pixel.divideByFilterWeight() : Color3f(pixel.head<3>());
             // result->coeffRef(y, x) = Color4f(result->coeffRef(y, x)).divideByFilterWeight();
         }
     }
@@ -77,7 +78,7 @@ void ImageBlock::fromBitmap(const Bitmap &bitmap) {
             coeffRef(y, x) << bitmap.coeff(y, x), 1;
 }
 
-void ImageBlock::put(const Point2f &_pos, const Color3f &value)
+void ImageBlock::put(const Point2f &_pos, const Color3f &value, float weight)
 {
     if (!value.isValid())
     {
@@ -113,7 +114,7 @@ void ImageBlock::put(const Point2f &_pos, const Color3f &value)
     * weight. */
     for (int y = bbox.min.y(), yr = 0; y <= bbox.max.y(); ++y, ++yr)
         for (int x = bbox.min.x(), xr = 0; x <= bbox.max.x(); ++x, ++xr)
-            coeffRef(y, x) += Color4f(value) * m_weightsX[xr] * m_weightsY[yr];
+            coeffRef(y, x) += Color4f(value) * m_weightsX[xr] * m_weightsY[yr] * weight;
 
 }
     
@@ -128,54 +129,286 @@ void ImageBlock::put(ImageBlock &b) {
         += b.topLeftCorner(size.y(), size.x());
 }
 
+void ImageBlock::merge(const ImageBlock &b) {
+    /* Without a border, the pixels of b belong to b alone */
+    assert(b.getBorderSize() == 0);
+
+    Vector2i offset = b.getOffset() - m_offset + Vector2i::Constant(m_borderSize);
+    block(offset.y(), offset.x(), b.getSize().y(), b.getSize().x())
+        += b.topLeftCorner(b.getSize().y(), b.getSize().x());
+}
+
 std::string ImageBlock::toString() const {
     return tfm::format("ImageBlock[offset=%s, size=%s]]",
         m_offset.toString(), m_size.toString());
 }
 
-BlockGenerator::BlockGenerator(const Vector2i &size, int blockSize)
-        : m_size(size), m_blockSize(blockSize) {
-    m_numBlocks = Vector2i(
-        (int) std::ceil(size.x() / (float) blockSize),
-        (int) std::ceil(size.y() / (float) blockSize));
-    m_blocksLeft = m_numBlocks.x() * m_numBlocks.y();
-    m_direction = ERight;
-    m_block = Point2i(m_numBlocks / 2);
-    m_stepsLeft = 1;
-    m_numSteps = 1;
+RowAccumulator::RowAccumulator(const Vector2i &size, int blockSize, int borderSize)
+        : m_size(size), m_blockSize(blockSize), m_borderSize(borderSize) {
+    int blocksX = (size.x() + blockSize - 1) / blockSize;
+    m_rows.resize(size.y() * (2*borderSize + 1), blocksX * (blockSize + 2*borderSize));
 }
 
-bool BlockGenerator::next(ImageBlock &block) {
-    tbb::mutex::scoped_lock lock(m_mutex);
+void RowAccumulator::put(const ImageBlock &row) {
+    int height = 2*m_borderSize + 1;
+    int width  = row.getSize().x() + 2*m_borderSize;
+    int blockX = row.getOffset().x() / m_blockSize;
+
+    m_rows.block(row.getOffset().y() * height, blockX * (m_blockSize + 2*m_borderSize), height, width)
+        = row.topLeftCorner(height, width);
+}
+
+void RowAccumulator::addTo(ImageBlock &image) const {
+    int height = 2*m_borderSize + 1;
+    int blocksX = (m_size.x() + m_blockSize - 1) / m_blockSize;
+
+    /* Every row of the image (including its border) sums the rows that
+       overlap it, always in the same order */
+    tbb::parallel_for(tbb::blocked_range<int>(0, (int) image.rows()),
+        [&](const tbb::blocked_range<int> &range) {
+            for (int dest = range.begin(); dest < range.end(); ++dest) {
+                int first = std::max(0, dest - 2*m_borderSize), last = std::min(m_size.y() - 1, dest);
+                for (int y = first; y <= last; ++y) {
+                    for (int blockX = 0; blockX < blocksX; ++blockX) {
+                        int x = blockX * m_blockSize;
+                        int width = std::min(m_blockSize, m_size.x() - x) + 2*m_borderSize;
+                        image.block(dest, x, 1, width) += m_rows.block(
+                            y * height + dest - y, blockX * (m_blockSize + 2*m_borderSize), 1, width);
+                    }
+                }
+            }
+        });
+}
+
+PixelStatistics::PixelStatistics(const Vector2i &size)
+        : m_size(size), m_mean(size.prod(), 0.f), m_m2(size.prod(), 0.f),
+          m_count(size.prod(), 0), m_passCount(size.prod(), 0) { }
+
+float PixelStatistics::error(int i) const {
+    if (m_count[i] < 2)
+        return std::numeric_limits<float>::infinity();
+    float varianceOfMean = m_m2[i] / ((m_count[i] - 1) * (float) m_count[i]);
+    return varianceOfMean / (m_mean[i] * m_mean[i] + 0.01f);
+}
+
+float PixelStatistics::getNoise() const {
+    double sum = 0;
+    for (size_t i = 0; i < m_mean.size(); ++i)
+        sum += error((int) i);
+    return (float) std::sqrt(sum / m_mean.size());
+}
+
+uint64_t PixelStatistics::allocate(uint64_t budget, uint32_t maxSamples) {
+    /* Pixels without an estimate share the budget before all others */
+    size_t unknown = 0;
+    std::vector<float> errors(m_mean.size());
+    for (size_t i = 0; i < m_mean.size(); ++i) {
+        errors[i] = error((int) i);
+        if (std::isinf(errors[i]))
+            unknown++;
+    }
+
+    /* Average the errors over a 5x5 window. Otherwise the pixels whose
+       samples missed the rare bright paths so far (and look converged)
+       would keep their too dark estimates, while the ones that found them
+       are sampled until they drop back to the mean */
+    const int radius = 2;
+    std::vector<float> smoothed(m_mean.size()), rows(m_mean.size());
+    for (int pass = 0; pass < 2 && unknown == 0; ++pass) {
+        const std::vector<float> &src = pass == 0 ? errors : rows;
+        std::vector<float> &dest = pass == 0 ? rows : smoothed;
+        for (int y = 0; y < m_size.y(); ++y) {
+            for (int x = 0; x < m_size.x(); ++x) {
+                double sum = 0;
+                int count = 0;
+                for (int d = -radius; d <= radius; ++d) {
+                    Point2i p = pass == 0 ? Point2i(x + d, y) : Point2i(x, y + d);
+                    if ((p.array() < 0).any() || (p.array() >= m_size.array()).any())
+                        continue;
+                    sum += src[index(p)];
+                    count++;
+                }
+                dest[index(Point2i(x, y))] = (float) (sum / count);
+            }
+        }
+    }
+
+    double total = 0;
+    for (size_t i = 0; i < m_mean.size() && unknown == 0; ++i)
+        total += smoothed[i];
+
+    double carry = 0;
+    uint64_t allocated = 0;
+    for (size_t i = 0; i < m_mean.size(); ++i) {
+        double share;
+        if (unknown > 0)
+            share = std::isinf(errors[i]) ? (double) budget / unknown : 0.0;
+        else if (total > 0)
+            share = budget * (smoothed[i] / total);
+        else
+            share = (double) budget / m_mean.size();
+        carry += std::min(share, (double) maxSamples);
+        uint32_t samples = (uint32_t) std::min(std::floor(carry), (double) maxSamples);
+        carry -= samples;
+        m_passCount[i] = samples;
+        allocated += samples;
+    }
+    return allocated;
+}
+
+std::string PixelStatistics::getSampleHistogram() const {
+    std::vector<size_t> buckets;
+    for (uint32_t count : m_count) {
+        size_t bucket = 0;
+        while ((2u << bucket) <= count)
+            ++bucket;
+        if (buckets.size() <= bucket)
+            buckets.resize(bucket + 1, 0);
+        buckets[bucket]++;
+    }
 
-    if (m_blocksLeft == 0)
-        return false;
+    std::string result;
+    for (size_t i = 0; i < buckets.size(); ++i) {
+        if (buckets[i] == 0)
+            continue;
+        result += tfm::format("%s[%i, %i): %.1f%%", result.empty() ? "" : ", ",
+                              i == 0 ? 0 : 1 << i, 2 << i, 100.0 * buckets[i] / m_count.size());
+    }
+    return result;
+}
+
+bool PixelStatistics::write(FILE *file) const {
+    size_t count = m_mean.size();
+    return fwrite(m_mean.data(), sizeof(float), count, file) == count &&
+           fwrite(m_m2.data(), sizeof(float), count, file) == count &&
+           fwrite(m_count.data(), sizeof(uint32_t), count, file) == count;
+}
+
+bool PixelStatistics::read(FILE *file) {
+    size_t count = m_mean.size();
+    return fread(m_mean.data(), sizeof(float), count, file) == count &&
+           fread(m_m2.data(), sizeof(float), count, file) == count &&
+           fread(m_count.data(), sizeof(uint32_t), count, file) == count;
+}
 
-    Point2i pos = m_block * m_blockSize;
-    block.setOffset(pos);
-    block.setSize((m_size - pos).cwiseMin(Vector2i::Constant(m_blockSize)));
+BlockGenerator::BlockGenerator(const Vector2i &size, int blockSize, int workerCount)
+        : m_workers(workerCount), m_workerCount(workerCount),
+          m_size(size), m_blockSize(blockSize) {
+    Vector2i numBlocks(
+        (int) std::ceil(size.x() / (float) blockSize),
+        (int) std::ceil(size.y() / (float) blockSize));
 
-    if (--m_blocksLeft == 0)
-        return true;
+    /* Walk the spiral once and record the blocks inside the image */
+    int blocksLeft = numBlocks.x() * numBlocks.y();
+    int direction = ERight, stepsLeft = 1, numSteps = 1;
+    Point2i block(numBlocks / 2);
+    m_blocks.reserve(blocksLeft);
 
-    do {
-        switch (m_direction) {
-            case ERight: ++m_block.x(); break;
-            case EDown:  ++m_block.y(); break;
-            case ELeft:  --m_block.x(); break;
-            case EUp:    --m_block.y(); break;
+    while (blocksLeft > 0) {
+        if ((block.array() >= 0).all() && (block.array() < numBlocks.array()).all()) {
+            m_blocks.push_back(block);
+            --blocksLeft;
         }
 
-        if (--m_stepsLeft == 0) {
-            m_direction = (m_direction + 1) % 4;
-            if (m_direction == ELeft || m_direction == ERight) 
-                ++m_numSteps;
-            m_stepsLeft = m_numSteps;
+        switch (direction) {
+            case ERight: ++block.x(); break;
+            case EDown:  ++block.y(); break;
+            case ELeft:  --block.x(); break;
+            case EUp:    --block.y(); break;
         }
-    } while ((m_block.array() < 0).any() ||
-             (m_block.array() >= m_numBlocks.array()).any());
 
+        if (--stepsLeft == 0) {
+            direction = (direction + 1) % 4;
+            if (direction == ELeft || direction == ERight)
+                ++numSteps;
+            stepsLeft = numSteps;
+        }
+    }
+}
+
+void BlockGenerator::reset() {
+    m_nextBlock = 0;
+    for (int i = 0; i < m_workerCount; ++i) {
+        m_workers[i].work = pack(NoBlock, 0, 0);
+        m_workers[i].rowTime = 0.f;
+    }
+}
+
+bool BlockGenerator::next(int worker, ImageBlock &block) {
+    Worker &self = m_workers[worker];
+    uint32_t index = m_nextBlock.fetch_add(1);
+    uint32_t first = 0, end;
+
+    if (index < m_blocks.size()) {
+        Point2i pos = m_blocks[index] * m_blockSize;
+        end = (uint32_t) std::min(m_blockSize, m_size.y() - pos.y());
+    } else {
+        /* All blocks are claimed: take over the second half of the rows
+           of the block with the most remaining work. Blocks with a
+           single row left will be done by their owners soon enough */
+        while (true) {
+            int victim = -1;
+            uint64_t victimWork = 0;
+            float maxRemaining = 0.f;
+            for (int i = 0; i < m_workerCount; ++i) {
+                if (i == worker)
+                    continue;
+                uint64_t work = m_workers[i].work.load();
+                uint32_t next = (work >> 16) & 0xFFFF, last = work & 0xFFFF;
+                if ((work >> 32) == NoBlock || last < next + 2)
+                    continue;
+                /* A worker that has not finished a row of its block yet is
+                   probably busy with an expensive one */
+                float rowTime = m_workers[i].rowTime.load(std::memory_order_relaxed);
+                float remaining = (last - next) * (rowTime > 0.f ? rowTime : 1.f);
+                if (remaining > maxRemaining) {
+                    maxRemaining = remaining;
+                    victim = i;
+                    victimWork = work;
+                }
+            }
+
+            if (victim < 0) {
+                self.work.store(pack(NoBlock, 0, 0));
+                return false;
+            }
+
+            uint32_t next = (victimWork >> 16) & 0xFFFF, last = victimWork & 0xFFFF;
+            uint32_t mid = next + (last - next) / 2;
+            index = (uint32_t) (victimWork >> 32);
+            if (m_workers[victim].work.compare_exchange_strong(victimWork, pack(index, next, mid))) {
+                first = mid;
+                end = last;
+                m_splits++;
+                break;
+            }
+            /* The victim claimed a row or was split by another thief, try again */
+        }
+    }
+
+    Point2i pos = m_blocks[index] * m_blockSize;
+    block.setOffset(Point2i(pos.x(), pos.y() + (int) first));
+    block.setSize(Vector2i(std::min(m_blockSize, m_size.x() - pos.x()), (int) (end - first)));
+    self.rowTime.store(0.f, std::memory_order_relaxed);
+    self.work.store(pack(index, first, end));
     return true;
 }
 
+bool BlockGenerator::nextRow(int worker, int &row, float rowTime) {
+    Worker &self = m_workers[worker];
+    if (rowTime > 0.f)
+        self.rowTime.store(rowTime, std::memory_order_relaxed);
+
+    uint64_t work = self.work.load();
+    while (true) {
+        uint32_t index = (uint32_t) (work >> 32), next = (work >> 16) & 0xFFFF, last = work & 0xFFFF;
+        if (index == NoBlock || next >= last)
+            return false;
+        if (self.work.compare_exchange_weak(work, pack(index, next + 1, last))) {
+            row = m_blocks[index].y() * m_blockSize + (int) next;
+            return true;
+        }
+    }
+}
+
 NORI_NAMESPACE_END
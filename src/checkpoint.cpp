@@ -0,0 +1,142 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/checkpoint.h>
+#include <nori/bitmap.h>
+#include <cstdio>
+
+/* ===================================================================
+    Checkpoint format: a fixed header followed by the raw contents of
+    the image block (Color4f, border included), the mean, M2 and sample
+    count arrays of the pixel statistics and, if present, the heatmap
+    (Color3f). All in the byte order of the machine that wrote them,
+    since checkpoints are only meant to be resumed where they were made.
+ * =================================================================== */
+
+NORI_NAMESPACE_BEGIN
+
+/// Increment whenever the file layout changes
+static const uint32_t CheckpointVersion = 1;
+
+enum CheckpointFlags {
+    EAdaptive = 1,
+    EHasHeatmap = 2
+};
+
+struct CheckpointHeader {
+    char magic[8];             ///< "NORICKP"
+    uint32_t version;          ///< \ref CheckpointVersion
+    uint32_t flags;            ///< Combination of \ref CheckpointFlags
+    int32_t width, height;     ///< Size of the image
+    int32_t borderSize;        ///< Border of the image block
+    int32_t passSampleCount;   ///< Samples per pixel of a pass
+    int32_t pass;              ///< Number of completed passes
+    int32_t padding;
+    uint64_t samples;          ///< Number of samples taken
+    double elapsed;            ///< Time spent rendering (seconds)
+};
+
+void saveCheckpoint(const std::string &filename, const Checkpoint &checkpoint,
+                    const ImageBlock &image, const PixelStatistics &stats,
+                    const Bitmap *heatmap) {
+    CheckpointHeader header;
+    memset(&header, 0, sizeof(CheckpointHeader));
+    memcpy(header.magic, "NORICKP", 8);
+    header.version = CheckpointVersion;
+    header.flags = (checkpoint.adaptive ? EAdaptive : 0) | (heatmap ? EHasHeatmap : 0);
+    header.width = checkpoint.size.x();
+    header.height = checkpoint.size.y();
+    header.borderSize = image.getBorderSize();
+    header.passSampleCount = checkpoint.passSampleCount;
+    header.pass = checkpoint.pass;
+    header.samples = checkpoint.samples;
+    header.elapsed = checkpoint.elapsed;
+
+    std::string tempName = filename + ".tmp";
+    FILE *file = fopen(tempName.c_str(), "wb");
+    if (!file)
+        throw NoriException("Unable to write the checkpoint \"%s\"!", tempName);
+
+    bool success = fwrite(&header, sizeof(CheckpointHeader), 1, file) == 1;
+    success = success && fwrite(image.data(), sizeof(Color4f), (size_t) image.size(), file) == (size_t) image.size();
+    success = success && stats.write(file);
+    if (heatmap)
+        success = success && fwrite(heatmap->data(), sizeof(Color3f), (size_t) heatmap->size(), file) == (size_t) heatmap->size();
+    success = (fclose(file) == 0) && success;
+
+    /* Replace the previous checkpoint only once the new one is complete */
+    if (success && std::rename(tempName.c_str(), filename.c_str()) != 0) {
+        std::remove(filename.c_str());
+        success = std::rename(tempName.c_str(), filename.c_str()) == 0;
+    }
+    if (!success) {
+        std::remove(tempName.c_str());
+        throw NoriException("Unable to write the checkpoint \"%s\"!", filename);
+    }
+}
+
+bool loadCheckpoint(const std::string &filename, Checkpoint &checkpoint,
+                    ImageBlock &image, PixelStatistics &stats, Bitmap *heatmap) {
+    FILE *file = fopen(filename.c_str(), "rb");
+    if (!file)
+        return false;
+
+    CheckpointHeader header;
+    if (fread(&header, sizeof(CheckpointHeader), 1, file) != 1 ||
+        memcmp(header.magic, "NORICKP", 8) != 0) {
+        fclose(file);
+        throw NoriException("\"%s\" is not a checkpoint!", filename);
+    }
+    if (header.version != CheckpointVersion) {
+        fclose(file);
+        throw NoriException("The checkpoint \"%s\" has an unsupported version (%i)!",
+                            filename, header.version);
+    }
+
+    /* Continuing with other settings would not give the same image */
+    std::string mismatch;
+    if (header.width != checkpoint.size.x() || header.height != checkpoint.size.y())
+        mismatch = tfm::format("an image size of %ix%i", header.width, header.height);
+    else if (header.borderSize != image.getBorderSize())
+        mismatch = "a different reconstruction filter";
+    else if (header.passSampleCount != checkpoint.passSampleCount)
+        mismatch = tfm::format("passes of %i spp", header.passSampleCount);
+    else if (((header.flags & EAdaptive) != 0) != checkpoint.adaptive)
+        mismatch = (header.flags & EAdaptive) ? "adaptive sampling" : "no adaptive sampling";
+    else if (((header.flags & EHasHeatmap) != 0) != (heatmap != nullptr))
+        mismatch = (header.flags & EHasHeatmap) ? "a heatmap" : "no heatmap";
+    if (!mismatch.empty()) {
+        fclose(file);
+        throw NoriException("The checkpoint \"%s\" was made with %s!", filename, mismatch);
+    }
+
+    bool success = fread(image.data(), sizeof(Color4f), (size_t) image.size(), file) == (size_t) image.size();
+    success = success && stats.read(file);
+    if (heatmap)
+        success = success && fread(heatmap->data(), sizeof(Color3f), (size_t) heatmap->size(), file) == (size_t) heatmap->size();
+    fclose(file);
+    if (!success)
+        throw NoriException("The checkpoint \"%s\" is truncated!", filename);
+
+    checkpoint.pass = header.pass;
+    checkpoint.samples = header.samples;
+    checkpoint.elapsed = header.elapsed;
+    return true;
+}
+
+NORI_NAMESPACE_END
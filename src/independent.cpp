@@ -52,6 +52,11 @@ public:
         );
     }
 
+    void prepareRow(const Point2i &offset, int pass) {
+        /* Every pass uses a separate stream of the generator */
+        m_random.seed(offset.x(), offset.y() + ((uint64_t) pass << 32));
+    }
+
     void generate() { /* No-op for this sampler */ }
     void advance()  { /* No-op for this sampler */ }
 
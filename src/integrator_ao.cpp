@@ -38,7 +38,7 @@ public:
         // unit(local) to world(global)
         Vector3f point_global_hemisphere = frame.toWorld(point_unit_hemisphere);
 
-        Ray3f shadowRay = Ray3f(its.p + Epsilon * its.shFrame.n, point_global_hemisphere);
+        Ray3f shadowRay = its.spawnRay(point_global_hemisphere);
 
         if (!scene->rayIntersect(shadowRay))
         {
@@ -76,7 +76,7 @@ public:
             n - 1);
         const Mesh* mesh = meshes[index[indexRandom]];
         const Emitter* light = mesh->getEmitter();
-        EmitterQueryRecord eqr(its.p);
+        EmitterQueryRecord eqr(its.p, its.geoFrame.n, its.pError, its.time);
 
         Color3f Li = light->sample(mesh, eqr, sampler);
         if (scene->rayIntersect(eqr.shadowRay))
@@ -88,7 +88,7 @@ public:
 
         bqr.uv = its.uv;
 
-        Color3f fr = its.mesh->getBSDF()->eval(bqr);
+        Color3f fr = its.bsdf->eval(bqr);
 
         value += Li * fr / (1.0f / n);
 
@@ -116,7 +116,7 @@ public:
         Color3f value(0.f);
         
         Frame frame = its.shFrame;
-        const BSDF* bsdf = its.mesh->getBSDF();
+        const BSDF* bsdf = its.bsdf;
         Point2f point_2d_square = sampler->next2D();
         Vector3f point_unit_hemisphere;
         
@@ -125,7 +125,7 @@ public:
             point_unit_hemisphere = Warp::squareToCosineHemisphere(point_2d_square);
             Vector3f point_global_hemisphere = frame.toWorld(point_unit_hemisphere);
 
-            Ray3f pathRay = Ray3f(its.p + Epsilon * its.shFrame.n, point_global_hemisphere);
+            Ray3f pathRay = its.spawnRay(point_global_hemisphere);
 
             Intersection its2;
 
@@ -143,7 +143,7 @@ public:
             point_unit_hemisphere = Warp::squareToUniformHemisphere(point_2d_square);
             Vector3f point_global_hemisphere = frame.toWorld(point_unit_hemisphere);
 
-            Ray3f pathRay = Ray3f(its.p + Epsilon * its.shFrame.n, point_global_hemisphere);
+            Ray3f pathRay = its.spawnRay(point_global_hemisphere);
 
             Intersection its2;
 
@@ -8,11 +8,19 @@ class IntersectionsIntegrator : public Integrator {
 private:
 
 	unsigned int m_maxTests;
+	bool m_nodeVisits;
 
 public:
 	IntersectionsIntegrator(const PropertyList& props) {
 		/* No parameters this time */
 		m_maxTests = props.getInteger("maxTests");
+
+		/* Visualize either the ray-triangle tests ("triangles")
+		   or the visited BVH nodes ("nodes") of every ray */
+		std::string metric = props.getString("metric", "triangles");
+		if (metric != "triangles" && metric != "nodes")
+			throw NoriException("IntersectionsIntegrator: unknown metric \"%s\"!", metric);
+		m_nodeVisits = metric == "nodes";
 	}
 
 	Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& ray) const {
@@ -21,7 +29,8 @@ public:
 		if (!scene->rayIntersect(ray, its))
 			return Color3f(0.0f);
 
-		float intensity = its.attempts / ((float)m_maxTests);
+		unsigned int count = m_nodeVisits ? its.nodeVisits : its.attempts;
+		float intensity = count / ((float)m_maxTests);
 		/* Return the component-wise absolute
 		   value of the shading normal as a color */
 		return Color3f(intensity, 0, std::max(0.f, 1.0f - intensity));
@@ -31,7 +40,8 @@ public:
         return tfm::format(
                 "IntersectionsIntegrator[\n"
 				"maxTests = %d\n"
-				"]", m_maxTests);
+				"metric = %s\n"
+				"]", m_maxTests, m_nodeVisits ? "nodes" : "triangles");
 	}
 };
 
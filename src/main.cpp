@@ -19,17 +19,25 @@
 #include <nori/parser.h>
 #include <nori/scene.h>
 #include <nori/camera.h>
+#include <nori/rfilter.h>
 #include <nori/block.h>
+#include <nori/checkpoint.h>
 #include <nori/timer.h>
 #include <nori/bitmap.h>
 #include <nori/sampler.h>
 #include <nori/integrator.h>
 #include <nori/gui.h>
+#include <nori/stats.h>
+#include <nori/mesh.h>
 #include <tbb/parallel_for.h>
 #include <tbb/blocked_range.h>
 #include <tbb/task_scheduler_init.h>
+#include <tbb/enumerable_thread_specific.h>
 #include <filesystem/resolver.h>
 #include <thread>
+#include <atomic>
+#include <mutex>
+#include <pcg32.h>
 #include <nori/warp.h>
 
 
@@ -39,40 +47,79 @@ using namespace nori;
 
 static int threadCount = -1;
 static bool gui = true;
-
-static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block)
+static bool benchmarkOnly = false;
+static bool benchmarkMergeOnly = false;
+static bool writeHeatmap = false;
+static bool compressMesh = false;
+static int passSampleCount = 0;    /* Samples per pixel of a progressive pass (0: one pass) */
+static int targetSampleCount = 0;  /* Overrides the sample count of the scene */
+static double timeBudget = 0;      /* Seconds after which progressive rendering stops */
+static float targetNoise = 0;      /* Relative error at which progressive rendering stops */
+static bool adaptiveSampling = false;
+static double checkpointInterval = 0;  /* Seconds between checkpoints of progressive rendering */
+static bool resumeRender = false;
+
+/**
+ * Render row \c y (relative to the offset) of a block with \c sampleCount
+ * samples per pixel. If \c heatmap is given, the traversal cost of every
+ * pixel (node visits, triangle tests and rays) is added to its RGB channels.
+ * Progressive rendering passes the number of the pass and the statistics
+ * of the pixels, records the samples in them and weights the pixels by
+ * their sample count. A \c sampleCount of zero takes the sample counts
+ * that adaptive sampling distributed (see \ref PixelStatistics::allocate())
+ */
+static void renderRow(const Scene *scene, Sampler *sampler, ImageBlock &block, int y,
+                      size_t sampleCount, int pass, PixelStatistics *pixelStats, Bitmap *heatmap)
 {
     const Camera *camera = scene->getCamera();
     const Integrator *integrator = scene->getIntegrator();
     // PropertyList pl{};
     // PathTracerRecursive integrator{pl};
 
-    size_t N = sampler->getSampleCount();
-    
     Point2i offset = block.getOffset();
     Vector2i size  = block.getSize();
 
-    /* Clear the block contents */
-    block.clear();
+    RayStatistics &stats = RayStatistics::local();
 
+    /* The samples of a row don't depend on the rest of the block */
+    sampler->prepareRow(Point2i(offset.x(), offset.y() + y), pass);
 
-    /* For each pixel and pixel sample sample */
-    for (int y=0; y<size.y(); ++y)
+    /* For each pixel of the row */
+    for (int x=0; x<size.x(); ++x)
     {
-        for (int x=0; x<size.x(); ++x)
+        Point2i pixel(x + offset.x(), y + offset.y());
+        size_t N = sampleCount > 0 ? sampleCount : pixelStats->getPassSampleCount(pixel);
+        if (N == 0)
+            continue;
+
+        RayStatistics before = stats;
+        Ray3f ray{};
+        Color3f color{0.f};
+        Point2f pixelSample = Point2f(float(x + offset.x()), float(y + offset.y())) + sampler->next2D();  // go through the centre of the pixel
+        for (size_t i=0; i<N; ++i) // N = Target sample count per pixel
         {
-            Ray3f ray{};
-            Color3f color{0.f};
-            Point2f pixelSample = Point2f(float(x + offset.x()), float(y + offset.y())) + sampler->next2D();  // go through the centre of the pixel
-            for (size_t i=0; i<N; ++i) // N = Target sample count per pixel
-            {
-                pixelSample.x() = std::min(pixelSample.x(), std::nextafter(float(x + offset.x() + 1), 0.f));
-                pixelSample.y() = std::min(pixelSample.y(), std::nextafter(float(y + offset.y() + 1), 0.f));
-                Point2f apertureSample = sampler->next2D();
-                camera->sampleRay(ray, pixelSample, apertureSample);
-                color += integrator->Li(scene, sampler, ray);
-            }
-            block.put(pixelSample, color / N);
+            pixelSample.x() = std::min(pixelSample.x(), std::nextafter(float(x + offset.x() + 1), 0.f));
+            pixelSample.y() = std::min(pixelSample.y(), std::nextafter(float(y + offset.y() + 1), 0.f));
+            Point2f apertureSample = sampler->next2D();
+            /* Static cameras leave the sample sequence as it was */
+            float timeSample = camera->hasMotionBlur() ? sampler->next1D() : 0.f;
+            camera->sampleRay(ray, pixelSample, apertureSample, timeSample);
+            Color3f value = integrator->Li(scene, sampler, ray);
+            color += value;
+            if (pixelStats && value.isValid())
+                pixelStats->put(pixel, value.getLuminance());
+        }
+        Color3f estimate = color / N;
+        if (pixelStats)
+            block.put(pixelSample, estimate, (float) N);
+        else
+            block.put(pixelSample, estimate);
+        stats.paths += N;
+
+        if (heatmap) {
+            RayStatistics cost = stats - before;
+            (*heatmap)(y + offset.y(), x + offset.x()) +=
+                Color3f((float) cost.nodeVisits, (float) cost.triangleTests, (float) cost.rays());
         }
     }
 }
@@ -82,13 +129,69 @@ static void render(Scene *scene, const std::string &filename) {
     Vector2i outputSize = camera->getOutputSize();
     scene->getIntegrator()->preprocess(scene);
 
-    /* Create a block generator (i.e. a work scheduler) */
-    BlockGenerator blockGenerator(outputSize, NORI_BLOCK_SIZE);
+    /* Create a block generator (i.e. a work scheduler) for one worker per thread */
+    int workerCount = threadCount > 0 ? threadCount : tbb::task_scheduler_init::default_num_threads();
+    BlockGenerator blockGenerator(outputSize, NORI_BLOCK_SIZE, workerCount);
 
     /* Allocate memory for the entire output image and clear it */
     ImageBlock result(outputSize, camera->getReconstructionFilter());
     result.clear();
 
+    /* Filters with a border add the rows of each pass in a fixed order,
+       so that the image doesn't depend on the schedule */
+    std::unique_ptr<RowAccumulator> rowAccumulator;
+    if (result.getBorderSize() > 0)
+        rowAccumulator.reset(new RowAccumulator(outputSize, NORI_BLOCK_SIZE, result.getBorderSize()));
+
+    /* Optional per-pixel cost of the render, and the time taken by each block */
+    std::unique_ptr<Bitmap> heatmap;
+    if (writeHeatmap) {
+        heatmap.reset(new Bitmap(outputSize));
+        heatmap->setConstant(Color3f(0.f));
+    }
+    struct BlockTime {
+        Point2i offset;
+        double time;
+    };
+    std::vector<BlockTime> blockTimes;
+    std::mutex blockTimesMutex;
+
+    /* Progressive rendering: passes of a few samples per pixel, until the
+       target sample count, the time budget or the target noise is reached.
+       Adaptive sampling spends the samples of a pass on the pixels with the
+       highest error instead, and then targets the average sample count */
+    bool progressive = passSampleCount > 0;
+    int targetSpp = targetSampleCount > 0 ? targetSampleCount : (int) scene->getSampler()->getSampleCount();
+    uint64_t pixelCount = (uint64_t) outputSize.prod();
+    uint64_t budget = pixelCount * targetSpp, spent = 0, passSamples = 0;
+    int pass = 0, passSpp = 0;
+    std::unique_ptr<PixelStatistics> pixelStats;
+    if (progressive)
+        pixelStats.reset(new PixelStatistics(outputSize));
+
+    /* Determine the filename of the output bitmap */
+    std::string outputName = filename;
+    size_t lastdot = outputName.find_last_of(".");
+    if (lastdot != std::string::npos)
+        outputName.erase(lastdot, std::string::npos);
+
+    /* Continue an interrupted render, which must use the same settings */
+    std::string checkpointName = outputName + ".checkpoint";
+    Checkpoint checkpoint;
+    checkpoint.size = outputSize;
+    checkpoint.passSampleCount = passSampleCount;
+    checkpoint.adaptive = adaptiveSampling;
+    if (resumeRender) {
+        if (loadCheckpoint(checkpointName, checkpoint, result, *pixelStats, heatmap.get())) {
+            pass = checkpoint.pass;
+            spent = checkpoint.samples;
+            cout << tfm::format("Resuming \"%s\" after pass %i (%.4g spp, %s)", checkpointName, pass,
+                                (double) spent / pixelCount, timeString(checkpoint.elapsed * 1000)) << endl;
+        } else {
+            cout << "No checkpoint \"" << checkpointName << "\" found, starting from scratch" << endl;
+        }
+    }
+
     /* Create a window that visualizes the partially rendered result */
     NoriScreen *screen = nullptr;
     if (gui) {
@@ -100,47 +203,189 @@ static void render(Scene *scene, const std::string &filename) {
     std::thread render_thread([&] {
         tbb::task_scheduler_init init(threadCount);
 
-        cout << "Rendering .. ";
+        if (progressive)
+            cout << "Rendering " << (adaptiveSampling ? "adaptively " : "") << "in passes of "
+                 << passSampleCount << " spp .." << endl;
+        else
+            cout << "Rendering .. ";
         cout.flush();
         auto before = std::chrono::system_clock::now();
         Timer timer;
+        RayStatistics::reset();
 
-        tbb::blocked_range<int> range(0, blockGenerator.getBlockCount());
+        tbb::blocked_range<int> range(0, workerCount, 1);
 
         auto map = [&](const tbb::blocked_range<int> &range) {
             /* Allocate memory for a small image block to be rendered
-               by the current thread */
+               by the current worker */
             ImageBlock block(Vector2i(NORI_BLOCK_SIZE),
                 camera->getReconstructionFilter());
+            ImageBlock row(Vector2i(NORI_BLOCK_SIZE, 1),
+                camera->getReconstructionFilter());
 
-            /* Create a clone of the sampler for the current thread */
+            /* Create a clone of the sampler for the current worker */
             std::unique_ptr<Sampler> sampler(scene->getSampler()->clone());
 
-            for (int i=range.begin(); i<range.end(); ++i) {
-                /* Request an image block from the block generator */
-                blockGenerator.next(block);
-
-                /* Inform the sampler about the block to be rendered */
-                sampler->prepare(block);
-
-                /* Render all contained pixels */
-                renderBlock(scene, sampler.get(), block);
-
-                /* The image block has been processed. Now add it to
-                   the "big" block that represents the entire image */
-                result.put(block);
+            for (int worker=range.begin(); worker<range.end(); ++worker) {
+                /* Request image blocks (or parts of them) until the image is done */
+                while (blockGenerator.next(worker, block)) {
+                    /* Inform the sampler about the block to be rendered */
+                    sampler->prepare(block);
+                    block.clear();
+
+                    /* Render the rows of the block, unless other workers take them over */
+                    auto blockStart = std::chrono::steady_clock::now();
+                    int y, rows = 0;
+                    float rowTime = 0.f;
+                    while (blockGenerator.nextRow(worker, y, rowTime)) {
+                        auto rowStart = std::chrono::steady_clock::now();
+                        if (rowAccumulator) {
+                            row.setOffset(Point2i(block.getOffset().x(), y));
+                            row.setSize(Point2i(block.getSize().x(), 1));
+                            row.clear();
+                            renderRow(scene, sampler.get(), row, 0,
+                                      (size_t) passSpp, pass, pixelStats.get(), heatmap.get());
+                            rowAccumulator->put(row);
+                        } else {
+                            renderRow(scene, sampler.get(), block, y - block.getOffset().y(),
+                                      (size_t) passSpp, pass, pixelStats.get(), heatmap.get());
+                        }
+                        rowTime = std::chrono::duration<float>(std::chrono::steady_clock::now() - rowStart).count();
+                        rows = y - block.getOffset().y() + 1;
+                    }
+                    block.setSize(Vector2i(block.getSize().x(), rows));
+                    double blockTime = std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - blockStart).count();
+                    {
+                        std::lock_guard<std::mutex> lock(blockTimesMutex);
+                        blockTimes.push_back(BlockTime { block.getOffset(), blockTime });
+                    }
+
+                    /* The image block has been processed. Now add it to
+                       the "big" block that represents the entire image */
+                    if (!rowAccumulator)
+                        result.merge(block);
+                }
             }
         };
 
-        /// Default: parallel rendering
-        tbb::parallel_for(range, map);
+        std::string stopReason = "sample count";
+        float noise = 0.f;
+        auto lastCheckpoint = before;
+        double previousElapsed = checkpoint.elapsed;
+        while (spent < budget) {
+            uint64_t passBudget = progressive ? std::min(pixelCount * passSampleCount, budget - spent) : budget;
+            /* The first quarter of the budget is spent uniformly, so that the
+               error estimates of all pixels have seen some of the rare paths */
+            if (adaptiveSampling && spent >= budget / 4) {
+                /* Pixels receive at most 8 passes worth of samples at once,
+                   so that a few fireflies don't take the whole pass */
+                passSpp = 0;
+                passSamples = pixelStats->allocate(passBudget, 8 * passSampleCount);
+            } else {
+                passSpp = (int) (passBudget / pixelCount);
+                passSamples = passSpp * pixelCount;
+            }
+            if (passSamples == 0)
+                break;
+            blockGenerator.reset();
+            auto passStart = std::chrono::system_clock::now();
+
+            /// Default: parallel rendering, one task per worker
+            tbb::parallel_for(range, map, tbb::simple_partitioner());
+
+            /// (equivalent to the following single-threaded call)
+            // map(range);
+
+            if (rowAccumulator)
+                rowAccumulator->addTo(result);
+
+            spent += passSamples;
+            ++pass;
+            if (!progressive)
+                break;
+
+            /* Report the pass and show the refined image */
+            auto now = std::chrono::system_clock::now();
+            double passTime = std::chrono::duration<double>(now - passStart).count();
+            double elapsed = previousElapsed + std::chrono::duration<double>(now - before).count();
+            noise = pixelStats->getNoise();
+            cout << tfm::format("Pass %i: %.4g spp, took %s, noise %s", pass, (double) spent / pixelCount,
+                                timeString(passTime * 1000),
+                                std::isinf(noise) ? std::string("unknown") : tfm::format("%.4f", noise)) << endl;
+            if (screen)
+                screen->redraw();
+
+            if (spent >= budget)
+                break;
+
+            /* Few passes miss the rare bright paths and underestimate the
+               noise, so the target is only checked from the 4th pass on */
+            if (targetNoise > 0 && pass >= 4 && noise <= targetNoise) {
+                stopReason = "noise target";
+                break;
+            }
+            /* Don't start a pass that would likely exceed the time budget */
+            uint64_t nextBudget = std::min(pixelCount * passSampleCount, budget - spent);
+            if (timeBudget > 0 && elapsed + passTime * nextBudget / passSamples > timeBudget) {
+                stopReason = "time budget";
+                break;
+            }
 
-        /// (equivalent to the following single-threaded call)
-        // map(range);
+            /* Save the state of the render every once in a while */
+            if (checkpointInterval > 0 &&
+                std::chrono::duration<double>(now - lastCheckpoint).count() >= checkpointInterval) {
+                checkpoint.pass = pass;
+                checkpoint.samples = spent;
+                checkpoint.elapsed = elapsed;
+                try {
+                    saveCheckpoint(checkpointName, checkpoint, result, *pixelStats, heatmap.get());
+                } catch (const std::exception &e) {
+                    cerr << "Warning: " << e.what() << endl;
+                }
+                lastCheckpoint = std::chrono::system_clock::now();
+            }
+        }
 
         cout << "done. (took " << timer.elapsedString() << ")" << endl;
         auto after = std::chrono::system_clock::now();
+        std::cout << "# benchmark # Blocks: " << blockGenerator.getBlockCount() << " blocks, "
+                  << blockGenerator.getSplitCount() << " splits, " << workerCount << " workers" << std::endl;
         std::cout << "# benchmark # Rendering took: " << std::chrono::duration<double>(after - before).count() << " s" << std::endl;
+        if (progressive)
+            std::cout << "# benchmark # Progressive rendering: " << pass << " passes, "
+                      << (double) spent / pixelCount << " spp, noise " << noise
+                      << ", stopped by the " << stopReason << std::endl;
+        if (adaptiveSampling)
+            std::cout << "# benchmark # Samples per pixel: " << pixelStats->getSampleHistogram() << std::endl;
+
+        /* Summarize the ray tracing work and list the most expensive blocks */
+        RayStatistics stats = RayStatistics::total();
+        double seconds = std::chrono::duration<double>(after - before).count();
+        cout << stats.toString() << endl;
+        std::cout << "# benchmark # Ray statistics: " << stats.rays() << " rays ("
+                  << stats.rays() / seconds * 1e-6 << " Mrays/s), "
+                  << (stats.rays() > 0 ? (double) stats.nodeVisits / stats.rays() : 0.0) << " node visits and "
+                  << (stats.rays() > 0 ? (double) stats.triangleTests / stats.rays() : 0.0) << " triangle tests per ray, "
+                  << (stats.paths > 0 ? (double) stats.radianceRays / stats.paths : 0.0) << " average path depth"
+                  << std::endl;
+        if (scene->getAccel()->getLazyMeshCount() > 0)
+            std::cout << "# benchmark # Lazy meshes: " << stats.pageIns << " page-ins, "
+                      << stats.evictions << " evictions" << std::endl;
+
+        double totalBlockTime = 0;
+        for (const BlockTime &b : blockTimes)
+            totalBlockTime += b.time;
+        size_t count = std::min(blockTimes.size(), (size_t) 5);
+        std::partial_sort(blockTimes.begin(), blockTimes.begin() + count, blockTimes.end(),
+            [](const BlockTime &a, const BlockTime &b) { return a.time > b.time; });
+        cout << "Most expensive blocks:";
+        for (size_t i = 0; i < count; ++i)
+            cout << tfm::format(" [%i, %i] %s (%.1f%%)%s", blockTimes[i].offset.x(), blockTimes[i].offset.y(),
+                                timeString(blockTimes[i].time * 1000, true),
+                                totalBlockTime > 0 ? 100 * blockTimes[i].time / totalBlockTime : 0.0,
+                                i + 1 < count ? "," : "");
+        cout << endl;
     });
 
     /* Enter the application main loop */
@@ -157,30 +402,293 @@ static void render(Scene *scene, const std::string &filename) {
 
     /* Now turn the rendered image block into
        a properly normalized bitmap */
-    std::unique_ptr<Bitmap> bitmap(result.toBitmap());
-
-    /* Determine the filename of the output bitmap */
-    std::string outputName = filename;
-    size_t lastdot = outputName.find_last_of(".");
-    if (lastdot != std::string::npos)
-        outputName.erase(lastdot, std::string::npos);
+    std::unique_ptr<Bitmap> bitmap(result.toBitmap(progressive));
 
     /* Save using the OpenEXR format */
     bitmap->saveEXR(outputName);
 
     /* Save tonemapped (sRGB) output using the PNG format */
     bitmap->savePNG(outputName);
+
+    /* Save the traversal cost of every pixel (per sample) */
+    if (heatmap) {
+        if (adaptiveSampling) {
+            for (int y = 0; y < outputSize.y(); ++y)
+                for (int x = 0; x < outputSize.x(); ++x)
+                    (*heatmap)(y, x) /= (float) std::max(pixelStats->getSampleCount(Point2i(x, y)), 1u);
+        } else {
+            *heatmap /= (float) (spent / pixelCount);
+        }
+        heatmap->saveEXR(outputName + "_cost");
+    }
+
+    /* The render is complete, so its checkpoint is no longer needed */
+    if (checkpointInterval > 0 || resumeRender)
+        std::remove(checkpointName.c_str());
+}
+
+/**
+ * Measure the raw ray tracing throughput of a scene: trace several jittered
+ * primary rays per pixel and one cosine-weighted bounce for every hit (as a
+ * source of incoherent rays), without any shading
+ */
+static void benchmark(Scene *scene) {
+    const Camera *camera = scene->getCamera();
+    Vector2i outputSize = camera->getOutputSize();
+    const int raysPerPixel = 8;
+    std::atomic<uint64_t> rayCount(0);
+
+    tbb::task_scheduler_init init(threadCount);
+
+    cout << "Tracing rays .. ";
+    cout.flush();
+    auto before = std::chrono::system_clock::now();
+    Timer timer;
+
+    tbb::parallel_for(tbb::blocked_range<int>(0, outputSize.y()),
+        [&](const tbb::blocked_range<int> &range) {
+            uint64_t count = 0;
+            for (int y = range.begin(); y < range.end(); ++y) {
+                pcg32 random;
+                random.seed((uint64_t) y);
+                for (int x = 0; x < outputSize.x(); ++x) {
+                    for (int i = 0; i < raysPerPixel; ++i) {
+                        Ray3f ray;
+                        Point2f pixelSample(x + random.nextFloat(), y + random.nextFloat());
+                        Point2f apertureSample(random.nextFloat(), random.nextFloat());
+                        float timeSample = camera->hasMotionBlur() ? random.nextFloat() : 0.f;
+                        camera->sampleRay(ray, pixelSample, apertureSample, timeSample);
+
+                        Intersection its;
+                        count++;
+                        if (!scene->rayIntersect(ray, its))
+                            continue;
+
+                        Vector3f d = Warp::squareToCosineHemisphere(
+                            Point2f(random.nextFloat(), random.nextFloat()));
+                        scene->rayIntersect(its.spawnRay(its.shFrame.toWorld(d)));
+                        count++;
+                    }
+                }
+            }
+            rayCount += count;
+        }
+    );
+
+    auto after = std::chrono::system_clock::now();
+    double seconds = std::chrono::duration<double>(after - before).count();
+    cout << "done. (took " << timer.elapsedString() << ")" << endl;
+    std::cout << "# benchmark # Tracing " << rayCount << " rays took: " << seconds
+              << " s (" << rayCount / seconds * 1e-6 << " Mrays/s)" << std::endl;
+}
+
+/**
+ * Trace the primary rays of every row (one per pixel) in packets of
+ * neighboring pixels and their cosine-weighted bounces as a stream (see
+ * \ref Scene::rayIntersect(const RayPacket &, Intersection *)), and once
+ * more one by one. Reports the throughput of both, and the rays whose hit
+ * or distance differ between them
+ */
+static void benchmarkPackets(Scene *scene) {
+    const Camera *camera = scene->getCamera();
+    Vector2i outputSize = camera->getOutputSize();
+    std::atomic<uint64_t> rayCount(0), mismatches(0);
+    /* Time spent in either kind of query, summed over all threads */
+    std::atomic<uint64_t> nanoseconds[2];
+    nanoseconds[0] = nanoseconds[1] = 0;
+
+    tbb::task_scheduler_init init(threadCount);
+
+    cout << "Tracing ray packets .. ";
+    cout.flush();
+    Timer timer;
+
+    tbb::parallel_for(tbb::blocked_range<int>(0, outputSize.y()),
+        [&](const tbb::blocked_range<int> &range) {
+            std::vector<Ray3f> rays(outputSize.x()), bounces;
+            std::vector<Intersection> its(outputSize.x()), packetIts(outputSize.x());
+            std::vector<bool> hit(outputSize.x());
+            std::unique_ptr<bool[]> streamHit(new bool[outputSize.x()]);
+            uint64_t count = 0, wrong = 0, spent[2] = { 0, 0 };
+
+            auto differ = [](bool hit1, const Intersection &its1, bool hit2, const Intersection &its2) {
+                return hit1 != hit2 || (hit1 && std::abs(its1.t - its2.t) > 1e-4f * std::max(1.f, its1.t));
+            };
+            auto elapsed = [](std::chrono::steady_clock::time_point before) {
+                return (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - before).count();
+            };
+
+            for (int y = range.begin(); y < range.end(); ++y) {
+                pcg32 random;
+                random.seed((uint64_t) y);
+                for (int x = 0; x < outputSize.x(); ++x) {
+                    Point2f pixelSample(x + random.nextFloat(), y + random.nextFloat());
+                    Point2f apertureSample(random.nextFloat(), random.nextFloat());
+                    float timeSample = camera->hasMotionBlur() ? random.nextFloat() : 0.f;
+                    camera->sampleRay(rays[x], pixelSample, apertureSample, timeSample);
+                }
+
+                /* Primary rays */
+                auto before = std::chrono::steady_clock::now();
+                for (int x = 0; x < outputSize.x(); ++x)
+                    hit[x] = scene->rayIntersect(rays[x], its[x]);
+                spent[0] += elapsed(before);
+
+                before = std::chrono::steady_clock::now();
+                RayPacket packet;
+                for (int x = 0; x < outputSize.x(); x += RayPacket::MaxSize) {
+                    packet.clear();
+                    for (int i = x; i < std::min(x + (int) RayPacket::MaxSize, outputSize.x()); ++i)
+                        packet.append(rays[i]);
+                    uint32_t mask = scene->rayIntersect(packet, &packetIts[x]);
+                    for (uint32_t i = 0; i < packet.size; ++i)
+                        streamHit[x + i] = (mask >> i) & 1;
+                }
+                spent[1] += elapsed(before);
+
+                bounces.clear();
+                for (int x = 0; x < outputSize.x(); ++x) {
+                    wrong += differ(hit[x], its[x], streamHit[x], packetIts[x]);
+                    if (!hit[x])
+                        continue;
+                    Vector3f d = Warp::squareToCosineHemisphere(
+                        Point2f(random.nextFloat(), random.nextFloat()));
+                    bounces.push_back(its[x].spawnRay(its[x].shFrame.toWorld(d)));
+                }
+                count += outputSize.x() + bounces.size();
+
+                /* Bounces */
+                uint32_t bounceCount = (uint32_t) bounces.size();
+                before = std::chrono::steady_clock::now();
+                for (uint32_t i = 0; i < bounceCount; ++i)
+                    hit[i] = scene->rayIntersect(bounces[i], its[i]);
+                spent[0] += elapsed(before);
+
+                before = std::chrono::steady_clock::now();
+                scene->rayIntersect(bounces.data(), bounceCount, packetIts.data(), streamHit.get());
+                spent[1] += elapsed(before);
+
+                for (uint32_t i = 0; i < bounceCount; ++i)
+                    wrong += differ(hit[i], its[i], streamHit[i], packetIts[i]);
+            }
+            rayCount += count;
+            mismatches += wrong;
+            nanoseconds[0] += spent[0];
+            nanoseconds[1] += spent[1];
+        }
+    );
+
+    cout << "done. (took " << timer.elapsedString() << ")" << endl;
+    std::cout << "# benchmark # Tracing " << rayCount << " rays: "
+              << rayCount / (nanoseconds[0] * 1e-9) * 1e-6 << " Mrays/s one by one, "
+              << rayCount / (nanoseconds[1] * 1e-9) * 1e-6 << " Mrays/s in packets (per thread), "
+              << mismatches << " rays with a different hit or distance" << std::endl;
+}
+
+/**
+ * Measure how fast finished blocks are merged into the image, with the
+ * mutex of \ref ImageBlock::put(ImageBlock &) and without it (see
+ * \ref ImageBlock::merge()), for increasing thread counts. Uses a
+ * 1920x1080 image and blocks of the usual size with the box filter, since
+ * the lock-free merge only takes blocks without a border
+ */
+static void benchmarkMerge() {
+    const Vector2i outputSize(1920, 1080);
+    const int passes = 50;
+
+    std::vector<Point2i> offsets;
+    for (int y = 0; y < outputSize.y(); y += NORI_BLOCK_SIZE)
+        for (int x = 0; x < outputSize.x(); x += NORI_BLOCK_SIZE)
+            offsets.push_back(Point2i(x, y));
+    int blockCount = (int) offsets.size() * passes;
+    int maxThreads = threadCount > 0 ? threadCount : tbb::task_scheduler_init::default_num_threads();
+
+    std::unique_ptr<ReconstructionFilter> filter(static_cast<ReconstructionFilter *>(
+        NoriObjectFactory::createInstance("box", PropertyList())));
+    ImageBlock result(outputSize, filter.get());
+
+    for (int threads = 1; ; threads = std::min(threads * 2, maxThreads)) {
+        tbb::task_scheduler_init init(threads);
+        double seconds[2];
+
+        for (int lockFree = 0; lockFree < 2; ++lockFree) {
+            result.clear();
+            /* One block per thread, created on first use */
+            tbb::enumerable_thread_specific<std::unique_ptr<ImageBlock>> blocks;
+            auto before = std::chrono::steady_clock::now();
+
+            /* Every pass merges each block once. merge() requires that no
+               two concurrent merges share pixels, so the passes must not
+               overlap */
+            for (int pass = 0; pass < passes; ++pass) {
+                tbb::parallel_for(tbb::blocked_range<int>(0, (int) offsets.size()),
+                    [&](const tbb::blocked_range<int> &range) {
+                        std::unique_ptr<ImageBlock> &block = blocks.local();
+                        if (!block) {
+                            block.reset(new ImageBlock(Vector2i(NORI_BLOCK_SIZE), filter.get()));
+                            block->setConstant(Color4f(1.f));
+                        }
+                        for (int i = range.begin(); i < range.end(); ++i) {
+                            Point2i offset = offsets[i];
+                            block->setOffset(offset);
+                            block->setSize((outputSize - offset).cwiseMin(Vector2i::Constant(NORI_BLOCK_SIZE)));
+                            if (lockFree)
+                                result.merge(*block);
+                            else
+                                result.put(*block);
+                        }
+                    }
+                );
+            }
+            seconds[lockFree] = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - before).count();
+        }
+
+        std::cout << "# benchmark # Merging " << blockCount << " blocks on " << threads << (threads == 1 ? " thread" : " threads") << ": "
+                  << blockCount / seconds[0] * 1e-3 << " kblocks/s with a mutex, "
+                  << blockCount / seconds[1] * 1e-3 << " kblocks/s lock-free" << std::endl;
+        if (threads == maxThreads)
+            break;
+    }
+}
+
+/// Parse a duration such as "300s", "5m", "1.5h" or "20" (seconds), or return 0
+static double parseDuration(const char *str) {
+    char *end = nullptr;
+    double seconds = strtod(str, &end);
+    std::string unit = end;
+    if (unit == "m" || unit == "min")
+        seconds *= 60;
+    else if (unit == "h")
+        seconds *= 3600;
+    else if (unit != "" && unit != "s")
+        return 0;
+    return seconds;
+}
+
+/// Convert an OBJ file into the binary mesh format (see \ref writeBinaryMesh())
+static void convertMesh(const std::string &input, const std::string &output) {
+    PropertyList propList;
+    propList.setString("filename", input);
+    std::unique_ptr<NoriObject> mesh(NoriObjectFactory::createInstance("obj", propList));
+    writeBinaryMesh(static_cast<const Mesh *>(mesh.get()), output, compressMesh);
 }
 
 int main(int argc, char **argv)
 {
     if (argc < 2) {
-        cerr << "Syntax: " << argv[0] << " <scene.xml> [--no-gui] [--threads N]" <<  endl;
+        cerr << "Syntax: " << argv[0] << " <scene.xml> [--no-gui] [--threads N] [--benchmark] [--heatmap]" <<  endl;
+        cerr << "        " << argv[0] << " <scene.xml> [--progressive K] [--spp N] [--time T[s|m|h]] [--noise E] [--adaptive]" <<  endl;
+        cerr << "        " << argv[0] << " <scene.xml> [--progressive K] [--checkpoint T[s|m|h]] [--resume]" <<  endl;
+        cerr << "        " << argv[0] << " --benchmark-merge [--threads N]" <<  endl;
+        cerr << "        " << argv[0] << " --convert <mesh.obj> <mesh.nmesh> [--compress]" <<  endl;
         return -1;
     }
     
     std::string sceneName = "";
     std::string exrName = "";
+    std::string convertInput = "", convertOutput = "";
 
     for (int i = 1; i < argc; ++i) {
         std::string token(argv[i]);
@@ -198,10 +706,84 @@ int main(int argc, char **argv)
 
             continue;
         }
+        else if (token == "--progressive" || token == "--spp") {
+            /* Render in passes of K samples per pixel, or override the sample count */
+            if (i+1 >= argc || atoi(argv[i+1]) <= 0) {
+                cerr << "\"" << token << "\" argument expects a positive integer following it." << endl;
+                return -1;
+            }
+            (token == "--spp" ? targetSampleCount : passSampleCount) = atoi(argv[i+1]);
+            i++;
+            continue;
+        }
+        else if (token == "--time" || token == "--checkpoint") {
+            /* Stop progressive rendering after a wall-clock budget, or save
+               its state periodically. Both take durations like 300s, 5m or 1.5h */
+            double duration = i+1 < argc ? parseDuration(argv[i+1]) : 0;
+            if (duration <= 0) {
+                cerr << "\"" << token << "\" argument expects a positive duration (e.g. 300s, 5m or 1h) following it." << endl;
+                return -1;
+            }
+            (token == "--time" ? timeBudget : checkpointInterval) = duration;
+            i++;
+            continue;
+        }
+        else if (token == "--resume") {
+            /* Continue from the checkpoint of an interrupted progressive render */
+            resumeRender = true;
+            continue;
+        }
+        else if (token == "--adaptive") {
+            /* Spend the samples of every pass on the noisiest pixels */
+            adaptiveSampling = true;
+            continue;
+        }
+        else if (token == "--noise") {
+            /* Stop progressive rendering at a relative error */
+            targetNoise = i+1 < argc ? (float) atof(argv[i+1]) : 0.f;
+            if (targetNoise <= 0) {
+                cerr << "\"--noise\" argument expects a positive relative error (e.g. 0.01) following it." << endl;
+                return -1;
+            }
+            i++;
+            continue;
+        }
         else if (token == "--no-gui") {
             gui = false;
             continue;
         }
+        else if (token == "--heatmap") {
+            /* Also write the per-pixel traversal cost to <scene>_cost.exr */
+            writeHeatmap = true;
+            continue;
+        }
+        else if (token == "--convert") {
+            /* Convert an OBJ file into a binary mesh instead of rendering */
+            if (i+2 >= argc) {
+                cerr << "\"--convert\" argument expects an input .obj and an output .nmesh file." << endl;
+                return -1;
+            }
+            convertInput = argv[i+1];
+            convertOutput = argv[i+2];
+            i += 2;
+            continue;
+        }
+        else if (token == "--compress") {
+            /* Compress the converted mesh with zlib */
+            compressMesh = true;
+            continue;
+        }
+        else if (token == "--benchmark-merge") {
+            /* Only measure how fast blocks are merged into the image */
+            benchmarkMergeOnly = true;
+            continue;
+        }
+        else if (token == "--benchmark") {
+            /* Only measure the ray tracing throughput, don't render */
+            benchmarkOnly = true;
+            gui = false;
+            continue;
+        }
 
         filesystem::path path(argv[i]);
 
@@ -226,6 +808,26 @@ int main(int argc, char **argv)
         }
     }
 
+    /* Time and noise targets, adaptive sampling and checkpoints need passes */
+    if ((timeBudget > 0 || targetNoise > 0 || adaptiveSampling || checkpointInterval > 0 || resumeRender) &&
+        passSampleCount == 0)
+        passSampleCount = 4;
+
+    if (benchmarkMergeOnly) {
+        benchmarkMerge();
+        return 0;
+    }
+
+    if (convertInput != "") {
+        try {
+            convertMesh(convertInput, convertOutput);
+        } catch (const std::exception &e) {
+            cerr << e.what() << endl;
+            return -1;
+        }
+        return 0;
+    }
+
     if (exrName !="" && sceneName !="") {
         cerr << "Both .xml and .exr files were provided. Please only provide one of them." << endl;
         return -1;
@@ -260,8 +862,14 @@ int main(int argc, char **argv)
         try {
             std::unique_ptr<NoriObject> root(loadFromXML(sceneName));
             /* When the XML root object is a scene, start rendering it .. */
-            if (root->getClassType() == NoriObject::EScene)
-                render(static_cast<Scene *>(root.get()), sceneName);
+            if (root->getClassType() == NoriObject::EScene) {
+                if (benchmarkOnly) {
+                    benchmark(static_cast<Scene *>(root.get()));
+                    benchmarkPackets(static_cast<Scene *>(root.get()));
+                }
+                else
+                    render(static_cast<Scene *>(root.get()), sceneName);
+            }
         } catch (const std::exception &e) {
             cerr << e.what() << endl;
             return -1;
@@ -0,0 +1,75 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/mappedfile.h>
+
+#if defined(PLATFORM_WINDOWS)
+#include <fstream>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+MappedFile::MappedFile(const std::string &filename) {
+#if defined(PLATFORM_WINDOWS)
+    std::ifstream is(filename, std::ios::binary | std::ios::ate);
+    if (is.fail())
+        return;
+    size_t size = (size_t) is.tellg();
+    m_buffer.resize((size + sizeof(Line) - 1) / sizeof(Line));
+    is.seekg(0);
+    if (!is.read((char *) m_buffer.data(), size))
+        return;
+    m_open = true;
+    if (size > 0) {
+        m_data = (const char *) m_buffer.data();
+        m_size = size;
+    }
+#else
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1)
+        return;
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        if (st.st_size == 0) {
+            m_open = true;
+        } else {
+            void *ptr = mmap(nullptr, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (ptr != MAP_FAILED) {
+                m_data = (const char *) ptr;
+                m_size = (size_t) st.st_size;
+                m_open = true;
+            }
+        }
+    }
+    close(fd);
+#endif
+}
+
+MappedFile::~MappedFile() {
+#if !defined(PLATFORM_WINDOWS)
+    if (m_data)
+        munmap((void *) m_data, m_size);
+#endif
+}
+
+NORI_NAMESPACE_END
@@ -28,6 +28,8 @@ NORI_NAMESPACE_BEGIN
 Mesh::Mesh(){}
 
 Mesh::~Mesh() {
+    for (BSDF *material : m_materials)
+        delete material;
     delete m_bsdf;
     delete m_emitter;
 }
@@ -40,6 +42,12 @@ void Mesh::activate()
         m_bsdf = static_cast<BSDF *>(NoriObjectFactory::createInstance("diffuse", PropertyList()));
     }
     m_area = 0.0f;
+
+    /* The triangles of a lazy mesh are not known yet. It is never an
+       emitter, so the sampling distribution is not needed */
+    if (m_lazy)
+        return;
+
     m_disPdf.reserve(getTriangleCount());
     for (uint32_t i = 0; i < getTriangleCount(); i++)
     {
@@ -48,10 +56,133 @@ void Mesh::activate()
         m_disPdf.append(area);
     }
     m_disPdf.normalize();
+
+    if (m_quantize)
+        quantize();
+}
+
+void Mesh::load() {
+    loadGeometry();
+    if (m_quantize)
+        quantize();
+}
+
+void Mesh::unload() {
+    /* Swap with empty containers, which (unlike clear()) frees the memory */
+    m_V = MatrixXf();
+    m_N = MatrixXf();
+    m_UV = MatrixXf();
+    m_F = MatrixXu();
+    std::vector<uint32_t>().swap(m_compactN);
+    std::vector<uint32_t>().swap(m_compactUV);
+    std::vector<uint16_t>().swap(m_compactF);
+    std::vector<uint16_t>().swap(m_faceMaterials);
+}
+
+void Mesh::loadGeometry() {
+    throw NoriException("The mesh \"%s\" cannot be loaded lazily!", m_name);
+}
+
+size_t Mesh::getMemoryUsage() const {
+    size_t size = sizeof(float) * (m_V.size() + m_N.size() + m_UV.size())
+        + sizeof(uint32_t) * (m_F.size() + m_compactN.size() + m_compactUV.size())
+        + sizeof(uint16_t) * (m_compactF.size() + m_faceMaterials.size());
+    for (size_t k = 0; k < m_keyframeV.size(); ++k)
+        size += sizeof(float) * m_keyframeV[k].size();
+    for (size_t k = 0; k < m_keyframeN.size(); ++k)
+        size += sizeof(float) * m_keyframeN[k].size();
+    return size;
+}
+
+/* Octahedral normal encoding: the unit sphere is projected onto the
+   octahedron |x| + |y| + |z| = 1, whose lower half is folded over the
+   upper one, and the result is stored as two 16-bit fixed point numbers */
+static inline float signNotZero(float value) {
+    return value >= 0.f ? 1.f : -1.f;
+}
+
+Normal3f Mesh::decodeNormal(uint32_t value) {
+    float x = (float) (value & 0xFFFF) * (2.f / 65535.f) - 1.f;
+    float y = (float) (value >> 16) * (2.f / 65535.f) - 1.f;
+    float z = 1.f - std::abs(x) - std::abs(y);
+    if (z < 0.f) {
+        float tmp = x;
+        x = (1.f - std::abs(y)) * signNotZero(tmp);
+        y = (1.f - std::abs(tmp)) * signNotZero(y);
+    }
+    return Normal3f(Vector3f(x, y, z).normalized());
+}
+
+uint32_t Mesh::encodeNormal(const Vector3f &n) {
+    float x = n.x(), y = n.y();
+    float scale = 1.f / (std::abs(n.x()) + std::abs(n.y()) + std::abs(n.z()));
+    x *= scale;
+    y *= scale;
+    if (n.z() < 0.f) {
+        float tmp = x;
+        x = (1.f - std::abs(y)) * signNotZero(tmp);
+        y = (1.f - std::abs(tmp)) * signNotZero(y);
+    }
+
+    /* Keep the rounding direction per component that decodes most accurately */
+    float fx = std::floor((clamp(x, -1.f, 1.f) * .5f + .5f) * 65535.f);
+    float fy = std::floor((clamp(y, -1.f, 1.f) * .5f + .5f) * 65535.f);
+    uint32_t best = 0;
+    float bestCosTheta = -2.f;
+    for (int i = 0; i < 4; ++i) {
+        uint32_t qx = (uint32_t) std::min(fx + (i & 1), 65535.f);
+        uint32_t qy = (uint32_t) std::min(fy + (i >> 1), 65535.f);
+        uint32_t value = qx | (qy << 16);
+        float cosTheta = decodeNormal(value).dot(n);
+        if (cosTheta > bestCosTheta) {
+            bestCosTheta = cosTheta;
+            best = value;
+        }
+    }
+    return best;
+}
+
+void Mesh::quantize() {
+    size_t before = sizeof(float) * (m_N.size() + m_UV.size()) + sizeof(uint32_t) * m_F.size();
+
+    if (m_N.size() > 0) {
+        m_compactN.resize(m_N.cols());
+        for (uint32_t i = 0; i < (uint32_t) m_N.cols(); ++i)
+            m_compactN[i] = encodeNormal(Vector3f(m_N.col(i)).normalized());
+        m_N.resize(0, 0);
+    }
+
+    if (m_UV.size() > 0) {
+        Vector2f uvMin = m_UV.rowwise().minCoeff(), uvMax = m_UV.rowwise().maxCoeff();
+        Vector2f extent = uvMax - uvMin;
+        m_uvOffset = uvMin;
+        m_uvScale = extent / 65535.f;
+        m_compactUV.resize(m_UV.cols());
+        for (uint32_t i = 0; i < (uint32_t) m_UV.cols(); ++i) {
+            uint32_t q[2];
+            for (int k = 0; k < 2; ++k)
+                q[k] = extent[k] > 0 ? (uint32_t) std::round(
+                    clamp((m_UV(k, i) - uvMin[k]) / extent[k], 0.f, 1.f) * 65535.f) : 0u;
+            m_compactUV[i] = q[0] | (q[1] << 16);
+        }
+        m_UV.resize(0, 0);
+    }
+
+    /* 16-bit indices can only address the first 65536 vertices */
+    if (m_F.size() > 0 && m_V.cols() <= 65536) {
+        m_compactF.assign(m_F.data(), m_F.data() + m_F.size());
+        m_F.resize(0, 0);
+    }
+
+    size_t after = sizeof(uint32_t) * (m_compactN.size() + m_compactUV.size() + m_F.size()) +
+                   sizeof(uint16_t) * m_compactF.size();
+    if (!m_lazy)
+        cout << "Quantized the vertex attributes of \"" << m_name << "\" ("
+             << memString(after) << " instead of " << memString(before) << ")" << endl;
 }
 
 float Mesh::surfaceArea(uint32_t index) const {
-    uint32_t i0 = m_F(0, index), i1 = m_F(1, index), i2 = m_F(2, index);
+    uint32_t i0 = getVertexIndex(index, 0), i1 = getVertexIndex(index, 1), i2 = getVertexIndex(index, 2);
 
     const Point3f p0 = m_V.col(i0), p1 = m_V.col(i1), p2 = m_V.col(i2);
 
@@ -65,16 +196,17 @@ SampleMeshResult Mesh::sampleSurfaceUniform(Sampler* sampler) const
     Point2f rng = sampler->next2D();
     float alpha = 1 - sqrt(1 - rng.x());
     float beta = rng.y() * sqrt(1 - rng.x());
-    Point3f v0 = m_V.col(m_F(0, idx));
-    Point3f v1 = m_V.col(m_F(1, idx));
-    Point3f v2 = m_V.col(m_F(2, idx));
+    uint32_t i0 = getVertexIndex(idx, 0), i1 = getVertexIndex(idx, 1), i2 = getVertexIndex(idx, 2);
+    Point3f v0 = m_V.col(i0);
+    Point3f v1 = m_V.col(i1);
+    Point3f v2 = m_V.col(i2);
     Point3f p = alpha * v0 + beta * v1 + (1 - alpha - beta) * v2;
     result.p = p;
-    if (m_N.size() != 0)
+    if (hasVertexNormals())
     {
-        Point3f n0 = m_N.col(m_F(0, idx));
-        Point3f n1 = m_N.col(m_F(1, idx));
-        Point3f n2 = m_N.col(m_F(2, idx));
+        Point3f n0 = getVertexNormal(i0);
+        Point3f n1 = getVertexNormal(i1);
+        Point3f n2 = getVertexNormal(i2);
         result.n = (alpha * n0 + beta * n1 + (1 - alpha - beta) * n2).normalized();
     }
     else
@@ -88,7 +220,7 @@ SampleMeshResult Mesh::sampleSurfaceUniform(Sampler* sampler) const
 }
 
 bool Mesh::rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const {
-    uint32_t i0 = m_F(0, index), i1 = m_F(1, index), i2 = m_F(2, index);
+    uint32_t i0 = getVertexIndex(index, 0), i1 = getVertexIndex(index, 1), i2 = getVertexIndex(index, 2);
     const Point3f p0 = m_V.col(i0), p1 = m_V.col(i1), p2 = m_V.col(i2);
 
     /* Find vectors for two edges sharing v[0] */
@@ -123,21 +255,50 @@ bool Mesh::rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, fl
     /* Ray intersects triangle -> compute t */
     t = edge2.dot(qvec) * inv_det;
 
-    return t >= ray.mint && t <= ray.maxt;
+    return t > ray.mint && t <= ray.maxt;
 }
 
 BoundingBox3f Mesh::getBoundingBox(uint32_t index) const {
-    BoundingBox3f result(m_V.col(m_F(0, index)));
-    result.expandBy(m_V.col(m_F(1, index)));
-    result.expandBy(m_V.col(m_F(2, index)));
+    BoundingBox3f result(m_V.col(getVertexIndex(index, 0)));
+    result.expandBy(m_V.col(getVertexIndex(index, 1)));
+    result.expandBy(m_V.col(getVertexIndex(index, 2)));
     return result;
 }
 
 Point3f Mesh::getCentroid(uint32_t index) const {
     return (1.0f / 3.0f) *
-        (m_V.col(m_F(0, index)) +
-         m_V.col(m_F(1, index)) +
-         m_V.col(m_F(2, index)));
+        (m_V.col(getVertexIndex(index, 0)) +
+         m_V.col(getVertexIndex(index, 1)) +
+         m_V.col(getVertexIndex(index, 2)));
+}
+
+/// Find the keyframe interval of a time and the position within it
+static inline uint32_t keyframeInterval(uint32_t keyframeCount, float time, float &alpha) {
+    float x = clamp(time, 0.f, 1.f) * (keyframeCount - 1);
+    uint32_t k = std::min((uint32_t) x, keyframeCount - 2);
+    alpha = x - k;
+    return k;
+}
+
+Point3f Mesh::getVertexPosition(uint32_t vertex, float time) const {
+    if (!isMoving())
+        return m_V.col(vertex);
+
+    float alpha;
+    uint32_t k = keyframeInterval(getKeyframeCount(), time, alpha);
+    Point3f p0 = getKeyframePositions(k).col(vertex), p1 = getKeyframePositions(k + 1).col(vertex);
+    return (1 - alpha) * p0 + alpha * p1;
+}
+
+Normal3f Mesh::getVertexNormal(uint32_t vertex, float time) const {
+    if (m_keyframeN.empty())
+        return getVertexNormal(vertex);
+
+    float alpha;
+    uint32_t k = keyframeInterval(getKeyframeCount(), time, alpha);
+    Normal3f n0 = k == 0 ? getVertexNormal(vertex) : Normal3f(m_keyframeN[k - 1].col(vertex));
+    Normal3f n1 = m_keyframeN[k].col(vertex);
+    return (1 - alpha) * n0 + alpha * n1;
 }
 
 void Mesh::addChild(NoriObject *obj) {
@@ -170,12 +331,16 @@ std::string Mesh::toString() const {
         "  name = \"%s\",\n"
         "  vertexCount = %i,\n"
         "  triangleCount = %i,\n"
+        "  keyframes = %i,\n"
+        "  materials = %i,\n"
         "  bsdf = %s,\n"
         "  emitter = %s\n"
         "]",
         m_name,
         m_V.cols(),
-        m_F.cols(),
+        getTriangleCount(),
+        getKeyframeCount(),
+        getMaterialCount(),
         m_bsdf ? indent(m_bsdf->toString()) : std::string("null"),
         m_emitter ? indent(m_emitter->toString()) : std::string("null")
     );
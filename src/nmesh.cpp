@@ -0,0 +1,370 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/mesh.h>
+#include <nori/mappedfile.h>
+#include <nori/timer.h>
+#include <filesystem/resolver.h>
+#include <tbb/tbb.h>
+#include <zlib.h>
+#include <cstdio>
+
+/* ===================================================================
+    Binary mesh format (.nmesh): a fixed header followed by the vertex
+    positions, normals, texture coordinates and faces, each stored as
+    the little-endian, column-major contents of the corresponding Eigen
+    matrix. Uncompressed sections start at multiples of 64 bytes and
+    are copied straight out of the memory-mapped file. Compressed files
+    instead hold a single zlib stream of the unpadded sections, which
+    is inflated directly into the matrices.
+ * =================================================================== */
+
+NORI_NAMESPACE_BEGIN
+
+/// Increment whenever the file layout changes
+static const uint32_t NMeshVersion = 1;
+
+enum NMeshFlags {
+    ECompressed = 1,
+    EHasNormals = 2,
+    EHasTexCoords = 4
+};
+
+struct NMeshHeader {
+    char magic[8];         ///< "NORIMSH"
+    uint32_t version;      ///< \ref NMeshVersion
+    uint32_t flags;        ///< Combination of \ref NMeshFlags
+    uint64_t vertexCount;  ///< Number of vertices
+    uint64_t faceCount;    ///< Number of triangles
+    uint64_t payloadSize;  ///< Size of the data following the header (compressed or not)
+    float bboxMin[3];      ///< Bounding box of the vertex positions
+    float bboxMax[3];
+};
+
+/* Every uncompressed section starts at a multiple of 64 bytes */
+static size_t alignSection(size_t offset) {
+    return (offset + 63) & ~(size_t) 63;
+}
+
+static bool isLittleEndian() {
+    uint16_t value = 1;
+    uint8_t byte;
+    memcpy(&byte, &value, 1);
+    return byte == 1;
+}
+
+/* zlib counts bytes with 32-bit integers, so large sections are processed in pieces */
+static const size_t ZlibPieceSize = (size_t) 1 << 30;
+
+void writeBinaryMesh(const Mesh *mesh, const std::string &filename, bool compress) {
+    if (!isLittleEndian())
+        throw NoriException("Binary meshes can only be written on little-endian machines!");
+    if (mesh->isMoving())
+        throw NoriException("Binary meshes cannot store the keyframes of the moving mesh \"%s\"!",
+                            mesh->getName());
+    if (mesh->isQuantized())
+        throw NoriException("Binary meshes cannot store the quantized mesh \"%s\"!", mesh->getName());
+
+    cout << "Writing \"" << filename << "\" .. ";
+    cout.flush();
+    Timer timer;
+
+    const MatrixXf &V = mesh->getVertexPositions(), &N = mesh->getVertexNormals(),
+                   &UV = mesh->getVertexTexCoords();
+    const MatrixXu &F = mesh->getIndices();
+    const BoundingBox3f &bbox = mesh->getBoundingBox();
+
+    struct Section {
+        const void *data;
+        size_t size;
+    };
+    Section sections[] = {
+        { V.data(), sizeof(float) * V.size() },
+        { N.data(), sizeof(float) * N.size() },
+        { UV.data(), sizeof(float) * UV.size() },
+        { F.data(), sizeof(uint32_t) * F.size() }
+    };
+
+    NMeshHeader header;
+    memset(&header, 0, sizeof(NMeshHeader));
+    memcpy(header.magic, "NORIMSH", 8);
+    header.version = NMeshVersion;
+    header.flags = (compress ? ECompressed : 0) | (N.size() > 0 ? EHasNormals : 0) |
+                   (UV.size() > 0 ? EHasTexCoords : 0);
+    header.vertexCount = (uint64_t) V.cols();
+    header.faceCount = (uint64_t) F.cols();
+    for (int i = 0; i < 3; ++i) {
+        header.bboxMin[i] = bbox.min[i];
+        header.bboxMax[i] = bbox.max[i];
+    }
+
+    /* Compressed files are assembled in memory, since the header stores the final size */
+    std::vector<uint8_t> payload;
+    if (compress) {
+        z_stream stream;
+        memset(&stream, 0, sizeof(z_stream));
+        if (deflateInit(&stream, Z_DEFAULT_COMPRESSION) != Z_OK)
+            throw NoriException("Unable to initialize the zlib compressor!");
+
+        size_t totalSize = 0;
+        for (const Section &section : sections)
+            totalSize += section.size;
+        payload.resize(std::max((size_t) deflateBound(&stream, (uLong) std::min(totalSize, ZlibPieceSize)), (size_t) 64));
+
+        size_t written = 0;
+        auto deflatePiece = [&](const void *data, size_t size, int flush) {
+            stream.next_in = (Bytef *) data;
+            stream.avail_in = (uInt) size;
+            int ret;
+            do {
+                if (written == payload.size())
+                    payload.resize(payload.size() * 2);
+                stream.next_out = payload.data() + written;
+                stream.avail_out = (uInt) std::min(payload.size() - written, ZlibPieceSize);
+                ret = deflate(&stream, flush);
+                written = (size_t) (stream.next_out - payload.data());
+            } while (stream.avail_in > 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+        };
+        for (const Section &section : sections) {
+            for (size_t offset = 0; offset < section.size; offset += ZlibPieceSize)
+                deflatePiece((const uint8_t *) section.data + offset,
+                             std::min(section.size - offset, ZlibPieceSize), Z_NO_FLUSH);
+        }
+        deflatePiece(nullptr, 0, Z_FINISH);
+        deflateEnd(&stream);
+        payload.resize(written);
+        header.payloadSize = payload.size();
+    } else {
+        for (const Section &section : sections)
+            header.payloadSize = alignSection(header.payloadSize + section.size);
+    }
+
+    FILE *file = fopen(filename.c_str(), "wb");
+    if (!file)
+        throw NoriException("Unable to write the binary mesh \"%s\"!", filename);
+
+    static const char padding[64] = { 0 };
+    size_t offset = 0;
+    bool success = true;
+    auto write = [&](const void *data, size_t size, bool align) {
+        success = success && fwrite(data, 1, size, file) == size;
+        offset += size;
+        size_t padSize = align ? alignSection(offset) - offset : 0;
+        success = success && fwrite(padding, 1, padSize, file) == padSize;
+        offset += padSize;
+    };
+    write(&header, sizeof(NMeshHeader), !compress);
+    if (compress) {
+        write(payload.data(), payload.size(), false);
+    } else {
+        for (const Section &section : sections)
+            write(section.data, section.size, true);
+    }
+    success = fclose(file) == 0 && success;
+    if (!success)
+        throw NoriException("Unable to write the binary mesh \"%s\"!", filename);
+
+    cout << "done. (V=" << V.cols() << ", F=" << F.cols() << ", took " << timer.elapsedString()
+         << " and " << memString(offset) << ")" << endl;
+}
+
+/**
+ * \brief Loader for binary .nmesh triangle meshes (see \ref writeBinaryMesh())
+ */
+class BinaryMesh : public Mesh {
+public:
+    BinaryMesh(const PropertyList &propList) {
+        m_filename = getFileResolver()->resolve(propList.getString("filename"));
+        if (!isLittleEndian())
+            throw NoriException("Binary meshes can only be loaded on little-endian machines!");
+
+        m_hasTrafo = propList.has("toWorld");
+        if (m_hasTrafo)
+            m_trafo = propList.getTransform("toWorld");
+        m_name = m_filename.str();
+        m_id = propList.getString("id", "");
+        m_quantize = propList.getBoolean("quantize", false);
+        m_lazy = propList.getBoolean("lazy", false);
+
+        if (m_lazy) {
+            /* The header has the bounding box in object space. The box
+               of its transformed corners contains the transformed mesh,
+               up to the rounding error of the transformation */
+            MappedFile file(m_filename.str());
+            NMeshHeader header = readHeader(file);
+            BoundingBox3f bbox(Point3f(header.bboxMin[0], header.bboxMin[1], header.bboxMin[2]),
+                               Point3f(header.bboxMax[0], header.bboxMax[1], header.bboxMax[2]));
+            if (header.vertexCount == 0) {
+                /* Empty mesh, keep the invalid box */
+            } else if (!m_hasTrafo) {
+                m_bbox = bbox;
+            } else {
+                for (int i = 0; i < 8; ++i)
+                    m_bbox.expandBy(m_trafo * bbox.getCorner(i));
+                Vector3f margin = errorBound(3) * (m_bbox.min.cwiseAbs().cwiseMax(m_bbox.max.cwiseAbs()));
+                m_bbox.min -= margin;
+                m_bbox.max += margin;
+            }
+            cout << "Read the bounds of \"" << m_filename << "\" (V=" << header.vertexCount
+                 << ", F=" << header.faceCount << ", loaded on demand)" << endl;
+            return;
+        }
+
+        cout << "Loading \"" << m_filename << "\" .. ";
+        cout.flush();
+        Timer timer;
+
+        readGeometry();
+
+        cout << "done. (V=" << m_V.cols() << ", F=" << m_F.cols() << ", took "
+             << timer.elapsedString() << " and "
+             << memString(m_F.size() * sizeof(uint32_t) +
+                          sizeof(float) * (m_V.size() + m_N.size() + m_UV.size()))
+             << ")" << endl;
+    }
+
+protected:
+    /// Check and return the header of the file
+    NMeshHeader readHeader(const MappedFile &file) const {
+        if (!file.isOpen())
+            throw NoriException("Unable to open binary mesh \"%s\"!", m_filename);
+
+        NMeshHeader header;
+        if (file.size() < sizeof(NMeshHeader))
+            throw NoriException("\"%s\" is not a binary mesh!", m_filename);
+        memcpy(&header, file.data(), sizeof(NMeshHeader));
+        if (memcmp(header.magic, "NORIMSH", 8) != 0)
+            throw NoriException("\"%s\" is not a binary mesh!", m_filename);
+        if (header.version != NMeshVersion)
+            throw NoriException("The binary mesh \"%s\" has an unsupported version (%i)!",
+                                m_filename, header.version);
+        return header;
+    }
+
+    /// Read the vertex attributes and faces
+    void readGeometry() {
+        MappedFile file(m_filename.str());
+        NMeshHeader header = readHeader(file);
+
+        bool compressed = (header.flags & ECompressed) != 0;
+        size_t payloadOffset = compressed ? sizeof(NMeshHeader) : alignSection(sizeof(NMeshHeader));
+        if (payloadOffset + header.payloadSize > file.size())
+            throw NoriException("The binary mesh \"%s\" is truncated!", m_filename);
+        const uint8_t *payload = (const uint8_t *) file.data() + payloadOffset;
+
+        m_V.resize(3, (Eigen::Index) header.vertexCount);
+        if (header.flags & EHasNormals)
+            m_N.resize(3, (Eigen::Index) header.vertexCount);
+        if (header.flags & EHasTexCoords)
+            m_UV.resize(2, (Eigen::Index) header.vertexCount);
+        m_F.resize(3, (Eigen::Index) header.faceCount);
+
+        struct Section {
+            void *data;
+            size_t size;
+        };
+        Section sections[] = {
+            { m_V.data(), sizeof(float) * m_V.size() },
+            { m_N.data(), sizeof(float) * m_N.size() },
+            { m_UV.data(), sizeof(float) * m_UV.size() },
+            { m_F.data(), sizeof(uint32_t) * m_F.size() }
+        };
+
+        if (compressed) {
+            z_stream stream;
+            memset(&stream, 0, sizeof(z_stream));
+            if (inflateInit(&stream) != Z_OK)
+                throw NoriException("Unable to initialize the zlib decompressor!");
+
+            size_t consumed = 0;
+            int ret = Z_OK;
+            bool complete = true;
+            for (const Section &section : sections) {
+                size_t produced = 0;
+                while (produced < section.size && ret == Z_OK) {
+                    stream.next_in = (Bytef *) payload + consumed;
+                    stream.avail_in = (uInt) std::min(header.payloadSize - consumed, (uint64_t) ZlibPieceSize);
+                    stream.next_out = (Bytef *) section.data + produced;
+                    stream.avail_out = (uInt) std::min(section.size - produced, ZlibPieceSize);
+                    ret = inflate(&stream, Z_NO_FLUSH);
+                    consumed = (size_t) (stream.next_in - payload);
+                    produced = (size_t) (stream.next_out - (Bytef *) section.data);
+                }
+                complete = complete && produced == section.size;
+            }
+            inflateEnd(&stream);
+            if (!complete)
+                throw NoriException("The binary mesh \"%s\" is corrupt (zlib error %i)!", m_filename, ret);
+        } else {
+            size_t offset = 0;
+            for (const Section &section : sections) {
+                if (offset + section.size > header.payloadSize)
+                    throw NoriException("The binary mesh \"%s\" is truncated!", m_filename);
+                memcpy(section.data, payload + offset, section.size);
+                offset = alignSection(offset + section.size);
+            }
+        }
+
+        /* Check the faces, since they are used to index the other arrays */
+        uint32_t maxIndex = tbb::parallel_reduce(
+            tbb::blocked_range<Eigen::Index>(0, m_F.size(), 1 << 16), 0u,
+            [&](const tbb::blocked_range<Eigen::Index> &range, uint32_t value) {
+                for (Eigen::Index i = range.begin(); i != range.end(); ++i)
+                    value = std::max(value, m_F.data()[i]);
+                return value;
+            },
+            [](uint32_t a, uint32_t b) { return std::max(a, b); });
+        if (m_F.size() > 0 && maxIndex >= header.vertexCount)
+            throw NoriException("The binary mesh \"%s\" references a missing vertex!", m_filename);
+
+        if (m_hasTrafo) {
+            /* Transform the mesh like the OBJ loader does */
+            tbb::parallel_for(tbb::blocked_range<Eigen::Index>(0, m_V.cols(), 1 << 16),
+                [&](const tbb::blocked_range<Eigen::Index> &range) {
+                    for (Eigen::Index i = range.begin(); i != range.end(); ++i) {
+                        m_V.col(i) = m_trafo * Point3f(m_V.col(i));
+                        if (m_N.size() > 0)
+                            m_N.col(i) = (m_trafo * Normal3f(m_N.col(i))).normalized();
+                    }
+                });
+        }
+
+        /* The box of a lazy mesh is already known (and possibly in use) */
+        if (m_lazy)
+            return;
+        if (m_hasTrafo) {
+            for (Eigen::Index i = 0; i < m_V.cols(); ++i)
+                m_bbox.expandBy(Point3f(m_V.col(i)));
+        } else if (m_V.cols() > 0) {
+            m_bbox = BoundingBox3f(Point3f(header.bboxMin[0], header.bboxMin[1], header.bboxMin[2]),
+                                   Point3f(header.bboxMax[0], header.bboxMax[1], header.bboxMax[2]));
+        }
+    }
+
+    void loadGeometry() {
+        readGeometry();
+    }
+
+protected:
+    filesystem::path m_filename; ///< Resolved path of the binary mesh
+    Transform m_trafo;           ///< Object-to-world transformation (if \ref m_hasTrafo)
+    bool m_hasTrafo = false;     ///< Was a "toWorld" transformation specified?
+};
+
+NORI_REGISTER_CLASS(BinaryMesh, "binary");
+NORI_NAMESPACE_END
@@ -17,158 +17,747 @@
 */
 
 #include <nori/mesh.h>
+#include <nori/bsdf.h>
+#include <nori/mappedfile.h>
 #include <nori/timer.h>
 #include <filesystem/resolver.h>
-#include <unordered_map>
+#include <tbb/tbb.h>
+#include <atomic>
+#include <cstdlib>
 #include <fstream>
+#include <map>
+#include <memory>
+
+/* ===================================================================
+    The OBJ file is memory-mapped and split into chunks at line
+    boundaries, which are parsed in parallel without allocating any
+    strings. The chunks are then concatenated, and the face vertices
+    (position/texcoord/normal index triples) are deduplicated with a
+    lock-free open-addressed hash table. The vertices are numbered in
+    the order of their first occurrence, exactly like a sequential
+    parser would, so the output does not depend on the thread count.
+ * =================================================================== */
 
 NORI_NAMESPACE_BEGIN
 
+/// Vertex indices used by the OBJ format
+struct OBJVertex {
+    uint32_t p = (uint32_t) -1;
+    uint32_t n = (uint32_t) -1;
+    uint32_t uv = (uint32_t) -1;
+
+    inline bool operator==(const OBJVertex &v) const {
+        return v.p == p && v.n == n && v.uv == uv;
+    }
+};
+
+/// Contents of an OBJ file (or of a chunk of it)
+struct OBJData {
+    std::vector<Vector3f> positions;
+    std::vector<Vector2f> texcoords;
+    std::vector<Vector3f> normals;
+    std::vector<OBJVertex> vertices; ///< Three face vertices per triangle (quads are split)
+    std::vector<std::pair<size_t, std::string>> materialSwitches; ///< \c usemtl statements (position in \c vertices, name)
+    std::vector<std::string> materialLibraries; ///< Files listed by \c mtllib statements
+};
+
+static inline bool isSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static inline bool isDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static inline const char *skipSpace(const char *ptr, const char *end) {
+    while (ptr < end && isSpace(*ptr))
+        ++ptr;
+    return ptr;
+}
+
 /**
- * \brief Loader for Wavefront OBJ triangle meshes
+ * \brief Parse a decimal number
+ *
+ * Numbers with up to 7 significant digits and small exponents (i.e.
+ * almost all numbers in OBJ files) are converted with a single float
+ * multiplication or division, which is exact since both operands are.
+ * Everything else goes through \c strtof(). Either way, the result is
+ * correctly rounded like that of the \c istream operator.
+ *
+ * \return The end of the number, or \c nullptr if there is none
  */
-class WavefrontOBJ : public Mesh {
-public:
-    WavefrontOBJ(const PropertyList &propList) {
-        typedef std::unordered_map<OBJVertex, uint32_t, OBJVertexHash> VertexMap;
+static const char *parseFloat(const char *ptr, const char *end, float &value) {
+    static const float powersOf10[] = {
+        1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f
+    };
 
-        filesystem::path filename =
-            getFileResolver()->resolve(propList.getString("filename"));
+    const char *start = ptr;
+    bool negative = ptr < end && *ptr == '-';
+    if (ptr < end && (*ptr == '-' || *ptr == '+'))
+        ++ptr;
 
-        std::ifstream is(filename.str());
-        if (is.fail())
-            throw NoriException("Unable to open OBJ file \"%s\"!", filename);
-        Transform trafo = propList.getTransform("toWorld", Transform());
+    uint32_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    bool found = false;
+    for (; ptr < end && isDigit(*ptr); ++ptr, found = true) {
+        if (mantissa > 0 || *ptr != '0')
+            digits++;
+        if (digits <= 9)
+            mantissa = mantissa * 10 + (uint32_t) (*ptr - '0');
+    }
+    if (ptr < end && *ptr == '.') {
+        for (++ptr; ptr < end && isDigit(*ptr); ++ptr, found = true) {
+            if (mantissa > 0 || *ptr != '0')
+                digits++;
+            if (digits <= 9) {
+                mantissa = mantissa * 10 + (uint32_t) (*ptr - '0');
+                exponent--;
+            }
+        }
+    }
+    if (found && ptr < end && (*ptr == 'e' || *ptr == 'E')) {
+        const char *expStart = ptr++;
+        bool expNegative = ptr < end && *ptr == '-';
+        if (ptr < end && (*ptr == '-' || *ptr == '+'))
+            ++ptr;
+        if (ptr < end && isDigit(*ptr)) {
+            int exp = 0;
+            for (; ptr < end && isDigit(*ptr); ++ptr)
+                exp = std::min(exp * 10 + (*ptr - '0'), 100000);
+            exponent += expNegative ? -exp : exp;
+        } else {
+            ptr = expStart;
+        }
+    }
 
-        cout << "Loading \"" << filename << "\" .. ";
-        cout.flush();
-        Timer timer;
+    bool terminated = ptr == end || isSpace(*ptr) || *ptr == '\n';
+    if (found && terminated && digits <= 7 && exponent >= -10 && exponent <= 10) {
+        float result = (float) mantissa;
+        result = exponent < 0 ? result / powersOf10[-exponent] : result * powersOf10[exponent];
+        value = negative ? -result : result;
+        return ptr;
+    }
+
+    /* Slow path: copy the token, so that strtof() stops at its end */
+    char buffer[64];
+    size_t length = 0;
+    for (ptr = start; ptr < end && !isSpace(*ptr) && *ptr != '\n' && length < sizeof(buffer) - 1; ++ptr)
+        buffer[length++] = *ptr;
+    buffer[length] = '\0';
+    char *endPtr = nullptr;
+    value = strtof(buffer, &endPtr);
+    if (endPtr == buffer)
+        return nullptr;
+    return start + (endPtr - buffer);
+}
+
+/// Parse an unsigned index, returns \c nullptr if there is none
+static inline const char *parseIndex(const char *ptr, const char *end, uint32_t &value) {
+    if (ptr == end || !isDigit(*ptr)) {
+        if (ptr < end && *ptr == '-')
+            throw NoriException("Negative (relative) OBJ indices are not supported!");
+        return nullptr;
+    }
+    value = 0;
+    for (; ptr < end && isDigit(*ptr); ++ptr)
+        value = value * 10 + (uint32_t) (*ptr - '0');
+    return ptr;
+}
+
+/// Parse a face vertex of the form p, p/uv, p//n or p/uv/n
+static const char *parseVertex(const char *ptr, const char *end, OBJVertex &v) {
+    v = OBJVertex();
+    ptr = parseIndex(ptr, end, v.p);
+    if (!ptr)
+        return nullptr;
+    if (ptr < end && *ptr == '/') {
+        ++ptr;
+        if (ptr < end && isDigit(*ptr))
+            ptr = parseIndex(ptr, end, v.uv);
+        if (ptr < end && *ptr == '/') {
+            ++ptr;
+            if (ptr < end && isDigit(*ptr))
+                ptr = parseIndex(ptr, end, v.n);
+        }
+    }
+    return ptr;
+}
+
+/// Parse the complete lines in <tt>[ptr, end)</tt>, skipping faces unless requested
+static void parseChunk(const char *ptr, const char *end, OBJData &data, bool faces) {
+    while (ptr < end) {
+        const char *lineEnd = (const char *) memchr(ptr, '\n', end - ptr);
+        if (!lineEnd)
+            lineEnd = end;
 
-        std::vector<Vector3f>   positions;
-        std::vector<Vector2f>   texcoords;
-        std::vector<Vector3f>   normals;
-        std::vector<uint32_t>   indices;
-        std::vector<OBJVertex>  vertices;
-        VertexMap vertexMap;
-
-        std::string line_str;
-        while (std::getline(is, line_str)) {
-            std::istringstream line(line_str);
-
-            std::string prefix;
-            line >> prefix;
-
-            if (prefix == "v") {
-                Point3f p;
-                line >> p.x() >> p.y() >> p.z();
-                p = trafo * p;
-                m_bbox.expandBy(p);
-                positions.push_back(p);
-            } else if (prefix == "vt") {
-                Point2f tc;
-                line >> tc.x() >> tc.y();
-                texcoords.push_back(tc);
-            } else if (prefix == "vn") {
-                Normal3f n;
-                line >> n.x() >> n.y() >> n.z();
-                normals.push_back((trafo * n).normalized());
-            } else if (prefix == "f") {
-                std::string v1, v2, v3, v4;
-                line >> v1 >> v2 >> v3 >> v4;
-                OBJVertex verts[6];
-                int nVertices = 3;
-
-                verts[0] = OBJVertex(v1);
-                verts[1] = OBJVertex(v2);
-                verts[2] = OBJVertex(v3);
-
-                if (!v4.empty()) {
+        /* The prefix is the first whitespace-delimited token */
+        ptr = skipSpace(ptr, lineEnd);
+        const char *prefix = ptr;
+        while (ptr < lineEnd && !isSpace(*ptr))
+            ++ptr;
+        size_t prefixLength = ptr - prefix;
+
+        bool valid = true;
+        if (prefixLength == 1 && prefix[0] == 'v') {
+            Vector3f p;
+            for (int i = 0; i < 3 && valid; ++i)
+                valid = (ptr = parseFloat(skipSpace(ptr, lineEnd), lineEnd, p[i])) != nullptr;
+            data.positions.push_back(p);
+        } else if (prefixLength == 2 && prefix[0] == 'v' && prefix[1] == 't') {
+            Vector2f tc;
+            for (int i = 0; i < 2 && valid; ++i)
+                valid = (ptr = parseFloat(skipSpace(ptr, lineEnd), lineEnd, tc[i])) != nullptr;
+            data.texcoords.push_back(tc);
+        } else if (prefixLength == 2 && prefix[0] == 'v' && prefix[1] == 'n') {
+            Vector3f n;
+            for (int i = 0; i < 3 && valid; ++i)
+                valid = (ptr = parseFloat(skipSpace(ptr, lineEnd), lineEnd, n[i])) != nullptr;
+            data.normals.push_back(n);
+        } else if (faces && prefixLength == 1 && prefix[0] == 'f') {
+            OBJVertex verts[4];
+            int nVertices = 0;
+            for (; nVertices < 4; ++nVertices) {
+                ptr = skipSpace(ptr, lineEnd);
+                if (ptr == lineEnd)
+                    break;
+                ptr = parseVertex(ptr, lineEnd, verts[nVertices]);
+                if (!ptr || (ptr < lineEnd && !isSpace(*ptr))) {
+                    valid = false;
+                    break;
+                }
+            }
+            valid = valid && nVertices >= 3;
+            if (valid) {
+                data.vertices.insert(data.vertices.end(), verts, verts + 3);
+                if (nVertices == 4) {
                     /* This is a quad, split into two triangles */
-                    verts[3] = OBJVertex(v4);
-                    verts[4] = verts[0];
-                    verts[5] = verts[2];
-                    nVertices = 6;
+                    data.vertices.push_back(verts[3]);
+                    data.vertices.push_back(verts[0]);
+                    data.vertices.push_back(verts[2]);
                 }
-                /* Convert to an indexed vertex list */
-                for (int i=0; i<nVertices; ++i) {
-                    const OBJVertex &v = verts[i];
-                    VertexMap::const_iterator it = vertexMap.find(v);
-                    if (it == vertexMap.end()) {
-                        vertexMap[v] = (uint32_t) vertices.size();
-                        indices.push_back((uint32_t) vertices.size());
-                        vertices.push_back(v);
-                    } else {
-                        indices.push_back(it->second);
+            }
+        } else if (faces && prefixLength == 6 && memcmp(prefix, "usemtl", 6) == 0) {
+            /* The material name is the rest of the line */
+            const char *nameStart = skipSpace(ptr, lineEnd), *nameEnd = lineEnd;
+            while (nameEnd > nameStart && isSpace(nameEnd[-1]))
+                --nameEnd;
+            data.materialSwitches.emplace_back(data.vertices.size(), std::string(nameStart, nameEnd));
+        } else if (faces && prefixLength == 6 && memcmp(prefix, "mtllib", 6) == 0) {
+            while ((ptr = skipSpace(ptr, lineEnd)) < lineEnd) {
+                const char *nameStart = ptr;
+                while (ptr < lineEnd && !isSpace(*ptr))
+                    ++ptr;
+                data.materialLibraries.emplace_back(nameStart, ptr);
+            }
+        }
+
+        if (!valid)
+            throw NoriException("Invalid OBJ data: \"%s\"", std::string(prefix, lineEnd));
+
+        ptr = lineEnd + 1;
+    }
+}
+
+/// Parse a memory-mapped OBJ file in parallel (see above)
+static void parseOBJ(const MappedFile &file, OBJData &data, bool faces) {
+    const char *begin = file.data(), *end = begin + file.size();
+
+    /* Chunks of roughly 1 MiB that start at the beginning of a line */
+    size_t chunkCount = std::min(file.size() / (1 << 20) + 1, (size_t) 1024);
+    std::vector<const char *> bounds(chunkCount + 1, end);
+    bounds[0] = begin;
+    for (size_t i = 1; i < chunkCount; ++i) {
+        const char *ptr = begin + file.size() / chunkCount * i;
+        ptr = std::max(ptr, bounds[i - 1]);
+        const char *newline = ptr < end ? (const char *) memchr(ptr, '\n', end - ptr) : nullptr;
+        bounds[i] = newline ? newline + 1 : end;
+    }
+
+    std::vector<OBJData> chunks(chunkCount);
+    tbb::parallel_for(size_t(0), chunkCount, [&](size_t i) {
+        parseChunk(bounds[i], bounds[i + 1], chunks[i], faces);
+    });
+
+    /* Concatenate the chunks */
+    std::vector<size_t> offsets[4];
+    for (auto &offset : offsets)
+        offset.assign(chunkCount + 1, 0);
+    for (size_t i = 0; i < chunkCount; ++i) {
+        offsets[0][i + 1] = offsets[0][i] + chunks[i].positions.size();
+        offsets[1][i + 1] = offsets[1][i] + chunks[i].texcoords.size();
+        offsets[2][i + 1] = offsets[2][i] + chunks[i].normals.size();
+        offsets[3][i + 1] = offsets[3][i] + chunks[i].vertices.size();
+    }
+    data.positions.resize(offsets[0][chunkCount]);
+    data.texcoords.resize(offsets[1][chunkCount]);
+    data.normals.resize(offsets[2][chunkCount]);
+    data.vertices.resize(offsets[3][chunkCount]);
+
+    tbb::parallel_for(size_t(0), chunkCount, [&](size_t i) {
+        std::copy(chunks[i].positions.begin(), chunks[i].positions.end(), data.positions.begin() + offsets[0][i]);
+        std::copy(chunks[i].texcoords.begin(), chunks[i].texcoords.end(), data.texcoords.begin() + offsets[1][i]);
+        std::copy(chunks[i].normals.begin(), chunks[i].normals.end(), data.normals.begin() + offsets[2][i]);
+        std::copy(chunks[i].vertices.begin(), chunks[i].vertices.end(), data.vertices.begin() + offsets[3][i]);
+        OBJData().positions.swap(chunks[i].positions);
+        OBJData().vertices.swap(chunks[i].vertices);
+    });
+
+    for (size_t i = 0; i < chunkCount; ++i) {
+        for (const auto &materialSwitch : chunks[i].materialSwitches)
+            data.materialSwitches.emplace_back(materialSwitch.first + offsets[3][i], materialSwitch.second);
+        data.materialLibraries.insert(data.materialLibraries.end(),
+            chunks[i].materialLibraries.begin(), chunks[i].materialLibraries.end());
+    }
+}
+
+static inline uint32_t hashVertex(const OBJVertex &v) {
+    uint64_t hash = v.p * 0x9E3779B97F4A7C15ull;
+    hash ^= (hash >> 29) + v.uv * 0xC2B2AE3D27D4EB4Full;
+    hash ^= (hash >> 31) + v.n * 0x165667B19E3779F9ull;
+    return (uint32_t) (hash ^ (hash >> 32));
+}
+
+/**
+ * \brief Merge identical face vertices
+ *
+ * Every slot of the hash table holds the position of the first face
+ * vertex with a given key; concurrent insertions of the same key
+ * lower it with compare-and-swap. The first occurrences are then
+ * numbered in order with a parallel prefix sum.
+ *
+ * \param indices
+ *    Receives the index of the merged vertex of every face vertex
+ * \param firsts
+ *    Receives the position of the first occurrence of every merged vertex
+ */
+static void mergeVertices(const std::vector<OBJVertex> &vertices,
+                          std::vector<uint32_t> &indices, std::vector<uint32_t> &firsts) {
+    const uint32_t Empty = 0xFFFFFFFFu, BlockSize = 1 << 16;
+    uint32_t count = (uint32_t) vertices.size();
+
+    uint32_t capacity = 16;
+    while (capacity < 2 * (uint64_t) count)
+        capacity *= 2;
+    uint32_t mask = capacity - 1;
+    std::unique_ptr<std::atomic<uint32_t>[]> table(new std::atomic<uint32_t>[capacity]);
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0u, capacity, BlockSize),
+        [&](const tbb::blocked_range<uint32_t> &range) {
+            for (uint32_t i = range.begin(); i != range.end(); ++i)
+                table[i].store(Empty, std::memory_order_relaxed);
+        });
+
+    /* Insert all face vertices, remembering their slots in 'indices' */
+    indices.resize(count);
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0u, count, BlockSize),
+        [&](const tbb::blocked_range<uint32_t> &range) {
+            for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                uint32_t slot = hashVertex(vertices[i]) & mask;
+                while (true) {
+                    uint32_t owner = table[slot].load(std::memory_order_relaxed);
+                    if (owner == Empty && table[slot].compare_exchange_strong(owner, i))
+                        break;
+                    if (vertices[owner] == vertices[i]) {
+                        while (i < owner && !table[slot].compare_exchange_weak(owner, i))
+                            ;
+                        break;
                     }
+                    slot = (slot + 1) & mask;
                 }
+                indices[i] = slot;
             }
+        });
+
+    /* Number the first occurrences in order */
+    uint32_t blockCount = (count + BlockSize - 1) / BlockSize;
+    std::vector<uint32_t> blockOffset(blockCount + 1, 0);
+    tbb::parallel_for(0u, blockCount, [&](uint32_t b) {
+        for (uint32_t i = b * BlockSize, end = std::min(i + BlockSize, count); i < end; ++i)
+            blockOffset[b + 1] += table[indices[i]].load(std::memory_order_relaxed) == i ? 1 : 0;
+    });
+    for (uint32_t b = 0; b < blockCount; ++b)
+        blockOffset[b + 1] += blockOffset[b];
+
+    firsts.resize(blockOffset[blockCount]);
+    tbb::parallel_for(0u, blockCount, [&](uint32_t b) {
+        uint32_t offset = blockOffset[b];
+        for (uint32_t i = b * BlockSize, end = std::min(i + BlockSize, count); i < end; ++i) {
+            if (table[indices[i]].load(std::memory_order_relaxed) == i)
+                firsts[offset++] = i;
         }
+    });
 
-        m_F.resize(3, indices.size()/3);
-        memcpy(m_F.data(), indices.data(), sizeof(uint32_t)*indices.size());
+    /* Replace the owners by the vertex numbers, and resolve the slots */
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0u, (uint32_t) firsts.size(), BlockSize),
+        [&](const tbb::blocked_range<uint32_t> &range) {
+            for (uint32_t v = range.begin(); v != range.end(); ++v)
+                table[indices[firsts[v]]].store(v, std::memory_order_relaxed);
+        });
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0u, count, BlockSize),
+        [&](const tbb::blocked_range<uint32_t> &range) {
+            for (uint32_t i = range.begin(); i != range.end(); ++i)
+                indices[i] = table[indices[i]].load(std::memory_order_relaxed);
+        });
+}
+
+/// The parts of an MTL material that are used by Nori
+struct MTLMaterial {
+    std::string name;
+    Color3f kd = Color3f(0.5f); ///< Diffuse color
+    Color3f ks = Color3f(0.f);  ///< Specular color
+    float ns = 0.f;             ///< Phong exponent
+    float ni = 0.f;             ///< Index of refraction (0 if unspecified)
+    std::string mapKd;          ///< Diffuse texture (relative to the file resolver)
+};
 
-        m_V.resize(3, vertices.size());
-        for (uint32_t i=0; i<vertices.size(); ++i)
-            m_V.col(i) = positions.at(vertices[i].p-1);
+/// Prepend \c directory to a relative path
+static std::string relativeTo(const filesystem::path &directory, const std::string &name) {
+    filesystem::path path(name);
+    if (path.is_absolute() || directory.empty())
+        return name;
+    return (directory / path).str();
+}
 
-        if (!normals.empty()) {
-            m_N.resize(3, vertices.size());
-            for (uint32_t i=0; i<vertices.size(); ++i)
-                m_N.col(i) = normals.at(vertices[i].n-1);
+/// Resolve a path that may also be absolute
+static filesystem::path resolvePath(const std::string &name) {
+    filesystem::path path(name);
+    return path.is_absolute() ? path : getFileResolver()->resolve(path);
+}
+
+/// Read the materials of an MTL file (statements other than the ones of \ref MTLMaterial are ignored)
+static void readMTL(const filesystem::path &filename, const filesystem::path &directory,
+                    std::vector<MTLMaterial> &materials) {
+    std::ifstream is(filename.str());
+    if (is.fail())
+        throw NoriException("Unable to open MTL file \"%s\"!", filename);
+
+    std::string line_str;
+    while (std::getline(is, line_str)) {
+        std::istringstream line(line_str);
+
+        std::string prefix;
+        line >> prefix;
+
+        if (prefix == "newmtl") {
+            materials.emplace_back();
+            line >> materials.back().name;
+            continue;
+        } else if (materials.empty()) {
+            continue;
         }
 
-        if (!texcoords.empty()) {
-            m_UV.resize(2, vertices.size());
-            for (uint32_t i=0; i<vertices.size(); ++i)
-                m_UV.col(i) = texcoords.at(vertices[i].uv-1);
+        MTLMaterial &material = materials.back();
+        if (prefix == "Kd")
+            line >> material.kd.r() >> material.kd.g() >> material.kd.b();
+        else if (prefix == "Ks")
+            line >> material.ks.r() >> material.ks.g() >> material.ks.b();
+        else if (prefix == "Ns")
+            line >> material.ns;
+        else if (prefix == "Ni")
+            line >> material.ni;
+        else if (prefix == "map_Kd") {
+            /* The file name is the last token (options may precede it) */
+            std::string token;
+            while (line >> token)
+                material.mapKd = relativeTo(directory, token);
+        }
+    }
+}
+
+/**
+ * \brief Create the BSDF of an MTL material
+ *
+ * Materials with a specular color become \c microfacet BSDFs, whose
+ * roughness follows from the Phong exponent (alpha = sqrt(2 / (Ns + 2))).
+ * All others become \c diffuse BSDFs, textured if there is a \c map_Kd.
+ */
+static BSDF *createBSDF(const MTLMaterial &material) {
+    PropertyList propList;
+    std::string type;
+    if (material.ks.maxCoeff() > 0.f) {
+        type = "microfacet";
+        propList.setColor("kd", material.kd);
+        propList.setFloat("alpha", clamp(std::sqrt(2.f / (material.ns + 2.f)), 0.01f, 1.f));
+        if (material.ni > 1.f)
+            propList.setFloat("intIOR", material.ni);
+    } else {
+        type = "diffuse";
+        propList.setColor("albedo", material.kd);
+        if (!material.mapKd.empty())
+            propList.setString("path", material.mapKd);
+    }
+    BSDF *bsdf = static_cast<BSDF *>(NoriObjectFactory::createInstance(type, propList));
+    bsdf->activate();
+    return bsdf;
+}
+
+/**
+ * \brief Loader for Wavefront OBJ triangle meshes
+ *
+ * The materials referenced by \c usemtl statements are read from the
+ * \c mtllib files and assigned per triangle (see \ref Mesh::getBSDF(uint32_t)),
+ * unless the mesh has a BSDF in the scene description, which then
+ * applies to the whole mesh as before.
+ */
+class WavefrontOBJ : public Mesh {
+public:
+    WavefrontOBJ(const PropertyList &propList) {
+        m_filename = getFileResolver()->resolve(propList.getString("filename"));
+        m_directory = filesystem::path(propList.getString("filename")).parent_path();
+        m_trafo = propList.getTransform("toWorld", Transform());
+
+        /* Keyframes of a moving mesh: the transforms "toWorld1",
+           "toWorld2", .. and/or OBJ files with the vertex positions (and
+           normals) of the keyframes after the first. Missing transforms
+           default to "toWorld", and missing files to this mesh */
+        std::vector<Transform> keyframeTrafos;
+        for (int k = 1; propList.has(tfm::format("toWorld%i", k)); ++k)
+            keyframeTrafos.push_back(propList.getTransform(tfm::format("toWorld%i", k)));
+        std::vector<std::string> keyframeFiles;
+        if (propList.has("keyframes"))
+            keyframeFiles = tokenize(propList.getString("keyframes"));
+        size_t keyframeCount = std::max(keyframeTrafos.size(), keyframeFiles.size());
+
+        m_name = m_filename.str();
+        m_id = propList.getString("id", "");
+        m_quantize = propList.getBoolean("quantize", false);
+        m_lazy = propList.getBoolean("lazy", false);
+
+        if (m_lazy) {
+            if (keyframeCount > 0)
+                throw NoriException("The moving mesh \"%s\" cannot be loaded lazily!", m_filename);
+            readBounds();
+            return;
+        }
+
+        cout << "Loading \"" << m_filename << "\" .. ";
+        cout.flush();
+        Timer timer;
+
+        OBJData data;
+        std::vector<uint32_t> firsts;
+        readGeometry(data, firsts);
+        uint32_t vertexCount = (uint32_t) firsts.size();
+        bool hasNormals = !data.normals.empty();
+
+        for (size_t k = 0; k < keyframeCount; ++k) {
+            const Transform &keyframeTrafo = k < keyframeTrafos.size() ? keyframeTrafos[k] : m_trafo;
+            const OBJData *keyframe = &data;
+            OBJData keyframeData;
+            if (k < keyframeFiles.size()) {
+                filesystem::path keyframeName = getFileResolver()->resolve(keyframeFiles[k]);
+                MappedFile keyframeFile(keyframeName.str());
+                if (!keyframeFile.isOpen())
+                    throw NoriException("Unable to open OBJ file \"%s\"!", keyframeName);
+                parseOBJ(keyframeFile, keyframeData, false);
+                if (keyframeData.positions.size() != data.positions.size() ||
+                    keyframeData.normals.size() != data.normals.size())
+                    throw NoriException("The keyframe \"%s\" does not match the vertices of \"%s\"!",
+                                        keyframeName, m_filename);
+                keyframe = &keyframeData;
+            }
+
+            MatrixXf V(3, vertexCount);
+            for (uint32_t i=0; i<vertexCount; ++i) {
+                V.col(i) = keyframeTrafo * Point3f(keyframe->positions[data.vertices[firsts[i]].p-1]);
+                m_bbox.expandBy(V.col(i));
+            }
+            m_keyframeV.push_back(std::move(V));
+
+            if (hasNormals) {
+                MatrixXf N(3, vertexCount);
+                for (uint32_t i=0; i<vertexCount; ++i)
+                    N.col(i) = (keyframeTrafo * Normal3f(keyframe->normals[data.vertices[firsts[i]].n-1])).normalized();
+                m_keyframeN.push_back(std::move(N));
+            }
         }
 
-        m_name = filename.str();
-        cout << "done. (V=" << m_V.cols() << ", F=" << m_F.cols() << ", took "
-             << timer.elapsedString() << " and "
+        cout << "done. (V=" << m_V.cols() << ", F=" << m_F.cols();
+        if (isMoving())
+            cout << ", " << getKeyframeCount() << " keyframes";
+        cout << ", took " << timer.elapsedString() << " and "
              << memString(m_F.size() * sizeof(uint32_t) +
-                          sizeof(float) * (m_V.size() + m_N.size() + m_UV.size()))
+                          sizeof(float) * (getKeyframeCount() * (m_V.size() + m_N.size()) + m_UV.size()))
              << ")" << endl;
     }
 
+    void activate() {
+        /* Only use the materials of the OBJ file if the scene does not assign a BSDF */
+        m_useMaterials = m_bsdf == nullptr;
+        if (m_useMaterials && !m_materialSwitches.empty()) {
+            loadMaterials();
+            assignMaterials();
+        }
+        Mesh::activate();
+    }
+
 protected:
-    /// Vertex indices used by the OBJ format
-    struct OBJVertex {
-        uint32_t p = (uint32_t) -1;
-        uint32_t n = (uint32_t) -1;
-        uint32_t uv = (uint32_t) -1;
+    /// Determine the bounding box of a lazy mesh from the vertex positions alone
+    void readBounds() {
+        cout << "Reading the bounds of \"" << m_filename << "\" .. ";
+        cout.flush();
+        Timer timer;
 
-        inline OBJVertex() { }
+        MappedFile file(m_filename.str());
+        if (!file.isOpen())
+            throw NoriException("Unable to open OBJ file \"%s\"!", m_filename);
+        OBJData data;
+        parseOBJ(file, data, false);
+        for (const Vector3f &p : data.positions)
+            m_bbox.expandBy(m_trafo * Point3f(p));
 
-        inline OBJVertex(const std::string &string) {
-            std::vector<std::string> tokens = tokenize(string, "/", true);
+        cout << "done. (" << data.positions.size() << " positions, took "
+             << timer.elapsedString() << ", loaded on demand)" << endl;
+    }
 
-            if (tokens.size() < 1 || tokens.size() > 3)
-                throw NoriException("Invalid vertex data: \"%s\"", string);
+    /**
+     * \brief Read the faces and vertex attributes
+     *
+     * \c data receives the parsed file and \c firsts the position in
+     * <tt>data.vertices</tt> of the first occurrence of every vertex.
+     */
+    void readGeometry(OBJData &data, std::vector<uint32_t> &firsts) {
+        MappedFile file(m_filename.str());
+        if (!file.isOpen())
+            throw NoriException("Unable to open OBJ file \"%s\"!", m_filename);
 
-            p = toUInt(tokens[0]);
+        parseOBJ(file, data, true);
 
-            if (tokens.size() >= 2 && !tokens[1].empty())
-                uv = toUInt(tokens[1]);
+        std::vector<uint32_t> indices;
+        mergeVertices(data.vertices, indices, firsts);
+        uint32_t vertexCount = (uint32_t) firsts.size();
 
-            if (tokens.size() >= 3 && !tokens[2].empty())
-                n = toUInt(tokens[2]);
+        /* Check the references of the merged vertices */
+        bool hasTexcoords = !data.texcoords.empty(), hasNormals = !data.normals.empty();
+        for (uint32_t first : firsts) {
+            const OBJVertex &v = data.vertices[first];
+            if (v.p - 1 >= data.positions.size() ||
+                (hasTexcoords && v.uv - 1 >= data.texcoords.size()) ||
+                (hasNormals && v.n - 1 >= data.normals.size()))
+                throw NoriException("OBJ file \"%s\" references a missing vertex, "
+                                    "texture coordinate or normal!", m_filename);
         }
 
-        inline bool operator==(const OBJVertex &v) const {
-            return v.p == p && v.n == n && v.uv == uv;
+        m_F.resize(3, indices.size()/3);
+        memcpy(m_F.data(), indices.data(), sizeof(uint32_t)*indices.size());
+
+        /* Remember the materials, which are only loaded by activate() if needed */
+        m_materialLibraries.clear();
+        m_materialSwitches.clear();
+        for (const std::string &library : data.materialLibraries)
+            m_materialLibraries.push_back(relativeTo(m_directory, library));
+        for (const auto &materialSwitch : data.materialSwitches)
+            m_materialSwitches.emplace_back((uint32_t) (materialSwitch.first / 3), materialSwitch.second);
+
+        /* Transform the positions and normals */
+        std::vector<Vector3f> positions(data.positions.size()), normals(data.normals.size());
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, positions.size(), 1 << 16),
+            [&](const tbb::blocked_range<size_t> &range) {
+                for (size_t i = range.begin(); i != range.end(); ++i)
+                    positions[i] = m_trafo * Point3f(data.positions[i]);
+            });
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, normals.size(), 1 << 16),
+            [&](const tbb::blocked_range<size_t> &range) {
+                for (size_t i = range.begin(); i != range.end(); ++i)
+                    normals[i] = (m_trafo * Normal3f(data.normals[i])).normalized();
+            });
+
+        /* The box of a lazy mesh is already known (and possibly in use) */
+        if (!m_lazy) {
+            for (const Vector3f &p : positions)
+                m_bbox.expandBy(Point3f(p));
         }
-    };
 
-    /// Hash function for OBJVertex
-    struct OBJVertexHash {
-        std::size_t operator()(const OBJVertex &v) const {
-            size_t hash = std::hash<uint32_t>()(v.p);
-            hash = hash * 37 + std::hash<uint32_t>()(v.uv);
-            hash = hash * 37 + std::hash<uint32_t>()(v.n);
-            return hash;
+        m_V.resize(3, vertexCount);
+        if (hasNormals)
+            m_N.resize(3, vertexCount);
+        if (hasTexcoords)
+            m_UV.resize(2, vertexCount);
+        tbb::parallel_for(tbb::blocked_range<uint32_t>(0u, vertexCount, 1 << 16),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                    const OBJVertex &v = data.vertices[firsts[i]];
+                    m_V.col(i) = positions[v.p-1];
+                    if (hasNormals)
+                        m_N.col(i) = normals[v.n-1];
+                    if (hasTexcoords)
+                        m_UV.col(i) = data.texcoords[v.uv-1];
+                }
+            });
+    }
+
+    void loadGeometry() {
+        OBJData data;
+        std::vector<uint32_t> firsts;
+        readGeometry(data, firsts);
+
+        /* The BSDFs are created on the first load and kept when the
+           geometry is released, since intersections may refer to them */
+        if (m_useMaterials && !m_materialSwitches.empty()) {
+            if (!m_materialsLoaded)
+                loadMaterials();
+            assignMaterials();
         }
-    };
+    }
+
+    /// Create the BSDFs of the materials in the MTL files
+    void loadMaterials() {
+        for (const std::string &library : m_materialLibraries) {
+            filesystem::path path = resolvePath(library);
+            if (!path.exists()) {
+                cerr << "Warning: the MTL file \"" << library << "\" of \"" << m_name
+                     << "\" does not exist!" << endl;
+                continue;
+            }
+            std::vector<MTLMaterial> materials;
+            readMTL(path, filesystem::path(library).parent_path(), materials);
+
+            /* The first definition of a name wins */
+            for (const MTLMaterial &material : materials) {
+                if (m_materialIds.find(material.name) != m_materialIds.end())
+                    continue;
+                if (m_materials.size() >= 0xFFFF)
+                    throw NoriException("OBJ file \"%s\" has too many materials!", m_name);
+                m_materials.push_back(createBSDF(material));
+                m_materialIds[material.name] = (uint16_t) m_materials.size();
+            }
+        }
+        m_materialsLoaded = true;
+        if (!m_lazy)
+            cout << "Loaded " << m_materials.size() << " materials for \"" << m_name << "\"" << endl;
+    }
+
+    /// Assign the materials of the \c usemtl statements to the triangles
+    void assignMaterials() {
+        /* Triangles before the first usemtl statement, and those of
+           unknown materials, use the default BSDF */
+        m_faceMaterials.assign(getTriangleCount(), 0);
+        for (size_t i = 0; i < m_materialSwitches.size(); ++i) {
+            auto it = m_materialIds.find(m_materialSwitches[i].second);
+            if (it == m_materialIds.end()) {
+                /* Lazy meshes assign their materials on every load, but only warn once */
+                if (!m_materialsAssigned)
+                    cerr << "Warning: OBJ file \"" << m_name << "\" uses the unknown material \""
+                         << m_materialSwitches[i].second << "\"!" << endl;
+                continue;
+            }
+            uint32_t end = i + 1 < m_materialSwitches.size() ? m_materialSwitches[i + 1].first
+                                                             : getTriangleCount();
+            std::fill(m_faceMaterials.begin() + m_materialSwitches[i].first,
+                      m_faceMaterials.begin() + end, it->second);
+        }
+        m_materialsAssigned = true;
+    }
+
+protected:
+    filesystem::path m_filename;  ///< Resolved path of the OBJ file
+    filesystem::path m_directory; ///< Directory of the OBJ file (relative to the file resolver)
+    Transform m_trafo;            ///< Object-to-world transformation
+    bool m_useMaterials = false;  ///< Use the materials of the MTL files?
+    bool m_materialsLoaded = false; ///< Were the BSDFs of the materials created?
+    bool m_materialsAssigned = false; ///< Were the materials assigned to the triangles before?
+    std::vector<std::string> m_materialLibraries; ///< MTL files (relative to the file resolver)
+    std::vector<std::pair<uint32_t, std::string>> m_materialSwitches; ///< \c usemtl statements (first triangle, name)
+    std::map<std::string, uint16_t> m_materialIds; ///< 1 + index into \ref m_materials of every material name
 };
 
 NORI_REGISTER_CLASS(WavefrontOBJ, "obj");
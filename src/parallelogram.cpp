@@ -69,6 +69,7 @@ public:
         m_bbox.expandBy(v1);
         m_bbox.expandBy(v2);
         m_bbox.expandBy(v3);
+        m_id = propList.getString("id", "");
 
         m_name = tfm::format(
                 "Parallelogram[name = %s, \n"
@@ -67,6 +67,7 @@ NoriObject *loadFromXML(const std::string &filename) {
         ESampler              = NoriObject::ESampler,
         ETest                 = NoriObject::ETest,
         EReconstructionFilter = NoriObject::EReconstructionFilter,
+        EInstance             = NoriObject::EInstance,
 
         /* Properties */
         EBoolean = NoriObject::EClassTypeCount,
@@ -99,6 +100,7 @@ NoriObject *loadFromXML(const std::string &filename) {
     tags["sampler"]    = ESampler;
     tags["rfilter"]    = EReconstructionFilter;
     tags["test"]       = ETest;
+    tags["instance"]   = EInstance;
     tags["boolean"]    = EBoolean;
     tags["integer"]    = EInteger;
     tags["float"]      = EFloat;
@@ -170,6 +172,8 @@ NoriObject *loadFromXML(const std::string &filename) {
 
         if (tag == EScene)
             node.append_attribute("type") = "scene";
+        else if (tag == EInstance && !node.attribute("type"))
+            node.append_attribute("type") = "instance";
         else if (tag == ETransform)
             transform.setIdentity();
 
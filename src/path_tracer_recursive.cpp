@@ -81,7 +81,7 @@ public:
                 n - 1);
             const Mesh* mesh = meshes[index[indexRandom]];
             const Emitter* light = mesh->getEmitter();
-            EmitterQueryRecord lRec(its.p);
+            EmitterQueryRecord lRec(its.p, its.geoFrame.n, its.pError, its.time);
             Color3f Li = light->sample(mesh, lRec, sampler) * n;
             float pdfLightSource = light->pdf(mesh, lRec);
             if (!scene->rayIntersect(lRec.shadowRay))
@@ -90,8 +90,8 @@ public:
 
                 bRec.uv = its.uv;
 
-                Color3f fr = its.mesh->getBSDF()->eval(bRec);
-                float pdfBSDR = its.mesh->getBSDF()->pdf(bRec);
+                Color3f fr = its.bsdf->eval(bRec);
+                float pdfBSDR = its.bsdf->pdf(bRec);
                 float weigthLightSource = pdfBSDR + pdfLightSource > 0.0f ? pdfLightSource / (pdfBSDR + pdfLightSource) : pdfBSDR;
                 color += Li * fr * weigthLightSource * t;
             }
@@ -110,10 +110,10 @@ public:
             
             BSDFQueryRecord bRec(its.shFrame.toLocal(-pathRay.d));
             bRec.uv = its.uv;
-            Color3f f = its.mesh->getBSDF()->sample(bRec, sampler->next2D());
+            Color3f f = its.bsdf->sample(bRec, sampler->next2D());
             t *= f;
-            pathRay = Ray3f(its.p, its.toWorld(bRec.wo));
-            float pdfBSDR = its.mesh->getBSDF()->pdf(bRec);
+            pathRay = its.spawnRay(its.toWorld(bRec.wo));
+            float pdfBSDR = its.bsdf->pdf(bRec);
             Point3f origin = its.p;
             if (!scene->rayIntersect(pathRay, its))
             {
@@ -174,14 +174,14 @@ public:
                 n - 1);
             const Mesh* mesh = meshes[index[indexRandom]];
             const Emitter* light = mesh->getEmitter();
-            EmitterQueryRecord lRec(its.p);
+            EmitterQueryRecord lRec(its.p, its.geoFrame.n, its.pError, its.time);
             Color3f Li = light->sample(mesh, lRec, sampler) * n;
             float pdfLightSource = light->pdf(mesh, lRec);
             if (!scene->rayIntersect(lRec.shadowRay))
             {
                 BSDFQueryRecord bRec(its.toLocal(-pathRay.d), its.toLocal(lRec.d), ESolidAngle);
-                Color3f fr = its.mesh->getBSDF()->eval(bRec);
-                float pdfBSDR = its.mesh->getBSDF()->pdf(bRec);
+                Color3f fr = its.bsdf->eval(bRec);
+                float pdfBSDR = its.bsdf->pdf(bRec);
                 float weigthLightSource = pdfBSDR + pdfLightSource > 0.0f ? pdfLightSource / (pdfBSDR + pdfLightSource) : pdfBSDR;
                 color += Li * fr * weigthLightSource * t;
             }
@@ -199,10 +199,10 @@ public:
             }
 
             BSDFQueryRecord bRec(its.shFrame.toLocal(-pathRay.d));
-            Color3f f = its.mesh->getBSDF()->sample(bRec, sampler->next2D());
+            Color3f f = its.bsdf->sample(bRec, sampler->next2D());
             t *= f;
-            pathRay = Ray3f(its.p, its.toWorld(bRec.wo));
-            float pdfBSDR = its.mesh->getBSDF()->pdf(bRec);
+            pathRay = its.spawnRay(its.toWorld(bRec.wo));
+            float pdfBSDR = its.bsdf->pdf(bRec);
             Point3f origin = its.p;
             if (!scene->rayIntersect(pathRay, its))
             {
@@ -251,10 +251,10 @@ public:
                 t /= probability;
             }
             BSDFQueryRecord bRec(its.shFrame.toLocal(-pathRay.d));
-            Color3f f = its.mesh->getBSDF()->sample(bRec, sampler->next2D());
+            Color3f f = its.bsdf->sample(bRec, sampler->next2D());
             t *= f;
 
-            pathRay = Ray3f(its.p, its.toWorld(bRec.wo));
+            pathRay = its.spawnRay(its.toWorld(bRec.wo));
             depth++;
         }
         return color;
@@ -47,6 +47,13 @@ public:
         m_nearClip = propList.getFloat("nearClip", 1e-4f);
         m_farClip = propList.getFloat("farClip", 1e4f);
 
+        /* Time interval during which the shutter is open. Moving meshes
+           are keyframed over the times [0, 1]. Default: no motion blur */
+        m_shutterOpen = propList.getFloat("shutterOpen", 0.0f);
+        m_shutterClose = propList.getFloat("shutterClose", 0.0f);
+        if (m_shutterClose < m_shutterOpen)
+            throw NoriException("PerspectiveCamera: the shutter closes before it opens!");
+
         m_rfilter = NULL;
     }
 
@@ -87,7 +94,8 @@ public:
 
     Color3f sampleRay(Ray3f &ray,
             const Point2f &samplePosition,
-            const Point2f &apertureSample) const {
+            const Point2f &apertureSample,
+            float timeSample) const {
         /* Compute the corresponding position on the 
            near plane (in local camera space) */
         Point3f nearP = m_sampleToCamera * Point3f(
@@ -103,6 +111,7 @@ public:
         ray.d = m_cameraToWorld * d;
         ray.mint = m_nearClip * invZ;
         ray.maxt = m_farClip * invZ;
+        ray.time = m_shutterOpen + timeSample * (m_shutterClose - m_shutterOpen);
         ray.update();
 
         return Color3f(1.0f);
@@ -130,6 +139,7 @@ public:
             "  outputSize = %s,\n"
             "  fov = %f,\n"
             "  clip = [%f, %f],\n"
+            "  shutter = [%f, %f],\n"
             "  rfilter = %s\n"
             "]",
             indent(m_cameraToWorld.toString(), 18),
@@ -137,6 +147,8 @@ public:
             m_fov,
             m_nearClip,
             m_farClip,
+            m_shutterOpen,
+            m_shutterClose,
             indent(m_rfilter->toString())
         );
     }
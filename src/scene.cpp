@@ -24,11 +24,75 @@
 #include <nori/sampler.h>
 #include <nori/camera.h>
 #include <nori/emitter.h>
+#include <nori/instance.h>
+#include <filesystem/resolver.h>
 
 NORI_NAMESPACE_BEGIN
 
-Scene::Scene(const PropertyList &) {
+static const char *buildMethodName(Accel::EBuildMethod method) {
+    switch (method) {
+        case Accel::ELBVH: return "lbvh";
+        case Accel::EHLBVH: return "hlbvh";
+        case Accel::ESBVH: return "sbvh";
+        default: return "sah";
+    }
+}
+
+Scene::Scene(const PropertyList &propList) {
     m_accel = new Accel();
+
+    /* Node layout of the BVH: "bvh2" (binary), "bvh4" or "bvh8". The
+       suffix "q" selects quantized child boxes for the wide layouts */
+    std::string accel = propList.getString("accel", "bvh4");
+    if (accel == "bvh4q" || accel == "bvh8q") {
+        m_accel->setCompressed(true);
+        accel.pop_back();
+    }
+    if (accel == "bvh2")
+        m_accel->setLayout(Accel::EBinary);
+    else if (accel == "bvh4")
+        m_accel->setLayout(Accel::EWide4);
+    else if (accel == "bvh8")
+        m_accel->setLayout(Accel::EWide8);
+    else
+        throw NoriException("Scene: unknown acceleration structure \"%s\" (expected \"bvh2\", "
+                            "\"bvh4\", \"bvh8\", \"bvh4q\" or \"bvh8q\")", accel);
+
+    /* BVH construction: "sah", "sbvh" (spatial splits, best quality),
+       or the faster "lbvh" and "hlbvh" */
+    std::string build = propList.getString("build", "sah");
+    if (build == "sah")
+        m_accel->setBuildMethod(Accel::ESAH);
+    else if (build == "lbvh")
+        m_accel->setBuildMethod(Accel::ELBVH);
+    else if (build == "hlbvh")
+        m_accel->setBuildMethod(Accel::EHLBVH);
+    else if (build == "sbvh")
+        m_accel->setBuildMethod(Accel::ESBVH);
+    else
+        throw NoriException("Scene: unknown BVH build method \"%s\" "
+                            "(expected \"sah\", \"sbvh\", \"lbvh\" or \"hlbvh\")", build);
+
+    /* Ray-triangle test: Moeller-Trumbore (default) or the slower
+       watertight test, which never misses the edges between triangles */
+    m_accel->setWatertight(propList.getBoolean("watertight", false));
+
+    /* Directory that caches built BVHs across runs, relative to the
+       scene file. Default: none (always rebuild) */
+    std::string cache = propList.getString("bvhCache", "");
+    if (!cache.empty()) {
+        filesystem::path path(cache);
+        if (!path.is_absolute())
+            path = (*getFileResolver())[0] / path;
+        m_accel->setCacheDirectory(path.str());
+    }
+
+    /* Memory budget (in MiB) of the geometry of the lazy meshes, which
+       are paged in and out on demand. Default: 0 (unlimited) */
+    float budget = propList.getFloat("memoryBudget", 0.f);
+    if (budget < 0)
+        throw NoriException("Scene: the memory budget must not be negative!");
+    m_accel->setMemoryBudget((size_t) ((double) budget * (1 << 20)));
 }
 
 Scene::~Scene() {
@@ -36,6 +100,8 @@ Scene::~Scene() {
     delete m_sampler;
     delete m_camera;
     delete m_integrator;
+    for (auto instance : m_instances)
+        delete instance;
 }
 
 void Scene::activate() {
@@ -64,8 +130,33 @@ void Scene::addChild(NoriObject *obj) {
     switch (obj->getClassType()) {
         case EMesh: {
                 Mesh *mesh = static_cast<Mesh *>(obj);
-                m_accel->addMesh(mesh);
-                m_meshes.push_back(mesh);
+                if (!mesh->getId().empty()) {
+                    /* Shared mesh, only rendered through instances */
+                    if (mesh->isEmitter())
+                        throw NoriException("Scene::addChild(): the shared mesh \"%s\" "
+                                            "cannot be an emitter!", mesh->getId());
+                    if (mesh->isMoving())
+                        throw NoriException("Scene::addChild(): the shared mesh \"%s\" "
+                                            "cannot have keyframes!", mesh->getId());
+                    if (mesh->isLazy())
+                        throw NoriException("Scene::addChild(): the shared mesh \"%s\" "
+                                            "cannot be loaded lazily!", mesh->getId());
+                    m_accel->addSharedMesh(mesh);
+                } else if (mesh->isLazy() && mesh->isEmitter()) {
+                    /* Emitters are sampled before any ray hits them */
+                    throw NoriException("Scene::addChild(): the emitter \"%s\" "
+                                        "cannot be loaded lazily!", mesh->getName());
+                } else {
+                    m_accel->addMesh(mesh);
+                    m_meshes.push_back(mesh);
+                }
+            }
+            break;
+
+        case EInstance: {
+                Instance *instance = static_cast<Instance *>(obj);
+                m_accel->addInstance(instance->getMeshId(), instance->getTransform());
+                m_instances.push_back(instance);
             }
             break;
         
@@ -115,16 +206,25 @@ std::string Scene::toString() const {
 
     return tfm::format(
         "Scene[\n"
+        "  accel = bvh%i%s (%s build%s),\n"
         "  integrator = %s,\n"
         "  sampler = %s\n"
         "  camera = %s,\n"
         "  meshes = {\n"
-        "  %s  }\n"
+        "  %s  },\n"
+        "  instances = %i,\n"
+        "  movingMeshes = %i\n"
         "]",
+        (int) m_accel->getLayout(),
+        m_accel->isCompressed() ? "q" : "",
+        buildMethodName(m_accel->getBuildMethod()),
+        m_accel->isWatertight() ? ", watertight" : "",
         indent(m_integrator->toString()),
         indent(m_sampler->toString()),
         indent(m_camera->toString()),
-        indent(meshes, 2)
+        indent(meshes, 2),
+        m_instances.size(),
+        m_accel->getMovingMeshCount()
     );
 }
 
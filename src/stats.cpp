@@ -0,0 +1,94 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/stats.h>
+#include <tbb/enumerable_thread_specific.h>
+
+NORI_NAMESPACE_BEGIN
+
+/* The records live as long as the program, so that the cached
+   pointers of the threads stay valid after a reset */
+static tbb::enumerable_thread_specific<RayStatistics> &threadStatistics() {
+    static tbb::enumerable_thread_specific<RayStatistics> stats;
+    return stats;
+}
+
+RayStatistics &RayStatistics::operator+=(const RayStatistics &stats) {
+    radianceRays += stats.radianceRays;
+    shadowRays += stats.shadowRays;
+    nodeVisits += stats.nodeVisits;
+    triangleTests += stats.triangleTests;
+    paths += stats.paths;
+    pageIns += stats.pageIns;
+    evictions += stats.evictions;
+    return *this;
+}
+
+RayStatistics RayStatistics::operator-(const RayStatistics &stats) const {
+    RayStatistics result;
+    result.radianceRays = radianceRays - stats.radianceRays;
+    result.shadowRays = shadowRays - stats.shadowRays;
+    result.nodeVisits = nodeVisits - stats.nodeVisits;
+    result.triangleTests = triangleTests - stats.triangleTests;
+    result.paths = paths - stats.paths;
+    result.pageIns = pageIns - stats.pageIns;
+    result.evictions = evictions - stats.evictions;
+    return result;
+}
+
+RayStatistics &RayStatistics::local() {
+    static thread_local RayStatistics *stats = nullptr;
+    if (!stats)
+        stats = &threadStatistics().local();
+    return *stats;
+}
+
+RayStatistics RayStatistics::total() {
+    RayStatistics result;
+    for (const RayStatistics &stats : threadStatistics())
+        result += stats;
+    return result;
+}
+
+void RayStatistics::reset() {
+    for (RayStatistics &stats : threadStatistics())
+        stats = RayStatistics();
+}
+
+std::string RayStatistics::toString() const {
+    auto perRay = [&](uint64_t value) {
+        return rays() > 0 ? (double) value / rays() : 0.0;
+    };
+
+    return tfm::format(
+        "RayStatistics[\n"
+        "  rays = %i (%i radiance, %i shadow),\n"
+        "  nodeVisits = %i (%.2f per ray),\n"
+        "  triangleTests = %i (%.2f per ray),\n"
+        "  paths = %i (average depth %.2f),\n"
+        "  pageIns = %i (%i evictions)\n"
+        "]",
+        rays(), radianceRays, shadowRays,
+        nodeVisits, perRay(nodeVisits),
+        triangleTests, perRay(triangleTests),
+        paths, paths > 0 ? (double) radianceRays / paths : 0.0,
+        pageIns, evictions
+    );
+}
+
+NORI_NAMESPACE_END
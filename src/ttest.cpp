@@ -171,7 +171,9 @@ public:
                     Ray3f ray;
                     Point2f pixelSample = (sampler->next2D().array()
                         * camera->getOutputSize().cast<float>().array()).matrix();
-                    Color3f value = camera->sampleRay(ray, pixelSample, sampler->next2D());
+                    Point2f apertureSample = sampler->next2D();
+                    float timeSample = camera->hasMotionBlur() ? sampler->next1D() : 0.f;
+                    Color3f value = camera->sampleRay(ray, pixelSample, apertureSample, timeSample);
 
                     /* Compute the incident radiance */
                     value *= integrator->Li(scene, sampler, ray);
@@ -89,6 +89,7 @@ public:
                 const Emitter* light = mesh->getEmitter();
 
                 EmitterQueryRecord lRec(mi.p);
+                lRec.time = pathRay.time;
 
                 Color3f Li = light->sample(mesh, lRec, sampler) * n;
                 // std::cout << 222 << std::endl;
@@ -120,7 +121,8 @@ public:
                     }
                 }
 
-                pathRay = Ray3f(mi.p, wo.normalized());
+                pathRay = Ray3f(mi.p, wo.normalized(), Epsilon,
+                                std::numeric_limits<float>::infinity(), pathRay.time);
                 if (scene->rayIntersect(pathRay, its))
                 {
                     if (its.mesh->isEmitter())
@@ -162,7 +164,7 @@ public:
                     n - 1);
                 const Mesh* mesh = meshes[index[indexRandom]];
                 const Emitter* light = mesh->getEmitter();
-                EmitterQueryRecord lRec(its.p);
+                EmitterQueryRecord lRec(its.p, its.geoFrame.n, its.pError, its.time);
                 Color3f Li = light->sample(mesh, lRec, sampler) * n;
                 float pdfLightSource = light->pdf(mesh, lRec);
                 if (!scene->rayIntersect(lRec.shadowRay))
@@ -171,8 +173,8 @@ public:
 
                     bRec.uv = its.uv;
 
-                    Color3f fr = its.mesh->getBSDF()->eval(bRec);
-                    float pdfBSDR = its.mesh->getBSDF()->pdf(bRec);
+                    Color3f fr = its.bsdf->eval(bRec);
+                    float pdfBSDR = its.bsdf->pdf(bRec);
                     float weigthLightSource = pdfBSDR + pdfLightSource > 0.0f ? pdfLightSource / (pdfBSDR + pdfLightSource) : pdfBSDR;
                     mi.tMax = lRec.shadowRay.maxt;
                     color += Li * fr * weigthLightSource * t * medium->Tr(lRec.shadowRay, sampler, mi);
@@ -195,12 +197,12 @@ public:
                 // bsdf
                 BSDFQueryRecord bRec(its.shFrame.toLocal(-pathRay.d));
                 bRec.uv = its.uv;
-                Color3f fr = its.mesh->getBSDF()->sample(bRec, sampler->next2D());
+                Color3f fr = its.bsdf->sample(bRec, sampler->next2D());
                 t *= fr;
 
-                pathRay = Ray3f(its.p, its.toWorld(bRec.wo));
+                pathRay = its.spawnRay(its.toWorld(bRec.wo));
 
-                float pdfBSDR = its.mesh->getBSDF()->pdf(bRec);
+                float pdfBSDR = its.bsdf->pdf(bRec);
 
                 Point3f origin = its.p;
                 if (!scene->rayIntersect(pathRay, its))